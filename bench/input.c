@@ -0,0 +1,234 @@
+#include "emulator.h"
+#include "input.h"
+#include <SDL3/SDL.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KEYS 200
+// A 4 kHz gaming mouse.
+#define MOTION_INTERVAL (SDL_NS_PER_SECOND / 4000)
+// Motion between two key strokes.
+#define MOTION_EVENTS 40
+// Key strokes queued at once, more reports than libch9329 holds.
+#define BURST_KEYS 40
+#define WIDTH 1920
+#define HEIGHT 1080
+
+// What the emulated target saw, written by the emulator thread.
+struct Seen {
+	SDL_AtomicInt key;
+	Uint64 key_at;
+	SDL_AtomicInt presses;
+	SDL_AtomicU32 pointer;
+	SDL_AtomicInt pointer_reports;
+};
+
+static void
+target_changed(
+		const struct EmulatorState *state, enum Ch9329Command command,
+		uint64_t now, void *userdata) {
+	struct Seen *seen = userdata;
+
+	switch (command) {
+	case CH9329_CMD_SEND_KB_GENERAL_DATA:
+		seen->key_at = now;
+		SDL_SetAtomicInt(&seen->key, state->keyboard[2]);
+		if (state->keyboard[2] != 0) {
+			SDL_AddAtomicInt(&seen->presses, 1);
+		}
+		break;
+	case CH9329_CMD_SEND_MS_ABS_DATA:
+		SDL_SetAtomicU32(&seen->pointer, (Uint32)state->y << 16 | state->x);
+		SDL_AddAtomicInt(&seen->pointer_reports, 1);
+		break;
+	default:
+		break;
+	}
+}
+
+static int
+compare(const void *a, const void *b) {
+	const Uint64 x = *(const Uint64 *)a;
+	const Uint64 y = *(const Uint64 *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double
+percentile(const Uint64 *sorted, int count, int percent) {
+	return (double)sorted[(count - 1) * percent / 100] / SDL_NS_PER_MS;
+}
+
+// The pointer goes around a circle.
+static SDL_FPoint
+point(int step) {
+	const float angle = step * 0.01f;
+	return (SDL_FPoint){
+			WIDTH / 2 + SDL_cosf(angle) * HEIGHT / 3,
+			HEIGHT / 2 + SDL_sinf(angle) * HEIGHT / 3,
+	};
+}
+
+// Where the target should end up for a point, the same way input.c maps
+// it onto the grid.
+static Uint32
+grid(SDL_FPoint p) {
+	const Uint16 x = SDL_min(p.x * 4096 / WIDTH, 4095);
+	const Uint16 y = SDL_min(p.y * 4096 / HEIGHT, 4095);
+	return (Uint32)y << 16 | x;
+}
+
+static void
+move(struct Input *input, int step) {
+	SDL_Event event = {.type = SDL_EVENT_MOUSE_MOTION};
+	const SDL_FPoint p = point(step);
+
+	event.motion.x = p.x;
+	event.motion.y = p.y;
+	input_send_input_event(input, &event, false);
+	SDL_DelayNS(MOTION_INTERVAL);
+}
+
+// Sends a key stroke while the pointer keeps moving and measures how long
+// the target took to see it.
+static bool
+stroke(struct Input *input, struct Seen *seen, bool down, int *step,
+	   Uint64 *latency) {
+	SDL_Event event = {.type = down ? SDL_EVENT_KEY_DOWN : SDL_EVENT_KEY_UP};
+	const int expected = down ? SDL_SCANCODE_A : 0;
+	const Uint64 sent_at = emulator_now();
+
+	event.key.scancode = SDL_SCANCODE_A;
+	event.key.down = down;
+	input_send_input_event(input, &event, false);
+	while (SDL_GetAtomicInt(&seen->key) != expected) {
+		if (emulator_now() - sent_at > SDL_NS_PER_SECOND) {
+			SDL_Log("The target never saw the key %s",
+					down ? "go down" : "come up");
+			return false;
+		}
+		move(input, (*step)++);
+	}
+	*latency = seen->key_at - sent_at;
+	return true;
+}
+
+// Queues key strokes faster than the link takes them. Every one of them
+// has to reach the target, and no key may be left held.
+static bool
+burst(struct Input *input, struct Seen *seen) {
+	const int before = SDL_GetAtomicInt(&seen->presses);
+	const Uint64 sent_at = emulator_now();
+	int pressed = 0;
+
+	for (int i = 0; i < BURST_KEYS; i++) {
+		SDL_Event event = {.type = SDL_EVENT_KEY_DOWN};
+
+		event.key.scancode = SDL_SCANCODE_A + i % 26;
+		event.key.down = true;
+		input_send_input_event(input, &event, false);
+		event.type = SDL_EVENT_KEY_UP;
+		event.key.down = false;
+		input_send_input_event(input, &event, false);
+	}
+	while (emulator_now() - sent_at < SDL_NS_PER_SECOND) {
+		pressed = SDL_GetAtomicInt(&seen->presses) - before;
+		if (pressed == BURST_KEYS && SDL_GetAtomicInt(&seen->key) == 0) {
+			break;
+		}
+		SDL_DelayNS(MOTION_INTERVAL);
+	}
+	SDL_Log("%d of %d key strokes queued at once reached the target in "
+			"%.1f ms, %d events dropped",
+			pressed, BURST_KEYS,
+			(double)(emulator_now() - sent_at) / SDL_NS_PER_MS,
+			SDL_GetAtomicInt(&input->dropped));
+	return pressed == BURST_KEYS && SDL_GetAtomicInt(&seen->key) == 0 &&
+			SDL_GetAtomicInt(&input->dropped) == 0;
+}
+
+int
+main(void) {
+	int rv = EXIT_FAILURE;
+	struct Seen seen = {0};
+	// Factory speed, so the benchmark goes through detection and
+	// negotiation like a new device would.
+	struct EmulatorOptions options = {
+			.callback = target_changed,
+			.userdata = &seen,
+	};
+	struct Emulator emulator;
+	static struct Input input;
+	SDL_FRect rect = {0, 0, WIDTH, HEIGHT};
+	static Uint64 latency[KEYS * 2];
+	Uint64 started_at;
+	Uint64 settled_at;
+	double elapsed;
+	int step = 0;
+
+	if (!SDL_Init(SDL_INIT_EVENTS)) {
+		SDL_Log("Couldn't initialize SDL: %s", SDL_GetError());
+		goto out;
+	}
+	if (emulator_start(&emulator, &options) < 0) {
+		SDL_Log("Couldn't start the emulator: %s", strerror(errno));
+		goto quit;
+	}
+	if (!input_init(&input, emulator.path)) {
+		SDL_Log("Couldn't initialize input: %s", SDL_GetError());
+		goto stop;
+	}
+	input_set_rect(&input, &rect);
+	if (!input_start(&input)) {
+		SDL_Log("Couldn't start input: %s", SDL_GetError());
+		goto cleanup;
+	}
+
+	started_at = emulator_now();
+	for (int i = 0; i < KEYS; i++) {
+		for (int j = 0; j < MOTION_EVENTS; j++) {
+			move(&input, step++);
+		}
+		if (!stroke(&input, &seen, true, &step, &latency[i * 2]) ||
+			!stroke(&input, &seen, false, &step, &latency[i * 2 + 1])) {
+			goto cleanup;
+		}
+	}
+	elapsed = (double)(emulator_now() - started_at) / SDL_NS_PER_SECOND;
+
+	// The pointer has to catch up with the last position.
+	settled_at = emulator_now();
+	while (SDL_GetAtomicU32(&seen.pointer) != grid(point(step - 1)) &&
+		   emulator_now() - settled_at < SDL_NS_PER_SECOND) {
+		SDL_DelayNS(MOTION_INTERVAL);
+	}
+
+	qsort(latency, KEYS * 2, sizeof(Uint64), compare);
+	SDL_Log("%d key strokes under %d motion events/s: latency p50 %.3f ms, "
+			"p99 %.3f ms, max %.3f ms",
+			KEYS, (int)(SDL_NS_PER_SECOND / MOTION_INTERVAL),
+			percentile(latency, KEYS * 2, 50),
+			percentile(latency, KEYS * 2, 99),
+			percentile(latency, KEYS * 2, 100));
+	SDL_Log("%d motion events, %d positions reached the target (%.0f/s)",
+			step, SDL_GetAtomicInt(&seen.pointer_reports),
+			SDL_GetAtomicInt(&seen.pointer_reports) / elapsed);
+	rv = SDL_GetAtomicU32(&seen.pointer) == grid(point(step - 1))
+			? EXIT_SUCCESS
+			: EXIT_FAILURE;
+	if (rv != EXIT_SUCCESS) {
+		SDL_Log("The pointer never reached its last position");
+	}
+	if (!burst(&input, &seen)) {
+		SDL_Log("Key strokes were lost in a burst");
+		rv = EXIT_FAILURE;
+	}
+cleanup:
+	input_cleanup(&input);
+stop:
+	emulator_stop(&emulator);
+quit:
+	SDL_Quit();
+out:
+	return rv;
+}
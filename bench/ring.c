@@ -0,0 +1,174 @@
+#include "ring.h"
+#include <SDL3/SDL.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define FRAMES 300
+// A 100 Hz camera.
+#define FRAME_INTERVAL (SDL_NS_PER_SECOND / 100)
+#define WIDTH 1920
+#define HEIGHT 1080
+#define MAX_READERS 16
+
+// What a reader saw, sent back to the producer through a pipe.
+struct Seen {
+	int frames;
+	int torn;
+	Uint64 latency[FRAMES];
+};
+
+static int
+compare(const void *a, const void *b) {
+	const Uint64 x = *(const Uint64 *)a;
+	const Uint64 y = *(const Uint64 *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double
+percentile(const Uint64 *sorted, int count, int percent) {
+	return (double)sorted[(count - 1) * percent / 100] / SDL_NS_PER_US;
+}
+
+// Waits for every frame and measures how long after it was published the
+// reader woke up to it.
+static int
+reader(const char *name, int ready, int results) {
+	static struct Seen seen;
+	struct RingReader ring;
+	struct RingFrame frame;
+	const char one = 1;
+
+	if (!ring_open(&ring, name)) {
+		SDL_Log("Couldn't open %s: %s", name, SDL_GetError());
+		return EXIT_FAILURE;
+	}
+	if (write(ready, &one, 1) != 1) {
+		return EXIT_FAILURE;
+	}
+	while (ring_wait(&ring, 1000) > 0 && ring_latest(&ring, &frame)) {
+		const Uint64 woke = ring_now();
+		Uint64 sequence;
+
+		// The producer stamps every frame, check it arrived whole.
+		SDL_memcpy(&sequence, frame.pixels, sizeof(sequence));
+		if (!ring_frame_valid(&frame) || sequence != frame.sequence) {
+			seen.torn++;
+		} else if (seen.frames < FRAMES) {
+			seen.latency[seen.frames++] = woke - frame.published;
+		}
+		if (frame.sequence == FRAMES) {
+			break;
+		}
+	}
+	ring_close(&ring);
+	return write(results, &seen, sizeof(seen)) == sizeof(seen)
+			? EXIT_SUCCESS
+			: EXIT_FAILURE;
+}
+
+static bool
+run(int readers) {
+	static Uint64 publishing[FRAMES];
+	static Uint64 latency[FRAMES * MAX_READERS];
+	static struct Seen seen;
+	const int pitch = WIDTH * 3;
+	struct Ring ring;
+	char name[RING_NAME_MAX];
+	int ready[2];
+	int results[2];
+	int frames = 0;
+	int torn = 0;
+	bool rv = false;
+	char byte;
+
+	SDL_snprintf(name, sizeof(name), "/kvsm-bench-%d", (int)getpid());
+	if (!ring_init(&ring, name) || pipe(ready) < 0 || pipe(results) < 0) {
+		SDL_Log("Couldn't set up: %s", SDL_GetError());
+		return false;
+	}
+	// The ring exists once the first frame begins.
+	ring_begin(&ring, WIDTH, HEIGHT, SDL_PIXELFORMAT_RGB24, pitch);
+	ring_abort(&ring);
+
+	for (int i = 0; i < readers; i++) {
+		const pid_t pid = fork();
+		if (pid == 0) {
+			_exit(reader(name, ready[1], results[1]));
+		} else if (pid < 0) {
+			SDL_Log("Couldn't start a reader: %s", strerror(errno));
+			goto out;
+		}
+	}
+	for (int i = 0; i < readers; i++) {
+		if (read(ready[0], &byte, 1) != 1) {
+			goto out;
+		}
+	}
+	// Give the readers the time to go to sleep.
+	SDL_DelayNS(FRAME_INTERVAL);
+
+	for (Uint64 i = 1; i <= FRAMES; i++) {
+		Uint8 *pixels = ring_begin(
+				&ring, WIDTH, HEIGHT, SDL_PIXELFORMAT_RGB24, pitch);
+		Uint64 started_at;
+
+		// Decoding isn't measured here, a stamp is enough.
+		SDL_memcpy(pixels, &i, sizeof(i));
+		started_at = ring_now();
+		ring_commit(&ring, started_at);
+		publishing[i - 1] = ring_now() - started_at;
+		SDL_DelayNS(FRAME_INTERVAL);
+	}
+
+	for (int i = 0; i < readers; i++) {
+		if (read(results[0], &seen, sizeof(seen)) != sizeof(seen)) {
+			SDL_Log("A reader went away");
+			goto out;
+		}
+		SDL_memcpy(&latency[frames], seen.latency,
+				   seen.frames * sizeof(Uint64));
+		frames += seen.frames;
+		torn += seen.torn;
+	}
+
+	if (frames == 0) {
+		SDL_Log("%d readers saw no frames", readers);
+		goto out;
+	}
+	qsort(latency, frames, sizeof(Uint64), compare);
+	qsort(publishing, FRAMES, sizeof(Uint64), compare);
+	SDL_Log("%2d readers: wake-up p50 %.1f us, p99 %.1f us, max %.1f us, "
+			"%d of %d frames seen, %d torn; publishing p50 %.1f us, max "
+			"%.1f us",
+			readers, percentile(latency, frames, 50),
+			percentile(latency, frames, 99),
+			percentile(latency, frames, 100), frames, FRAMES * readers,
+			torn, percentile(publishing, FRAMES, 50),
+			percentile(publishing, FRAMES, 100));
+	rv = torn == 0;
+out:
+	ring_cleanup(&ring);
+	while (wait(NULL) > 0) {
+	}
+	close(ready[0]);
+	close(ready[1]);
+	close(results[0]);
+	close(results[1]);
+	return rv;
+}
+
+int
+main(void) {
+	static const int readers[] = {1, 4, MAX_READERS};
+	int rv = EXIT_SUCCESS;
+
+	for (size_t i = 0; i < SDL_arraysize(readers); i++) {
+		if (!run(readers[i])) {
+			rv = EXIT_FAILURE;
+		}
+	}
+	return rv;
+}
@@ -1,11 +1,48 @@
+#ifndef CAMERA_H
+#define CAMERA_H
 #include <SDL3/SDL.h>
 #include <jpeglib.h>
 #include <stdbool.h>
 
+#include "ring.h"
+
 #define CAMERA_EVENT_CODE (Sint32)'c'
+// Number of unchanged frames after which the camera is considered idle.
+#define CAMERA_IDLE_FRAMES 30
+// Upper bound in ms for the frame interval while the camera is idle.
+#define CAMERA_IDLE_INTERVAL 250
+// Frames smaller than width * height / CAMERA_BLANK_RATIO bytes are checked
+// for being blank.
+#define CAMERA_BLANK_RATIO 64
+// Maximum spread of the luma DC coefficients of a blank frame.
+#define CAMERA_BLANK_DC_RANGE 2
+// Y, Cb and Cr DC coefficients of a blank frame.
+#define CAMERA_BLANK_COMPONENTS 3
+// Largest downscaling factor libjpeg supports while decoding.
+#define CAMERA_MAX_SCALE 8
+// Automation looks at the luma of every 8x8 block, the DC coefficients of
+// the JPEG frame.
+#define CAMERA_BLOCK_SIZE 8
+// How much the luma of a block must move to count as a change rather than
+// noise of the capture.
+#define CAMERA_CHANGE_LEVEL 6
+
+// A frame handed out to other processes, see camera_export_frame().
+struct CameraFrame {
+	int fd;
+	SDL_PixelFormat format;
+	int width;
+	int height;
+	int pitch;
+	size_t size;
+	Uint64 timestamp;
+	Uint64 seq;
+};
 
 struct Camera {
-	SDL_TimerID timer_id;
+	SDL_Thread *thread;
+	SDL_Semaphore *wakeup;
+	SDL_AtomicInt running;
 	SDL_Mutex *mutex;
 	SDL_Camera *camera;
 	Uint64 timestamp;
@@ -14,20 +51,89 @@ struct Camera {
 	struct jpeg_decompress_struct cinfo;
 	struct jpeg_error_mgr jerr;
 	SDL_CameraSpec spec;
+	Uint32 frame_time;
+	int width;
+	int height;
+	int scale;
+
+	int frame_size;
+	Uint32 frame_hash;
+	int static_frames;
+	bool blank;
+	// The color of the last blank frame, see frame_is_blank().
+	int blank_level[CAMERA_BLANK_COMPONENTS];
+	bool suspended;
+	Uint64 acquired_frames;
+	Uint64 decoded_frames;
+	// Camera timestamp and end of decoding of the frame not uploaded yet,
+	// then of the texture not presented yet, see latency.h.
+	Uint64 captured_at;
+	Uint64 decoded_at;
+	Uint64 uploaded_captured_at;
+	Uint64 uploaded_at;
+
+	// Block luma of the last frame, kept up to date while anybody waits on
+	// the picture. Rows are padded for SIMD loads.
+	SDL_AtomicInt watchers;
+	// Set by camera_cleanup(), which waits for the watchers to leave.
+	bool closing;
+	SDL_Condition *thumb_changed;
+	Uint8 *thumb;
+	int thumb_width;
+	int thumb_height;
+	int thumb_pitch;
+	int thumb_size;
+	Uint32 thumb_hash;
+	Uint64 thumb_seq;
+	bool thumb_valid;
+
+	// The last decoded and compressed frame handed out.
+	struct CameraFrame exported[2];
+	// The control thread's view of the ring, for exports.
+	struct RingReader exporter;
+	// Frames are decoded into this ring while it's enabled.
+	struct Ring ring;
 
 	SDL_Texture *texture;
 };
 
-bool camera_init(struct Camera *camera, const char *camera_name);
+bool camera_init(struct Camera *camera, const char *camera_name, int index);
 
 bool camera_start(struct Camera *camera);
 
 bool camera_size(struct Camera *camera, int *width, int *height);
 
+bool camera_suspend(struct Camera *camera, bool suspend);
+
+bool camera_set_scale(struct Camera *camera, int scale);
+
+bool camera_publish(struct Camera *camera, const char *name);
+
 bool camera_update_texture(struct Camera *camera, SDL_Renderer *renderer);
 
 SDL_Texture *camera_texture(struct Camera *camera);
 
+void camera_presented(struct Camera *camera, Uint64 now);
+
+void camera_watch(struct Camera *camera);
+
+void camera_unwatch(struct Camera *camera);
+
+bool camera_wait_change(
+		struct Camera *camera, const SDL_Rect *region, Sint32 timeout);
+
+bool camera_wait_stable(
+		struct Camera *camera, const SDL_Rect *region, Uint32 stable,
+		Sint32 timeout);
+
+bool camera_find(
+		struct Camera *camera, SDL_Surface *reference, float min_score,
+		Sint32 timeout, SDL_Rect *found, float *score);
+
 void camera_frame_release(struct Camera *camera, SDL_Surface *frame);
 
+int camera_export_frame(
+		struct Camera *camera, bool compressed, struct CameraFrame *out);
+
 bool camera_cleanup(struct Camera *camera);
+#endif
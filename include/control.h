@@ -0,0 +1,158 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+#include <SDL3/SDL.h>
+#include <stdbool.h>
+
+#include "device.h"
+
+// Most input events in one batch.
+#define CONTROL_EVENTS_MAX 256
+// Waits and searches running at once, each on a thread of its own.
+#define CONTROL_JOBS_MAX 16
+// Largest reference image for CONTROL_FIND, in bytes.
+#define CONTROL_REFERENCE_MAX (16 * 1024 * 1024)
+
+// The control socket is a SOCK_SEQPACKET UNIX domain socket, so every
+// request and reply is one message. Requests and replies start with a
+// ControlHeader, in host byte order.
+enum ControlCommand {
+	// Followed by `arg` ControlEvents, queued in order, all or none.
+	// Replied to with a ControlHeader.
+	CONTROL_INPUT = 1,
+	// Replied to with ControlStatus.
+	CONTROL_STATUS,
+	// `arg` is a ControlFrameKind. Replied to with ControlFrame and the
+	// memfd holding the frame, sealed against writes.
+	CONTROL_FRAME,
+	// A ControlWait. Replied to with a ControlHeader once a region of the
+	// picture changed, or with ETIMEDOUT.
+	CONTROL_WAIT_CHANGE,
+	// A ControlWait. Replied to once the region didn't change for `stable`
+	// ms, or with ETIMEDOUT.
+	CONTROL_WAIT_STABLE,
+	// A ControlFind, with a file descriptor of the reference image's pixels
+	// passed along. Replied to with ControlFound once the picture shows the
+	// reference, or with ETIMEDOUT and the best match.
+	CONTROL_FIND,
+};
+
+// Waits and searches take their time. Other requests are answered
+// meanwhile, so their replies may come first. EBUSY means too many are
+// running already, ECANCELED that the device went away.
+
+enum ControlFrameKind {
+	// RGB24 at the scale the tile is shown at.
+	CONTROL_FRAME_DECODED,
+	// MJPG as it came from the camera.
+	CONTROL_FRAME_COMPRESSED,
+};
+
+struct ControlHeader {
+	Uint8 command;
+	// Index of the device, the tiles in order.
+	Uint8 device;
+	// Requests: see ControlCommand. Replies: 0 or an errno value.
+	Uint16 arg;
+};
+
+// An input event the way macros keep it, see struct MacroEvent.
+struct ControlEvent {
+	Uint8 kind;
+	Uint8 rel_mouse;
+	Sint16 code;
+	Sint16 x;
+	Sint16 y;
+};
+
+struct ControlStatus {
+	struct ControlHeader header;
+	// The target enumerated the keyboard and mouse.
+	Uint8 connected;
+	Uint8 num_lock;
+	Uint8 caps_lock;
+	Uint8 scroll_lock;
+};
+
+struct ControlWait {
+	struct ControlHeader header;
+	// In frame pixels, the whole frame if `w` is 0.
+	Sint32 x;
+	Sint32 y;
+	Sint32 w;
+	Sint32 h;
+	// Milliseconds.
+	Uint32 stable;
+	Sint32 timeout;
+};
+
+struct ControlFind {
+	struct ControlHeader header;
+	// An SDL_PixelFormat, of the reference image.
+	Uint32 format;
+	Uint32 width;
+	Uint32 height;
+	Uint32 pitch;
+	// Normalised cross-correlation, 1 being a perfect match.
+	float min_score;
+	// Milliseconds, 0 looks at the current picture only.
+	Sint32 timeout;
+};
+
+struct ControlFound {
+	struct ControlHeader header;
+	// Where the best match is, in frame pixels.
+	Sint32 x;
+	Sint32 y;
+	Sint32 w;
+	Sint32 h;
+	float score;
+};
+
+struct ControlFrame {
+	struct ControlHeader header;
+	// An SDL_PixelFormat.
+	Uint32 format;
+	Uint32 width;
+	Uint32 height;
+	// 0 for compressed frames.
+	Uint32 pitch;
+	Uint64 size;
+	// Nanoseconds, as the camera reported it.
+	Uint64 timestamp;
+	Uint64 sequence;
+};
+
+struct Control {
+	SDL_Thread *thread;
+	int listener;
+	int epoll;
+	// eventfd stopping the control thread.
+	int wakeup;
+	char path[108];
+
+	// Held by the control thread while it works on a device, and by the UI
+	// thread while it connects or disconnects one.
+	SDL_Mutex *mutex;
+	struct Device *devices;
+	int device_count;
+
+	// Connected clients, touched by the control thread only.
+	int *clients;
+	int client_count;
+	int client_capacity;
+	Uint64 requests;
+	Uint64 dropped_clients;
+	// Waits and searches running.
+	SDL_AtomicInt jobs;
+};
+
+bool control_start(
+		struct Control *control, const char *path, struct Device *devices,
+		int device_count);
+
+void control_lock(struct Control *control);
+
+void control_unlock(struct Control *control);
+
+bool control_cleanup(struct Control *control);
+#endif
@@ -0,0 +1,79 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+#include "camera.h"
+#include "input.h"
+
+#define DEVICE_EVENT_CODE (Sint32)'d'
+#define DEVICE_DEFAULT_CAMERA "Openterface: Openterface"
+#define DEVICE_DEFAULT_SERIAL "/dev/ttyUSB0"
+#define DEVICE_NAME_SIZE 128
+#define DEVICE_PATH_SIZE 256
+
+enum DeviceOpenState {
+	DEVICE_OPEN_IDLE,
+	DEVICE_OPEN_PENDING,
+	DEVICE_OPEN_DONE,
+	DEVICE_OPEN_FAILED,
+};
+
+// Where to find the parts of a KVM dongle. usb_path and video_path are only
+// known for devices found through udev.
+struct DeviceInfo {
+	char camera_name[DEVICE_NAME_SIZE];
+	int camera_index;
+	char serial_path[DEVICE_PATH_SIZE];
+	char video_path[DEVICE_PATH_SIZE];
+	char usb_path[DEVICE_PATH_SIZE];
+};
+
+// A KVM dongle: the capture device showing the target's screen and the
+// CH9329 serial port injecting input into it. Devices without a serial port
+// are view-only.
+struct Device {
+	struct DeviceInfo info;
+	struct Camera camera;
+	struct Input input;
+	bool connected;
+	SDL_FRect rect;
+
+	// Camera and serial port are brought up concurrently, each on its own
+	// thread. Both push a DEVICE_EVENT_CODE event when they are done.
+	SDL_Thread *camera_opener;
+	SDL_Thread *input_opener;
+	SDL_AtomicInt camera_state;
+	SDL_AtomicInt input_state;
+	Uint64 camera_open_time;
+	Uint64 input_open_time;
+};
+
+bool device_open_camera(struct Device *device);
+
+bool device_open_input(struct Device *device);
+
+bool device_open(struct Device *device);
+
+bool device_opening(struct Device *device);
+
+bool device_finish_open(struct Device *device);
+
+bool device_has_input(struct Device *device);
+
+bool device_set_rect(struct Device *device, const SDL_FRect *rect);
+
+bool device_visible(struct Device *device);
+
+bool
+device_send_input_event(struct Device *device, SDL_Event *event, bool rel_mouse);
+
+bool device_paste(
+		struct Device *device, const char *text, enum Ch9329Layout layout,
+		int interval);
+
+bool device_record(struct Device *device, const char *path, Uint64 until);
+
+bool device_play(struct Device *device, const char *path, bool fastest);
+
+bool device_play_done(struct Device *device);
+
+bool device_cleanup(struct Device *device);
+#endif
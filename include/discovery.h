@@ -0,0 +1,40 @@
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+#include <SDL3/SDL.h>
+#include <libudev.h>
+#include <stdbool.h>
+
+#include "device.h"
+
+#define DISCOVERY_EVENT_CODE (Sint32)'u'
+
+enum DiscoveryAction {
+	DISCOVERY_ADD,
+	DISCOVERY_REMOVE,
+};
+
+// Pushed as data1 of a DISCOVERY_EVENT_CODE user event. The receiver owns it
+// and has to SDL_free() it.
+struct DiscoveryEvent {
+	enum DiscoveryAction action;
+	// DISCOVERY_ADD: the complete dongle.
+	struct DeviceInfo info;
+	// DISCOVERY_REMOVE: the device node that went away.
+	char devnode[DEVICE_PATH_SIZE];
+};
+
+struct Discovery {
+	struct udev *udev;
+	struct udev_monitor *monitor;
+	int wakeup;
+	SDL_Thread *thread;
+};
+
+bool discovery_init(struct Discovery *discovery);
+
+int discovery_scan(struct Discovery *discovery, struct DeviceInfo *infos, int max);
+
+bool discovery_start(struct Discovery *discovery);
+
+bool discovery_cleanup(struct Discovery *discovery);
+#endif
@@ -1,33 +1,138 @@
+#ifndef INPUT_H
+#define INPUT_H
+#include "macro.h"
 #include <SDL3/SDL.h>
 #include <ch9329.h>
 #include <stdbool.h>
 
 #define INPUT_EVENT_CODE (Sint32)'i'
-#define INPUT_EVENT_RING_SIZE 16
+// Only keys, buttons and relative motion take up slots, absolute motion and
+// wheel are merged.
+#define INPUT_QUEUE_SIZE 256
+// Cursor lag is counted in power of two buckets of grid units: 0, 1, 2-3,
+// up to 2048-4095.
+#define INPUT_LAG_BUCKETS 13
 #define INPUT_KEY_DATA_SIZE 8
 #define INPUT_MOUSE_DATA_SIZE 7
+// Keys and buttons followed through to their acknowledgement.
+#define INPUT_TRACKS CH9329_QUEUE_SIZE
 
 struct InputEvent {
 	SDL_Event event;
 	bool rel_mouse;
+	// Where the pointer was on the 0..4095 grid when a button changed.
+	Uint16 x;
+	Uint16 y;
+	// Whole pixels of relative motion.
+	int dx;
+	int dy;
+	Uint64 enqueued;
 };
 
-struct Input {
-	SDL_Mutex *condition_mutex;
-	SDL_Condition *condition;
+// A key or button report on its way to the target, timed for latency.h.
+struct InputTrack {
+	Uint64 event;
+	Uint64 enqueued;
+	// 0 until the report left in a write to the serial port.
+	Uint64 written;
+	Uint8 command;
+	Uint8 report[CH9329_REPORT_SIZE];
+};
+
+struct InputSlot {
+	// Tells the consumer whether the slot is filled and the producers
+	// whether it's free, see input.c.
+	SDL_AtomicU32 sequence;
+	struct InputEvent item;
+};
+
+// Events that didn't fit into the queue, newest first.
+struct InputOverflow {
+	struct InputOverflow *next;
+	struct InputEvent item;
+};
+
+// Text waiting to be typed.
+struct InputPaste {
+	enum Ch9329Layout layout;
+	int interval;
+	char text[];
+};
 
+struct Input {
 	SDL_Thread *thread;
+	SDL_AtomicInt running;
+	// eventfd waking the input thread up for new events and shutdown.
+	int wakeup;
 
 	SDL_Mutex *mutex;
+	// The LEDs are polled more often right after something may have
+	// changed them, less and less often while nothing does.
 	Uint64 status_interval;
+	Uint64 status_time;
+	bool status_pending;
+	// When a lock key went down, until the LEDs follow.
+	Uint64 lock_key_time;
+	Uint64 status_since;
+	Uint64 status_polls;
+	Uint64 status_changes;
+	Uint64 status_latency_count;
+	Uint64 status_latency_total;
+	Uint64 status_latency_max;
 	struct Ch9329 hid;
 	struct Ch9329Frame hid_status;
 
 	SDL_FRect rect;
-	struct InputEvent event_ring[INPUT_EVENT_RING_SIZE];
-	int event_ring_last_head;
-	int event_ring_head;
-	int event_ring_tail;
+	// Lock-free queue from any number of producers to the input thread.
+	struct InputSlot queue[INPUT_QUEUE_SIZE];
+	SDL_AtomicU32 queue_head;
+	Uint32 queue_tail;
+	void *overflow;
+	// Overflow taken by the input thread that didn't fit into the library's
+	// queue yet, oldest first.
+	struct InputOverflow *backlog;
+	// Only the latest pointer position matters: valid bit, y and x.
+	SDL_AtomicU32 motion;
+	// Same, but left alone by the input thread.
+	SDL_AtomicU32 pointer;
+	// Wheel, motion and status reports not acknowledged yet. Only one of
+	// them may be in flight, so a key never waits for more than one
+	// transaction. Motion goes out as fast as the link turns it around.
+	int background;
+	Uint64 motion_sent_at;
+	// Smoothed round-trip time of absolute reports, in nanoseconds.
+	Uint64 motion_rtt;
+	// How far the pointer had moved on when a position was acknowledged.
+	Uint32 lag_histogram[INPUT_LAG_BUCKETS];
+	// Keys and buttons not acknowledged yet, oldest first.
+	struct InputTrack tracks[INPUT_TRACKS];
+	int track_head;
+	int track_count;
+	// hid.reports_saved as of the last report done.
+	unsigned long reports_saved;
+	// Fractions of pixels of relative motion, kept by the UI thread.
+	float rel_x_fraction;
+	float rel_y_fraction;
+	// Relative motion taken from the queue, but not sent yet.
+	int rel_x;
+	int rel_y;
+	// Wheel steps not sent yet.
+	SDL_AtomicInt wheel;
+	SDL_AtomicInt coalesced;
+	SDL_AtomicInt overflowed;
+	SDL_AtomicInt dropped;
+	SDL_AtomicInt repeats;
+
+	// Handed over by input_paste(), taken by the input thread.
+	void *paste;
+	struct InputPaste *typing;
+	struct Ch9329Typist typist;
+	Uint64 typing_since;
+
+	// Kept by the UI thread as its events come in.
+	struct Macro recording;
+	// Replays a recording from its own thread, straight into the queue.
+	struct MacroPlayer player;
 };
 
 bool input_init(struct Input *input, const char *input_name);
@@ -47,4 +152,23 @@ bool input_set_rect(struct Input *input, SDL_FRect *rect);
 bool
 input_send_input_event(struct Input *input, SDL_Event *event, bool rel_mouse);
 
+bool input_inject(struct Input *input, const struct MacroEvent *event);
+
+bool input_paste(
+		struct Input *input, const char *text, enum Ch9329Layout layout,
+		int interval);
+
+bool input_record_start(struct Input *input);
+
+bool input_recording(struct Input *input);
+
+bool input_record_stop(struct Input *input, const char *path, Uint64 until);
+
+bool input_play(struct Input *input, const char *path, bool fastest);
+
+bool input_playing(struct Input *input);
+
+bool input_play_stop(struct Input *input);
+
 bool input_cleanup(struct Input *input);
+#endif
@@ -0,0 +1,55 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+#include <SDL3/SDL.h>
+#include <stdbool.h>
+
+// Values are kept in nanoseconds, 32 buckets to every power of two, so
+// percentiles come out within 3%.
+#define LATENCY_SUB_BUCKETS 32
+#define LATENCY_BUCKETS (36 * LATENCY_SUB_BUCKETS)
+
+// Where frames and input events spend their time, each stage from the end
+// of the one before. Every device counts towards the same stages.
+enum LatencyStage {
+	// Camera timestamp to SDL_AcquireCameraFrame().
+	LATENCY_CAPTURE,
+	// Acquired to decode start: hashing, blank check, thumbnail.
+	LATENCY_DECODE_WAIT,
+	LATENCY_DECODE,
+	// Decoded to the texture updated, on the UI thread.
+	LATENCY_UPLOAD,
+	// Texture updated to SDL_RenderPresent() returning.
+	LATENCY_PRESENT,
+	// Camera timestamp to present.
+	LATENCY_FRAME,
+	// SDL event timestamp to the input thread's queue.
+	LATENCY_ENQUEUE,
+	// Queued to the report written to the serial port.
+	LATENCY_WRITE,
+	// Written to acknowledged by the CH9329.
+	LATENCY_ACK,
+	// SDL event timestamp to acknowledged.
+	LATENCY_INPUT,
+	LATENCY_STAGE_COUNT,
+};
+
+// Lock-free, any thread may record into any stage.
+struct LatencyHistogram {
+	SDL_AtomicInt buckets[LATENCY_BUCKETS];
+	SDL_AtomicInt count;
+	// Microseconds.
+	SDL_AtomicU32 max;
+};
+
+void latency_record(enum LatencyStage stage, Uint64 start, Uint64 end);
+
+const char *latency_stage_name(enum LatencyStage stage);
+
+int latency_count(enum LatencyStage stage);
+
+Uint64 latency_percentile(enum LatencyStage stage, double percent);
+
+Uint64 latency_max(enum LatencyStage stage);
+
+bool latency_dump(const char *path);
+#endif
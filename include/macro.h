@@ -0,0 +1,82 @@
+#ifndef MACRO_H
+#define MACRO_H
+#include <SDL3/SDL.h>
+#include <stdbool.h>
+
+#define MACRO_EVENT_CODE (Sint32)'m'
+
+enum MacroKind {
+	MACRO_KEY_DOWN,
+	MACRO_KEY_UP,
+	MACRO_BUTTON_DOWN,
+	MACRO_BUTTON_UP,
+	MACRO_MOTION,
+	MACRO_WHEEL,
+	MACRO_KIND_COUNT
+};
+
+// An input event as recorded. Positions are on the 0..4095 grid of the
+// target, so a macro replays the same in a window of any size.
+struct MacroEvent {
+	// Nanoseconds since the recording started.
+	Uint64 time;
+	enum MacroKind kind;
+	bool rel_mouse;
+	// Scan code, button, or wheel steps.
+	int code;
+	// Grid position, or relative motion in pixels.
+	int x;
+	int y;
+};
+
+// A recording as it is stored: "KVSM" and a version byte, then for each
+// event the microseconds since the one before, its kind and its arguments,
+// all as variable length integers.
+struct Macro {
+	Uint8 *data;
+	size_t size;
+	size_t capacity;
+	int count;
+	bool recording;
+	Uint64 started_at;
+	Uint64 last_time;
+};
+
+// Sends one event on replay, from the player thread.
+typedef bool (*MacroSend)(void *userdata, const struct MacroEvent *event);
+
+struct MacroPlayer {
+	SDL_Thread *thread;
+	SDL_AtomicInt running;
+	// Deadlines are absolute, so lateness doesn't add up over the macro.
+	int timer;
+	int wakeup;
+	struct Macro macro;
+	bool fastest;
+	MacroSend send;
+	void *userdata;
+};
+
+bool macro_record_start(struct Macro *macro);
+
+bool macro_record(struct Macro *macro, const struct MacroEvent *event);
+
+bool macro_record_stop(struct Macro *macro, Uint64 until);
+
+int macro_next(
+		const struct Macro *macro, size_t *offset, struct MacroEvent *event);
+
+bool macro_save(const struct Macro *macro, const char *path);
+
+bool macro_load(struct Macro *macro, const char *path);
+
+void macro_free(struct Macro *macro);
+
+bool macro_play(
+		struct MacroPlayer *player, struct Macro *macro, bool fastest,
+		MacroSend send, void *userdata);
+
+bool macro_playing(struct MacroPlayer *player);
+
+bool macro_stop(struct MacroPlayer *player);
+#endif
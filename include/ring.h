@@ -0,0 +1,113 @@
+#ifndef RING_H
+#define RING_H
+#include <SDL3/SDL.h>
+#include <stdbool.h>
+
+// The frame ring is a POSIX shared memory object that kvsm decodes frames
+// into and other processes map read-only. It starts with a RingHeader,
+// followed by the slots' pixels, each at a page aligned offset.
+#define RING_MAGIC 0x5253564b // "KVSR"
+#define RING_VERSION 1
+// Frames a reader has time to look at one before it is overwritten: the
+// slots but the one being written.
+#define RING_SLOTS 4
+#define RING_NAME_MAX 64
+
+// A frame, guarded by a sequence lock: `lock` is odd while the slot is
+// written and changes with every frame, so a reader that sees the same
+// even value before and after reading saw the frame whole.
+struct RingSlot {
+	SDL_AtomicU32 lock;
+	// An SDL_PixelFormat.
+	Uint32 format;
+	Uint32 width;
+	Uint32 height;
+	Uint32 pitch;
+	Uint32 reserved;
+	Uint64 size;
+	// Offset of the pixels from the start of the ring.
+	Uint64 offset;
+	// Nanoseconds, as the camera reported it.
+	Uint64 timestamp;
+	// CLOCK_MONOTONIC nanoseconds when the frame was published.
+	Uint64 published;
+	Uint64 sequence;
+};
+
+struct RingHeader {
+	Uint32 magic;
+	Uint32 version;
+	Uint32 slot_count;
+	// Set when kvsm replaced the ring, for a larger frame, or went away.
+	// Readers open the name again.
+	SDL_AtomicU32 closed;
+	Uint64 slot_size;
+	// Frames published so far, the latest one is in slot
+	// (sequence - 1) % slot_count. A futex, woken with every frame.
+	SDL_AtomicU32 sequence;
+	Uint32 reserved;
+	struct RingSlot slots[RING_SLOTS];
+};
+
+// The producer side, owned by the camera thread.
+struct Ring {
+	char name[RING_NAME_MAX];
+	int fd;
+	struct RingHeader *header;
+	size_t size;
+	Uint64 sequence;
+	// Slot being written, or NULL.
+	struct RingSlot *slot;
+};
+
+// A frame in the mapping of a reader. The pixels may be overwritten
+// while they're looked at, see ring_frame_valid().
+struct RingFrame {
+	const Uint8 *pixels;
+	SDL_PixelFormat format;
+	int width;
+	int height;
+	int pitch;
+	size_t size;
+	Uint64 timestamp;
+	Uint64 published;
+	Uint64 sequence;
+	const struct RingSlot *slot;
+	Uint32 lock;
+};
+
+struct RingReader {
+	char name[RING_NAME_MAX];
+	int fd;
+	const struct RingHeader *header;
+	size_t size;
+	// The header sequence of the last frame read.
+	Uint32 seen;
+};
+
+bool ring_init(struct Ring *ring, const char *name);
+
+bool ring_enabled(struct Ring *ring);
+
+Uint8 *ring_begin(
+		struct Ring *ring, int width, int height, SDL_PixelFormat format,
+		int pitch);
+
+void ring_commit(struct Ring *ring, Uint64 timestamp);
+
+void ring_abort(struct Ring *ring);
+
+void ring_cleanup(struct Ring *ring);
+
+bool ring_open(struct RingReader *reader, const char *name);
+
+int ring_wait(struct RingReader *reader, Sint32 timeout);
+
+bool ring_latest(struct RingReader *reader, struct RingFrame *frame);
+
+bool ring_frame_valid(const struct RingFrame *frame);
+
+void ring_close(struct RingReader *reader);
+
+Uint64 ring_now(void);
+#endif
@@ -0,0 +1,73 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <SDL3/SDL.h>
+#include <stdbool.h>
+
+// With KVSM_TRACE set to a file, the threads record when they enter and
+// leave the hot spots, and wait for locks. The timeline is written to the
+// file on exit as a Chrome trace, for chrome://tracing or ui.perfetto.dev.
+#define TRACE_ENV "KVSM_TRACE"
+// Events kept per thread, later ones are dropped.
+#define TRACE_EVENTS 65536
+// Events are kept in chunks of this many, allocated as they fill so that
+// short-lived threads stay cheap.
+#define TRACE_CHUNK 1024
+
+struct TraceEvent {
+	// A string literal.
+	const char *name;
+	Uint64 time;
+	// 'B'egin or 'E'nd.
+	char phase;
+};
+
+struct TraceChunk {
+	// The next struct TraceChunk.
+	void *next;
+	SDL_AtomicInt count;
+	struct TraceEvent events[TRACE_CHUNK];
+};
+
+// Written by its thread only, and read once the threads are done.
+struct TraceBuffer {
+	struct TraceBuffer *next;
+	SDL_ThreadID thread;
+	const char *thread_name;
+	// The first struct TraceChunk.
+	void *first;
+	struct TraceChunk *last;
+	int chunks;
+	int dropped;
+};
+
+// Set once at startup, before any thread records.
+extern bool trace_enabled;
+
+#define TRACE_BEGIN(name)                                                     \
+	do {                                                                      \
+		if (trace_enabled) {                                                  \
+			trace_event(name, 'B');                                           \
+		}                                                                     \
+	} while (0)
+
+#define TRACE_END(name)                                                       \
+	do {                                                                      \
+		if (trace_enabled) {                                                  \
+			trace_event(name, 'E');                                           \
+		}                                                                     \
+	} while (0)
+
+// SDL_LockMutex(), tracing the wait if the mutex is taken.
+#define TRACE_LOCK(mutex, name)                                               \
+	(trace_enabled ? trace_lock(mutex, name) : SDL_LockMutex(mutex))
+
+bool trace_init(void);
+
+void trace_thread(const char *name);
+
+void trace_event(const char *name, char phase);
+
+void trace_lock(SDL_Mutex *mutex, const char *name);
+
+bool trace_save(void);
+#endif
@@ -1,11 +1,49 @@
+// memfd_create().
+#define _GNU_SOURCE
 #include "camera.h"
+#include "latency.h"
+#include "trace.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Spare bytes at the end of every row of block luma, so a SIMD load of
+// 8 bytes never runs past the buffer.
+#define THUMB_PADDING 8
+// Products with the template above which camera_find() searches at half
+// the resolution first, about 10 ms of an unoptimised build.
+#define MATCH_FULL_COST (8 * 1024 * 1024)
+// Places the coarse search looks at more closely.
+#define MATCH_CANDIDATES 8
+
+// Block luma of a frame, or of a reference image.
+struct Luma {
+	Uint8 *pixels;
+	int width;
+	int height;
+	int pitch;
+	Uint64 seq;
+};
+
+// A reference image prepared for normalised cross-correlation.
+struct Template {
+	// Block luma, rows zero padded to a multiple of 8.
+	Uint16 *pixels;
+	int width;
+	int height;
+	int pitch;
+	Uint64 sum;
+	double norm;
+};
 
 static bool
 decode_frame(
 		struct jpeg_decompress_struct *cinfo, SDL_Surface *source,
-		SDL_Surface *target) {
+		SDL_Surface *target, int scale) {
 	JSAMPARRAY buffer;
 	int row_stride;
 
@@ -15,6 +53,11 @@ decode_frame(
 		return false;
 	}
 
+	// libjpeg scales in the IDCT, which is a lot cheaper than decoding the
+	// full frame and scaling it down afterwards.
+	cinfo->scale_num = 1;
+	cinfo->scale_denom = scale;
+
 	jpeg_start_decompress(cinfo);
 
 	if (target->w != (int)cinfo->output_width ||
@@ -40,77 +83,346 @@ decode_frame(
 	return true;
 }
 
+// Also returns the color of a blank frame in `level`: its luma and the
+// chroma of the first block.
+static bool
+frame_is_blank(
+		struct jpeg_decompress_struct *cinfo, SDL_Surface *source,
+		int level[CAMERA_BLANK_COMPONENTS]) {
+	jvirt_barray_ptr *coefficients;
+	jpeg_component_info *luma;
+	JCOEF dc_min = 0, dc_max = 0;
+
+	jpeg_mem_src(cinfo, (unsigned char *)source->pixels, source->pitch);
+	if (jpeg_read_header(cinfo, TRUE) != JPEG_HEADER_OK) {
+		jpeg_abort_decompress(cinfo);
+		return false;
+	}
+
+	// Only entropy decode the frame. The DC coefficient of every luma block
+	// is its average brightness, so a frame is blank if they all match.
+	coefficients = jpeg_read_coefficients(cinfo);
+	luma = &cinfo->comp_info[0];
+	for (JDIMENSION row = 0; row < luma->height_in_blocks; row++) {
+		JBLOCKARRAY blocks = (*cinfo->mem->access_virt_barray)(
+				(j_common_ptr)cinfo, coefficients[0], row, 1, FALSE);
+		for (JDIMENSION col = 0; col < luma->width_in_blocks; col++) {
+			JCOEF dc = blocks[0][col][0];
+			if (row == 0 && col == 0) {
+				dc_min = dc_max = dc;
+			} else if (dc < dc_min) {
+				dc_min = dc;
+			} else if (dc > dc_max) {
+				dc_max = dc;
+			}
+		}
+	}
+	level[0] = (dc_min + dc_max) / 2;
+	for (int i = 1; i < CAMERA_BLANK_COMPONENTS; i++) {
+		level[i] = 0;
+		if (i < cinfo->num_components) {
+			JBLOCKARRAY blocks = (*cinfo->mem->access_virt_barray)(
+					(j_common_ptr)cinfo, coefficients[i], 0, 1, FALSE);
+			level[i] = blocks[0][0][0];
+		}
+	}
+
+	jpeg_finish_decompress(cinfo);
+
+	return dc_max - dc_min <= CAMERA_BLANK_DC_RANGE;
+}
+
+// Whether two blank frames look the same, give or take the noise.
+static bool
+same_color(
+		const int a[CAMERA_BLANK_COMPONENTS],
+		const int b[CAMERA_BLANK_COMPONENTS]) {
+	for (int i = 0; i < CAMERA_BLANK_COMPONENTS; i++) {
+		if (SDL_abs(a[i] - b[i]) > CAMERA_BLANK_DC_RANGE) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Takes the DC coefficient of every luma block, its average brightness, as
+// a picture of an eighth of the size. That only needs entropy decoding.
+// Returns whether the picture is different from the last one.
+static bool
+update_thumbnail(struct Camera *camera, SDL_Surface *source) {
+	struct jpeg_decompress_struct *cinfo = &camera->cinfo;
+	const Uint32 hash = SDL_murmur3_32(source->pixels, source->pitch, 0);
+	jvirt_barray_ptr *coefficients;
+	jpeg_component_info *luma;
+	int quant;
+
+	if (camera->thumb_valid && source->pitch == camera->thumb_size &&
+		hash == camera->thumb_hash) {
+		return false;
+	}
+
+	jpeg_mem_src(cinfo, (unsigned char *)source->pixels, source->pitch);
+	if (jpeg_read_header(cinfo, TRUE) != JPEG_HEADER_OK) {
+		jpeg_abort_decompress(cinfo);
+		return false;
+	}
+	coefficients = jpeg_read_coefficients(cinfo);
+	luma = &cinfo->comp_info[0];
+	if (camera->thumb_width != (int)luma->width_in_blocks ||
+		camera->thumb_height != (int)luma->height_in_blocks) {
+		const int pitch = luma->width_in_blocks + THUMB_PADDING;
+		Uint8 *thumb = SDL_calloc(luma->height_in_blocks, pitch);
+		if (thumb == NULL) {
+			jpeg_abort_decompress(cinfo);
+			return false;
+		}
+		SDL_free(camera->thumb);
+		camera->thumb = thumb;
+		camera->thumb_width = luma->width_in_blocks;
+		camera->thumb_height = luma->height_in_blocks;
+		camera->thumb_pitch = pitch;
+	}
+
+	// The DC coefficient is eight times the average of the block, less 128.
+	quant = luma->quant_table->quantval[0];
+	for (int row = 0; row < camera->thumb_height; row++) {
+		JBLOCKARRAY blocks = (*cinfo->mem->access_virt_barray)(
+				(j_common_ptr)cinfo, coefficients[0], row, 1, FALSE);
+		Uint8 *out = &camera->thumb[row * camera->thumb_pitch];
+		for (int col = 0; col < camera->thumb_width; col++) {
+			const int value = 128 + blocks[0][col][0] * quant / 8;
+			out[col] = SDL_clamp(value, 0, 255);
+		}
+	}
+	jpeg_finish_decompress(cinfo);
+
+	camera->thumb_size = source->pitch;
+	camera->thumb_hash = hash;
+	camera->thumb_seq++;
+	camera->thumb_valid = true;
+	SDL_BroadcastCondition(camera->thumb_changed);
+	return true;
+}
+
+static Uint32
+camera_interval(struct Camera *camera) {
+	TRACE_LOCK(camera->mutex, "camera->mutex");
+	int backoff = camera->static_frames - CAMERA_IDLE_FRAMES;
+	Uint32 interval = camera->frame_time;
+
+	// Whoever waits on the picture wants to know as soon as it changes.
+	if (SDL_GetAtomicInt(&camera->watchers) > 0) {
+		interval = camera->frame_time;
+	} else if (camera->suspended) {
+		interval = CAMERA_IDLE_INTERVAL;
+	} else {
+		// Double the interval for every static tick past the idle threshold.
+		while (backoff-- >= 0 && interval < CAMERA_IDLE_INTERVAL) {
+			interval *= 2;
+		}
+	}
+	SDL_UnlockMutex(camera->mutex);
+	return SDL_min(interval, CAMERA_IDLE_INTERVAL);
+}
+
+// The surface the next frame is decoded to. Published frames go straight
+// into the next slot of the ring, other processes get them without a copy.
+static SDL_Surface *
+frame_target(struct Camera *camera, int width, int height) {
+	const SDL_PixelFormat format = SDL_PIXELFORMAT_RGB24;
+	const int pitch = width * SDL_BYTESPERPIXEL(format);
+	Uint8 *pixels;
+
+	if (ring_enabled(&camera->ring)) {
+		const struct RingHeader *mapping = camera->ring.header;
+
+		pixels = ring_begin(&camera->ring, width, height, format, pitch);
+		// A larger frame got a new ring, the last frame was unmapped with
+		// the old one.
+		if (camera->ring.header != mapping) {
+			SDL_DestroySurface(camera->frame);
+			camera->frame = NULL;
+		}
+		return pixels ? SDL_CreateSurfaceFrom(
+								width, height, format, pixels, pitch)
+					  : NULL;
+	}
+
+	// A frame being exported is left to the exporter.
+	if (camera->frame &&
+		(camera->frame->w != width || camera->frame->h != height ||
+		 camera->frame->refcount > 1)) {
+		SDL_DestroySurface(camera->frame);
+		camera->frame = NULL;
+	}
+	if (!camera->frame) {
+		camera->frame = SDL_CreateSurface(width, height, format);
+	}
+	return camera->frame;
+}
+
 static bool
 update_camera_frame(struct Camera *camera) {
 	bool rv = false;
+	bool blank = false;
+	int level[CAMERA_BLANK_COMPONENTS];
+	SDL_Surface *target;
+	Uint32 hash;
+	int width, height;
 	Uint64 frame_timestamp = 0;
 	SDL_Surface *jpeg_frame =
 			SDL_AcquireCameraFrame(camera->camera, &frame_timestamp);
+	const Uint64 acquired_at = SDL_GetTicksNS();
+	Uint64 decode_start;
+	bool decoded;
 
-	SDL_LockMutex(camera->mutex);
+	TRACE_LOCK(camera->mutex, "camera->mutex");
 
 	if (!jpeg_frame || frame_timestamp == camera->timestamp) {
 		goto out;
 	}
+	latency_record(LATENCY_CAPTURE, frame_timestamp, acquired_at);
 	camera->timestamp = frame_timestamp;
+	camera->acquired_frames++;
+	camera->width = jpeg_frame->w;
+	camera->height = jpeg_frame->h;
+
+	if (SDL_GetAtomicInt(&camera->watchers) > 0) {
+		update_thumbnail(camera, jpeg_frame);
+	}
 
-	if (camera->jpeg_frame &&
-		SDL_memcmp(
-				jpeg_frame->pixels, camera->jpeg_frame->pixels,
-				jpeg_frame->pitch) == 0) {
+	// Nobody can see the picture. Keep draining the camera, but leave the
+	// last decoded frame and its hash alone so that resuming only decodes if
+	// the content changed in the meantime.
+	if (camera->suspended) {
 		goto out;
 	}
 
-	if (!camera->frame) {
-		camera->frame = SDL_CreateSurface(
-				jpeg_frame->w, jpeg_frame->h, SDL_PIXELFORMAT_RGB24);
-		if (!camera->frame) {
-			SDL_Log("Failed to create frame surface");
-			goto out;
-		}
+	// MJPG frames are stored as a byte buffer of `pitch` bytes. Identical
+	// content yields an identical bitstream, so size and hash are enough to
+	// tell a static picture apart without decoding it.
+	hash = SDL_murmur3_32(jpeg_frame->pixels, jpeg_frame->pitch, 0);
+	if (camera->frame && jpeg_frame->pitch == camera->frame_size &&
+		hash == camera->frame_hash) {
+		camera->static_frames++;
+		goto out;
 	}
+	camera->frame_size = jpeg_frame->pitch;
+	camera->frame_hash = hash;
 
-	if (!decode_frame(&camera->cinfo, jpeg_frame, camera->frame)) {
+	// Uniform pictures such as "No Signal" screens compress to a fraction of
+	// a byte per pixel. Only those are worth a look at the DC coefficients.
+	if (jpeg_frame->pitch <
+		camera->spec.width * camera->spec.height / CAMERA_BLANK_RATIO) {
+		blank = frame_is_blank(&camera->cinfo, jpeg_frame, level);
+	}
+	// Another blank picture, "No Signal" turning into a black screen, has
+	// to be shown.
+	if (blank && camera->blank && same_color(camera->blank_level, level)) {
+		camera->static_frames++;
+		goto out;
+	}
+	camera->blank = blank;
+	if (blank) {
+		SDL_memcpy(camera->blank_level, level, sizeof(level));
+	}
+	camera->static_frames = blank ? CAMERA_IDLE_FRAMES : 0;
+
+	width = (jpeg_frame->w + camera->scale - 1) / camera->scale;
+	height = (jpeg_frame->h + camera->scale - 1) / camera->scale;
+	target = frame_target(camera, width, height);
+	if (!target) {
+		SDL_Log("Failed to create frame surface: %s", SDL_GetError());
+		goto out;
+	}
+
+	decode_start = SDL_GetTicksNS();
+	latency_record(LATENCY_DECODE_WAIT, acquired_at, decode_start);
+	TRACE_BEGIN("decode_frame");
+	decoded = decode_frame(&camera->cinfo, jpeg_frame, target, camera->scale);
+	TRACE_END("decode_frame");
+	if (!decoded) {
 		SDL_Log("Failed to decode JPEG to texture");
+		if (target != camera->frame) {
+			ring_abort(&camera->ring);
+			SDL_DestroySurface(target);
+		}
 		goto out;
 	}
+	if (target != camera->frame) {
+		ring_commit(&camera->ring, camera->timestamp);
+		SDL_DestroySurface(camera->frame);
+		camera->frame = target;
+	}
+	camera->decoded_frames++;
+	camera->captured_at = frame_timestamp;
+	camera->decoded_at = SDL_GetTicksNS();
+	latency_record(LATENCY_DECODE, decode_start, camera->decoded_at);
 
 	rv = true;
 out:
-	SDL_ReleaseCameraFrame(camera->camera, camera->jpeg_frame);
-	camera->jpeg_frame = jpeg_frame;
+	// The last frame stays around until there is a newer one, so it can be
+	// exported.
+	if (jpeg_frame) {
+		SDL_ReleaseCameraFrame(camera->camera, camera->jpeg_frame);
+		camera->jpeg_frame = jpeg_frame;
+	}
 	SDL_UnlockMutex(camera->mutex);
 	return rv;
 }
 
-static Uint32
-update_camera_frame_timer(void *userdata, SDL_TimerID id, Uint32 interval) {
-	(void)id;
+static int
+camera_thread(void *data) {
+	struct Camera *camera = data;
 
-	struct Camera *ui = (struct Camera *)userdata;
+	trace_thread("camera_thread");
+	while (SDL_GetAtomicInt(&camera->running)) {
+		Uint64 start = SDL_GetTicks();
+		Uint64 elapsed;
+		Uint32 interval;
+		bool updated;
 
-	if (!update_camera_frame(ui)) {
-		return interval;
-	}
+		TRACE_BEGIN("update_camera_frame");
+		updated = update_camera_frame(camera);
+		TRACE_END("update_camera_frame");
+		if (updated) {
+			SDL_Event event = {
+					.user = {
+							.type = SDL_EVENT_USER,
+							.code = CAMERA_EVENT_CODE,
+							.data1 = camera,
+					}};
+			SDL_PushEvent(&event);
+		}
 
-	SDL_Event event = {
-			.user = {
-					.type = SDL_EVENT_USER,
-					.code = CAMERA_EVENT_CODE,
-			}};
-	SDL_PushEvent(&event);
-	return interval;
+		interval = camera_interval(camera);
+		elapsed = SDL_GetTicks() - start;
+		SDL_WaitSemaphoreTimeout(
+				camera->wakeup, elapsed < interval ? interval - elapsed : 0);
+	}
+	return 0;
 }
 
 bool
-camera_init(struct Camera *camera, const char *camera_name) {
+camera_init(struct Camera *camera, const char *camera_name, int index) {
 	int devcount = 0;
 	SDL_CameraID *devices = SDL_GetCameras(&devcount);
 	SDL_CameraID target_device = 0;
-	for (int i = 0; i < devcount; i++) {
-		if (strcmp(camera_name, SDL_GetCameraName(devices[i])) == 0) {
+	// Identical dongles share a name. SDL hands out IDs in the order cameras
+	// appear, so pick the index-th camera of that name by ID.
+	for (int i = 0; i < devcount && target_device == 0; i++) {
+		int rank = 0;
+		if (strcmp(camera_name, SDL_GetCameraName(devices[i])) != 0) {
+			continue;
+		}
+		for (int j = 0; j < devcount; j++) {
+			if (devices[j] < devices[i] &&
+				strcmp(camera_name, SDL_GetCameraName(devices[j])) == 0) {
+				rank++;
+			}
+		}
+		if (rank == index) {
 			target_device = devices[i];
-			break;
 		}
 	}
 	SDL_free(devices);
@@ -125,14 +437,12 @@ camera_init(struct Camera *camera, const char *camera_name) {
 	camera->camera = SDL_OpenCamera(target_device, &desired_spec);
 	if (!camera->camera) {
 		SDL_Log("Couldn't open camera: %s", SDL_GetError());
-		SDL_Quit();
-		return 1;
+		return false;
 	}
 
 	if (!SDL_GetCameraFormat(camera->camera, &camera->spec)) {
 		SDL_Log("Couldn't get camera spec: %s", SDL_GetError());
-		SDL_Quit();
-		return 1;
+		return false;
 	}
 	SDL_LogTrace(
 			SDL_LOG_CATEGORY_APPLICATION, "Camera spec: %dx%d %d/%d %d\n",
@@ -141,6 +451,9 @@ camera_init(struct Camera *camera, const char *camera_name) {
 			camera->spec.framerate_denominator,
 			camera->spec.format == SDL_PIXELFORMAT_MJPG);
 	camera->mutex = SDL_CreateMutex();
+	camera->wakeup = SDL_CreateSemaphore(0);
+	camera->thumb_changed = SDL_CreateCondition();
+	camera->scale = 1;
 
 	camera->cinfo.err = jpeg_std_error(&camera->jerr);
 
@@ -152,10 +465,10 @@ camera_init(struct Camera *camera, const char *camera_name) {
 bool
 camera_size(struct Camera *camera, int *w, int *h) {
 	bool rv = false;
-	SDL_LockMutex(camera->mutex);
+	TRACE_LOCK(camera->mutex, "camera->mutex");
 	if (camera->frame) {
-		*w = camera->frame->w;
-		*h = camera->frame->h;
+		*w = camera->width;
+		*h = camera->height;
 		rv = true;
 	}
 	SDL_UnlockMutex(camera->mutex);
@@ -164,23 +477,71 @@ camera_size(struct Camera *camera, int *w, int *h) {
 
 bool
 camera_start(struct Camera *camera) {
-	if (camera->timer_id) {
+	if (camera->thread) {
 		SDL_Log("Camera already started");
 		return false;
 	}
 
-	const int frame_time = camera->spec.framerate_denominator * 1000 /
+	camera->frame_time = camera->spec.framerate_denominator * 1000 /
 			camera->spec.framerate_numerator;
 
-	camera->timer_id =
-			SDL_AddTimer(frame_time, update_camera_frame_timer, camera);
-	if (!camera->timer_id) {
-		SDL_Log("Failed to create camera timer: %s", SDL_GetError());
+	SDL_SetAtomicInt(&camera->running, 1);
+	camera->thread = SDL_CreateThread(camera_thread, "camera_thread", camera);
+	if (!camera->thread) {
+		SDL_Log("Failed to create camera thread: %s", SDL_GetError());
+		SDL_SetAtomicInt(&camera->running, 0);
 		return false;
 	}
 	return true;
 }
 
+bool
+camera_suspend(struct Camera *camera, bool suspend) {
+	bool changed;
+
+	TRACE_LOCK(camera->mutex, "camera->mutex");
+	changed = camera->suspended != suspend;
+	if (changed) {
+		camera->suspended = suspend;
+		camera->static_frames = 0;
+	}
+	SDL_UnlockMutex(camera->mutex);
+
+	// The worker may be sleeping for a whole suspended interval. Wake it so
+	// the next frame is fetched within one frame period.
+	if (changed && !suspend) {
+		SDL_SignalSemaphore(camera->wakeup);
+	}
+	return true;
+}
+
+bool
+camera_set_scale(struct Camera *camera, int scale) {
+	TRACE_LOCK(camera->mutex, "camera->mutex");
+	if (camera->scale != scale) {
+		camera->scale = scale;
+		// Make sure the next frame is decoded at the new scale even if the
+		// picture is static.
+		camera->frame_size = 0;
+		camera->blank = false;
+		SDL_SignalSemaphore(camera->wakeup);
+	}
+	SDL_UnlockMutex(camera->mutex);
+	return true;
+}
+
+// Publishes decoded frames to the POSIX shared memory object `name`, see
+// ring.h.
+bool
+camera_publish(struct Camera *camera, const char *name) {
+	bool rv;
+
+	TRACE_LOCK(camera->mutex, "camera->mutex");
+	rv = ring_init(&camera->ring, name);
+	SDL_UnlockMutex(camera->mutex);
+	return rv;
+}
+
 bool
 camera_update_texture(struct Camera *camera, SDL_Renderer *renderer) {
 	bool rv = false;
@@ -188,10 +549,16 @@ camera_update_texture(struct Camera *camera, SDL_Renderer *renderer) {
 		return rv;
 	}
 
-	SDL_LockMutex(camera->mutex);
+	TRACE_BEGIN("camera_update_texture");
+	TRACE_LOCK(camera->mutex, "camera->mutex");
 	if (!camera->frame) {
 		goto out;
 	}
+	if (camera->texture && (camera->texture->w != camera->frame->w ||
+							camera->texture->h != camera->frame->h)) {
+		SDL_DestroyTexture(camera->texture);
+		camera->texture = NULL;
+	}
 	if (!camera->texture) {
 		SDL_LogTrace(SDL_LOG_CATEGORY_RENDER, "Creating window texture");
 		camera->texture = SDL_CreateTexture(
@@ -208,10 +575,18 @@ camera_update_texture(struct Camera *camera, SDL_Renderer *renderer) {
 		SDL_Log("Failed to update camera texture: %s", SDL_GetError());
 		goto out;
 	}
+	// A frame only counts once, however often it is uploaded.
+	if (camera->decoded_at) {
+		camera->uploaded_at = SDL_GetTicksNS();
+		camera->uploaded_captured_at = camera->captured_at;
+		latency_record(LATENCY_UPLOAD, camera->decoded_at, camera->uploaded_at);
+		camera->decoded_at = 0;
+	}
 
 	rv = true;
 out:
 	SDL_UnlockMutex(camera->mutex);
+	TRACE_END("camera_update_texture");
 	return rv;
 }
 
@@ -220,13 +595,797 @@ camera_texture(struct Camera *camera) {
 	return camera->texture;
 }
 
+// Notes that the texture made it to the screen, on the UI thread.
+void
+camera_presented(struct Camera *camera, Uint64 now) {
+	if (camera->uploaded_at == 0) {
+		return;
+	}
+	latency_record(LATENCY_PRESENT, camera->uploaded_at, now);
+	latency_record(LATENCY_FRAME, camera->uploaded_captured_at, now);
+	camera->uploaded_at = 0;
+}
+
+// Copies `size` bytes to a new sealed memfd. Returns it, or -1.
+static int
+sealed_memfd(const Uint8 *pixels, size_t size) {
+	const int fd = memfd_create("kvsm-frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+	if (fd < 0) {
+		SDL_SetError("Couldn't create memfd: %s", strerror(errno));
+		return -1;
+	}
+	for (size_t done = 0; done < size;) {
+		const ssize_t written = write(fd, pixels + done, size - done);
+		if (written < 0 && errno != EINTR) {
+			SDL_SetError("Couldn't write memfd: %s", strerror(errno));
+			goto fail;
+		}
+		done += written > 0 ? written : 0;
+	}
+	if (fcntl(fd, F_ADD_SEALS,
+			  F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+		SDL_SetError("Couldn't seal memfd: %s", strerror(errno));
+		goto fail;
+	}
+	return fd;
+fail:
+	close(fd);
+	return -1;
+}
+
+// Copies the latest frame out of the frame ring through a mapping of its
+// own, which stays valid if the camera thread moves to a new ring.
+static int
+export_ring_frame(struct Camera *camera, struct CameraFrame *frame) {
+	struct RingReader *reader = &camera->exporter;
+	struct RingFrame latest;
+
+	if (reader->header == NULL &&
+		!ring_open(reader, camera->ring.name)) {
+		return -1;
+	}
+	// Follows the camera to a new ring.
+	if (ring_wait(reader, 0) < 0) {
+		return -1;
+	}
+	for (int i = 0; i < RING_SLOTS; i++) {
+		int fd;
+
+		if (!ring_latest(reader, &latest)) {
+			return -1;
+		}
+		if (frame->fd > 0 && frame->seq == latest.sequence) {
+			return frame->fd;
+		}
+		fd = sealed_memfd(latest.pixels, latest.size);
+		if (fd < 0) {
+			return -1;
+		}
+		if (!ring_frame_valid(&latest)) {
+			// Overwritten while it was copied.
+			close(fd);
+			continue;
+		}
+		if (frame->fd > 0) {
+			close(frame->fd);
+		}
+		*frame = (struct CameraFrame){
+				.fd = fd,
+				.format = latest.format,
+				.width = latest.width,
+				.height = latest.height,
+				.pitch = latest.pitch,
+				.size = latest.size,
+				.timestamp = latest.timestamp,
+				.seq = latest.sequence,
+		};
+		return fd;
+	}
+	SDL_SetError("Frames come faster than they are exported");
+	return -1;
+}
+
+// Puts the latest frame into a sealed memfd, which other processes can map
+// but not change. Decoded frames are RGB24 at the current scale, compressed
+// ones MJPG as they came from the camera. The memfd is kept until there is
+// a newer frame, so a frame is copied once however often it's handed out.
+// Only the control thread exports, the copy is made without the camera
+// mutex. Returns the memfd, which belongs to the camera, or -1.
+int
+camera_export_frame(
+		struct Camera *camera, bool compressed, struct CameraFrame *out) {
+	struct CameraFrame *frame = &camera->exported[compressed];
+	struct CameraFrame next = {0};
+	SDL_Surface *pinned = NULL;
+	Uint8 *copy = NULL;
+	SDL_Surface *source;
+
+	if (!compressed && ring_enabled(&camera->ring)) {
+		next.fd = export_ring_frame(camera, frame);
+		goto out;
+	}
+
+	TRACE_LOCK(camera->mutex, "camera->mutex");
+	source = compressed ? camera->jpeg_frame : camera->frame;
+	next.seq = compressed ? camera->acquired_frames : camera->decoded_frames;
+	if (source == NULL) {
+		SDL_UnlockMutex(camera->mutex);
+		SDL_SetError("No frame yet");
+		next.fd = -1;
+		goto out;
+	}
+	if (frame->fd > 0 && frame->seq == next.seq) {
+		SDL_UnlockMutex(camera->mutex);
+		next.fd = frame->fd;
+		goto out;
+	}
+	next.format = compressed ? SDL_PIXELFORMAT_MJPG : source->format;
+	next.width = compressed ? camera->width : source->w;
+	next.height = compressed ? camera->height : source->h;
+	// MJPG frames keep their size in the pitch.
+	next.pitch = compressed ? 0 : source->pitch;
+	next.size = compressed ? (size_t)source->pitch
+						   : (size_t)source->pitch * source->h;
+	next.timestamp = camera->timestamp;
+	if (compressed) {
+		// The camera wants its buffer back with the next frame. An MJPG
+		// frame is small, copying it is quick.
+		copy = SDL_malloc(next.size);
+		if (copy != NULL) {
+			SDL_memcpy(copy, source->pixels, next.size);
+		}
+	} else {
+		// The camera thread decodes into a new surface while this one is
+		// referenced, see frame_target().
+		pinned = source;
+		pinned->refcount++;
+	}
+	SDL_UnlockMutex(camera->mutex);
+
+	if (compressed && copy == NULL) {
+		next.fd = -1;
+		goto out;
+	}
+	next.fd = sealed_memfd(copy ? copy : pinned->pixels, next.size);
+	SDL_free(copy);
+	if (pinned != NULL) {
+		TRACE_LOCK(camera->mutex, "camera->mutex");
+		SDL_DestroySurface(pinned);
+		SDL_UnlockMutex(camera->mutex);
+	}
+	if (next.fd < 0) {
+		goto out;
+	}
+	if (frame->fd > 0) {
+		close(frame->fd);
+	}
+	*frame = next;
+out:
+	if (next.fd > 0) {
+		*out = *frame;
+	}
+	return next.fd > 0 ? next.fd : -1;
+}
+
 bool
 camera_cleanup(struct Camera *camera) {
-	SDL_RemoveTimer(camera->timer_id);
+	// Waits still going give up and let go of the camera.
+	if (camera->mutex != NULL) {
+		TRACE_LOCK(camera->mutex, "camera->mutex");
+		camera->closing = true;
+		SDL_BroadcastCondition(camera->thumb_changed);
+		while (SDL_GetAtomicInt(&camera->watchers) > 0) {
+			SDL_WaitCondition(camera->thumb_changed, camera->mutex);
+		}
+		SDL_UnlockMutex(camera->mutex);
+	}
+	SDL_SetAtomicInt(&camera->running, 0);
+	SDL_SignalSemaphore(camera->wakeup);
+	SDL_WaitThread(camera->thread, NULL);
+	if (camera->acquired_frames > 0) {
+		SDL_Log("Camera decoded %" SDL_PRIu64 " of %" SDL_PRIu64 " frames",
+				camera->decoded_frames, camera->acquired_frames);
+	}
 	SDL_DestroyTexture(camera->texture);
 	SDL_CloseCamera(camera->camera);
 	SDL_DestroySurface(camera->frame);
+	ring_cleanup(&camera->ring);
+	ring_close(&camera->exporter);
+	SDL_free(camera->thumb);
+	SDL_DestroyCondition(camera->thumb_changed);
+	for (int i = 0; i < 2; i++) {
+		if (camera->exported[i].fd > 0) {
+			close(camera->exported[i].fd);
+		}
+	}
 	SDL_DestroyMutex(camera->mutex);
+	SDL_DestroySemaphore(camera->wakeup);
 	jpeg_destroy_decompress(&camera->cinfo);
 	return true;
 }
+
+// Makes the camera thread keep the block luma up to date. The camera isn't
+// cleaned up while it is watched.
+void
+camera_watch(struct Camera *camera) {
+	if (SDL_AddAtomicInt(&camera->watchers, 1) == 0) {
+		// Nobody looked at the frames that came meanwhile.
+		TRACE_LOCK(camera->mutex, "camera->mutex");
+		camera->thumb_valid = false;
+		SDL_UnlockMutex(camera->mutex);
+		SDL_SignalSemaphore(camera->wakeup);
+	}
+}
+
+void
+camera_unwatch(struct Camera *camera) {
+	// camera_cleanup() may be waiting for the last watcher. The camera may
+	// be gone once the mutex is released.
+	TRACE_LOCK(camera->mutex, "camera->mutex");
+	if (SDL_AddAtomicInt(&camera->watchers, -1) == 1 && camera->closing) {
+		SDL_BroadcastCondition(camera->thumb_changed);
+	}
+	SDL_UnlockMutex(camera->mutex);
+}
+
+// Waits until `deadline` for block luma newer than `seq` and copies it.
+// Returns 1 if it got it, 0 on timeout and -1 on error.
+static int
+wait_luma(
+		struct Camera *camera, Uint64 seq, Uint64 deadline,
+		struct Luma *luma) {
+	int rv = 0;
+	size_t size;
+
+	TRACE_LOCK(camera->mutex, "camera->mutex");
+	while (!camera->thumb_valid || camera->thumb_seq == seq) {
+		const Uint64 now = SDL_GetTicksNS();
+		if (camera->closing) {
+			SDL_SetError("The camera is gone");
+			rv = -1;
+			goto out;
+		}
+		if (now >= deadline) {
+			goto out;
+		}
+		SDL_WaitConditionTimeout(
+				camera->thumb_changed, camera->mutex,
+				(Sint32)SDL_NS_TO_MS(deadline - now + SDL_NS_PER_MS - 1));
+	}
+
+	size = (size_t)camera->thumb_pitch * camera->thumb_height;
+	if ((size_t)luma->pitch * luma->height != size) {
+		SDL_free(luma->pixels);
+		SDL_zerop(luma);
+		luma->pixels = SDL_malloc(size);
+		if (luma->pixels == NULL) {
+			rv = -1;
+			goto out;
+		}
+	}
+	SDL_memcpy(luma->pixels, camera->thumb, size);
+	luma->width = camera->thumb_width;
+	luma->height = camera->thumb_height;
+	luma->pitch = camera->thumb_pitch;
+	luma->seq = camera->thumb_seq;
+	rv = 1;
+out:
+	SDL_UnlockMutex(camera->mutex);
+	return rv;
+}
+
+// The first picture may take a while if the camera was idle.
+static Uint64
+first_deadline(Uint64 deadline) {
+	return SDL_max(
+			deadline, SDL_GetTicksNS() + SDL_MS_TO_NS(CAMERA_IDLE_INTERVAL));
+}
+
+// Whether any block of a region in frame pixels moved by more than
+// CAMERA_CHANGE_LEVEL. NULL is the whole frame.
+static bool
+luma_changed(
+		const struct Luma *before, const struct Luma *after,
+		const SDL_Rect *region) {
+	int x0 = 0, y0 = 0, x1 = after->width, y1 = after->height;
+
+	if (before->width != after->width || before->height != after->height) {
+		return true;
+	}
+	if (region != NULL) {
+		x0 = SDL_max(region->x / CAMERA_BLOCK_SIZE, 0);
+		y0 = SDL_max(region->y / CAMERA_BLOCK_SIZE, 0);
+		x1 = SDL_min(
+				(region->x + region->w + CAMERA_BLOCK_SIZE - 1) /
+						CAMERA_BLOCK_SIZE,
+				after->width);
+		y1 = SDL_min(
+				(region->y + region->h + CAMERA_BLOCK_SIZE - 1) /
+						CAMERA_BLOCK_SIZE,
+				after->height);
+	}
+	for (int y = y0; y < y1; y++) {
+		const Uint8 *a = &before->pixels[y * before->pitch];
+		const Uint8 *b = &after->pixels[y * after->pitch];
+		for (int x = x0; x < x1; x++) {
+			if (SDL_abs(a[x] - b[x]) > CAMERA_CHANGE_LEVEL) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// Waits until a region of the picture, in frame pixels, changes. NULL is
+// the whole frame. Returns false on timeout.
+bool
+camera_wait_change(
+		struct Camera *camera, const SDL_Rect *region, Sint32 timeout) {
+	const Uint64 deadline = SDL_GetTicksNS() + SDL_MS_TO_NS(timeout);
+	struct Luma before = {0};
+	struct Luma after = {0};
+	bool rv = false;
+	int got;
+
+	camera_watch(camera);
+	got = wait_luma(camera, 0, first_deadline(deadline), &before);
+	while (got > 0) {
+		got = wait_luma(camera, before.seq, deadline, &after);
+		if (got > 0 && luma_changed(&before, &after, region)) {
+			rv = true;
+			break;
+		}
+		before.seq = after.seq;
+	}
+	if (got == 0) {
+		SDL_SetError("The picture didn't change in %d ms", timeout);
+	}
+	camera_unwatch(camera);
+	SDL_free(before.pixels);
+	SDL_free(after.pixels);
+	return rv;
+}
+
+// Waits until a region of the picture hasn't changed for `stable` ms.
+// Returns false on timeout.
+bool
+camera_wait_stable(
+		struct Camera *camera, const SDL_Rect *region, Uint32 stable,
+		Sint32 timeout) {
+	const Uint64 deadline = SDL_GetTicksNS() + SDL_MS_TO_NS(timeout);
+	struct Luma last = {0};
+	struct Luma next = {0};
+	Uint64 stable_since;
+	bool rv = false;
+	int got;
+
+	camera_watch(camera);
+	got = wait_luma(camera, 0, first_deadline(deadline), &last);
+	if (got == 0) {
+		SDL_SetError("No picture");
+	}
+	stable_since = SDL_GetTicksNS();
+	while (got >= 0 && last.pixels != NULL) {
+		const Uint64 now = SDL_GetTicksNS();
+		if (now - stable_since >= SDL_MS_TO_NS(stable)) {
+			rv = true;
+			break;
+		}
+		if (now >= deadline) {
+			SDL_SetError("The picture didn't settle in %d ms", timeout);
+			break;
+		}
+		got = wait_luma(
+				camera, last.seq,
+				SDL_min(deadline, stable_since + SDL_MS_TO_NS(stable)),
+				&next);
+		if (got > 0) {
+			struct Luma swap = last;
+			if (luma_changed(&last, &next, region)) {
+				stable_since = SDL_GetTicksNS();
+			}
+			last = next;
+			next = swap;
+		}
+	}
+	camera_unwatch(camera);
+	SDL_free(last.pixels);
+	SDL_free(next.pixels);
+	return rv;
+}
+
+// Dot product of a row of luma with a row of the template, `count` being a
+// multiple of 8. At most 255 * 255 * 2 per 16 bit pair, so no lane of the
+// 32 bit sums overflows for rows of any frame size.
+static Uint32
+dot_row(const Uint8 *luma, const Uint16 *template, int count) {
+#if defined(SDL_SSE2_INTRINSICS)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sum = zero;
+
+	for (int i = 0; i < count; i += 8) {
+		const __m128i a = _mm_unpacklo_epi8(
+				_mm_loadl_epi64((const __m128i *)&luma[i]), zero);
+		const __m128i b = _mm_loadu_si128((const __m128i *)&template[i]);
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(a, b));
+	}
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (Uint32)_mm_cvtsi128_si32(sum);
+#elif defined(SDL_NEON_INTRINSICS)
+	uint32x4_t sum = vdupq_n_u32(0);
+
+	for (int i = 0; i < count; i += 8) {
+		const uint16x8_t a = vmovl_u8(vld1_u8(&luma[i]));
+		const uint16x8_t b = vld1q_u16(&template[i]);
+		sum = vmlal_u16(sum, vget_low_u16(a), vget_low_u16(b));
+		sum = vmlal_u16(sum, vget_high_u16(a), vget_high_u16(b));
+	}
+	return vgetq_lane_u32(sum, 0) + vgetq_lane_u32(sum, 1) +
+			vgetq_lane_u32(sum, 2) + vgetq_lane_u32(sum, 3);
+#else
+	Uint32 sum = 0;
+
+	for (int i = 0; i < count; i++) {
+		sum += luma[i] * template[i];
+	}
+	return sum;
+#endif
+}
+
+// Works out what normalised cross-correlation needs of a template.
+static bool
+template_finish(struct Template *template) {
+	const double n = template->width * template->height;
+	Uint64 sum2 = 0;
+
+	template->sum = 0;
+	for (int y = 0; y < template->height; y++) {
+		const Uint16 *row = &template->pixels[y * template->pitch];
+		for (int x = 0; x < template->width; x++) {
+			template->sum += row[x];
+			sum2 += row[x] * row[x];
+		}
+	}
+	template->norm = SDL_sqrt(
+			n * (double)sum2 - (double)template->sum * template->sum);
+	return template->norm > 0;
+}
+
+static bool
+template_alloc(struct Template *template, int width, int height) {
+	template->width = width;
+	template->height = height;
+	template->pitch = (width + 7) & ~7;
+	template->pixels = SDL_calloc(height * template->pitch, sizeof(Uint16));
+	return template->pixels != NULL;
+}
+
+// Averages a reference image down to block luma. Partial blocks at the
+// right and bottom edge are left out.
+static bool
+template_init(struct Template *template, SDL_Surface *reference) {
+	SDL_Surface *rgb = SDL_ConvertSurface(reference, SDL_PIXELFORMAT_RGB24);
+	const int block_pixels = CAMERA_BLOCK_SIZE * CAMERA_BLOCK_SIZE;
+	bool rv = false;
+
+	SDL_zerop(template);
+	if (rgb == NULL) {
+		goto out;
+	}
+	if (rgb->w < 2 * CAMERA_BLOCK_SIZE || rgb->h < 2 * CAMERA_BLOCK_SIZE) {
+		SDL_SetError("The reference must be at least %d pixels in size",
+					 2 * CAMERA_BLOCK_SIZE);
+		goto out;
+	}
+	if (!template_alloc(
+				template, rgb->w / CAMERA_BLOCK_SIZE,
+				rgb->h / CAMERA_BLOCK_SIZE)) {
+		goto out;
+	}
+
+	for (int y = 0; y < template->height * CAMERA_BLOCK_SIZE; y++) {
+		const Uint8 *p = (const Uint8 *)rgb->pixels + y * rgb->pitch;
+		Uint16 *row =
+				&template->pixels[y / CAMERA_BLOCK_SIZE * template->pitch];
+		for (int x = 0; x < template->width * CAMERA_BLOCK_SIZE;
+			 x++, p += 3) {
+			// BT.601 like the luma of JPEG, summed up over the block.
+			row[x / CAMERA_BLOCK_SIZE] +=
+					(77 * p[0] + 150 * p[1] + 29 * p[2]) >> 8;
+		}
+	}
+	for (int y = 0; y < template->height; y++) {
+		Uint16 *row = &template->pixels[y * template->pitch];
+		for (int x = 0; x < template->width; x++) {
+			row[x] /= block_pixels;
+		}
+	}
+	if (!template_finish(template)) {
+		SDL_SetError("The reference is a single colour");
+		goto out;
+	}
+	rv = true;
+out:
+	SDL_DestroySurface(rgb);
+	if (!rv) {
+		SDL_free(template->pixels);
+		template->pixels = NULL;
+	}
+	return rv;
+}
+
+// Halves a template in both directions for the coarse search. Fails for
+// templates with too little left of them at that size.
+static bool
+template_halve(const struct Template *template, struct Template *half) {
+	SDL_zerop(half);
+	if (template->width < 8 || template->height < 8 ||
+		!template_alloc(half, template->width / 2, template->height / 2)) {
+		return false;
+	}
+	for (int y = 0; y < half->height; y++) {
+		const Uint16 *a = &template->pixels[2 * y * template->pitch];
+		const Uint16 *b = a + template->pitch;
+		for (int x = 0; x < half->width; x++) {
+			half->pixels[y * half->pitch + x] =
+					(a[2 * x] + a[2 * x + 1] + b[2 * x] + b[2 * x + 1]) / 4;
+		}
+	}
+	if (!template_finish(half)) {
+		SDL_free(half->pixels);
+		half->pixels = NULL;
+		return false;
+	}
+	return true;
+}
+
+static bool
+luma_halve(const struct Luma *luma, struct Luma *half) {
+	half->width = luma->width / 2;
+	half->height = luma->height / 2;
+	half->pitch = half->width + THUMB_PADDING;
+	half->pixels = SDL_calloc(half->height, half->pitch);
+	if (half->pixels == NULL) {
+		return false;
+	}
+	for (int y = 0; y < half->height; y++) {
+		const Uint8 *a = &luma->pixels[2 * y * luma->pitch];
+		const Uint8 *b = a + luma->pitch;
+		for (int x = 0; x < half->width; x++) {
+			half->pixels[y * half->pitch + x] =
+					(a[2 * x] + a[2 * x + 1] + b[2 * x] + b[2 * x + 1]) / 4;
+		}
+	}
+	return true;
+}
+
+// Summed area tables, for the sum and the sum of squares of any window.
+struct Sums {
+	Uint32 *sum;
+	Uint64 *sum2;
+	int stride;
+};
+
+static bool
+sums_init(struct Sums *sums, const struct Luma *luma) {
+	const size_t size = (size_t)(luma->width + 1) * (luma->height + 1);
+	const int w = luma->width + 1;
+
+	sums->stride = w;
+	sums->sum = SDL_calloc(size, sizeof(Uint32));
+	sums->sum2 = SDL_calloc(size, sizeof(Uint64));
+	if (sums->sum == NULL || sums->sum2 == NULL) {
+		return false;
+	}
+	for (int y = 0; y < luma->height; y++) {
+		const Uint8 *row = &luma->pixels[y * luma->pitch];
+		Uint32 sum = 0;
+		Uint64 sum2 = 0;
+		for (int x = 0; x < luma->width; x++) {
+			sum += row[x];
+			sum2 += row[x] * row[x];
+			sums->sum[(y + 1) * w + x + 1] = sums->sum[y * w + x + 1] + sum;
+			sums->sum2[(y + 1) * w + x + 1] =
+					sums->sum2[y * w + x + 1] + sum2;
+		}
+	}
+	return true;
+}
+
+static void
+sums_free(struct Sums *sums) {
+	SDL_free(sums->sum);
+	SDL_free(sums->sum2);
+}
+
+// Normalised cross-correlation of the template with the picture at x, y.
+// Only the products with the template cost per pixel.
+static float
+score_at(
+		const struct Luma *luma, const struct Sums *sums,
+		const struct Template *template, int x, int y) {
+	const int n = template->width * template->height;
+	const int w = sums->stride;
+	const int x1 = x + template->width, y1 = y + template->height;
+	const double sum = (double)sums->sum[y1 * w + x1] -
+			sums->sum[y * w + x1] - sums->sum[y1 * w + x] +
+			sums->sum[y * w + x];
+	const double sum2 = (double)sums->sum2[y1 * w + x1] -
+			sums->sum2[y * w + x1] - sums->sum2[y1 * w + x] +
+			sums->sum2[y * w + x];
+	const double norm = n * sum2 - sum * sum;
+	Uint64 dot = 0;
+
+	// A flat window matches nothing.
+	if (norm <= 0) {
+		return 0;
+	}
+	for (int i = 0; i < template->height; i++) {
+		dot += dot_row(
+				&luma->pixels[(y + i) * luma->pitch + x],
+				&template->pixels[i * template->pitch], template->pitch);
+	}
+	return (float)((n * (double)dot - sum * template->sum) /
+				   (SDL_sqrt(norm) * template->norm));
+}
+
+struct Candidate {
+	int x;
+	int y;
+	float score;
+};
+
+// Keeps the best scores, best first, and only the better one of two next
+// to each other.
+static void
+candidate_add(struct Candidate *candidates, int x, int y, float score) {
+	int i;
+
+	for (i = 0; i < MATCH_CANDIDATES; i++) {
+		if (SDL_abs(candidates[i].x - x) <= 1 &&
+			SDL_abs(candidates[i].y - y) <= 1 && candidates[i].score >= 0) {
+			break;
+		}
+	}
+	if (i < MATCH_CANDIDATES) {
+		if (candidates[i].score >= score) {
+			return;
+		}
+		// Taken out, the new one goes in wherever it belongs.
+		SDL_memmove(
+				&candidates[i], &candidates[i + 1],
+				(MATCH_CANDIDATES - 1 - i) * sizeof(struct Candidate));
+		candidates[MATCH_CANDIDATES - 1].score = -1;
+	}
+
+	i = MATCH_CANDIDATES;
+	while (i > 0 && candidates[i - 1].score < score) {
+		if (i < MATCH_CANDIDATES) {
+			candidates[i] = candidates[i - 1];
+		}
+		i--;
+	}
+	if (i < MATCH_CANDIDATES) {
+		candidates[i] = (struct Candidate){x, y, score};
+	}
+}
+
+// Searches the positions within a range for the best match.
+static void
+search(const struct Luma *luma, const struct Sums *sums,
+	   const struct Template *template, const SDL_Rect *range,
+	   struct Candidate *candidates) {
+	const int x1 =
+			SDL_min(range->x + range->w, luma->width - template->width + 1);
+	const int y1 =
+			SDL_min(range->y + range->h, luma->height - template->height + 1);
+
+	for (int y = SDL_max(range->y, 0); y < y1; y++) {
+		for (int x = SDL_max(range->x, 0); x < x1; x++) {
+			candidate_add(
+					candidates, x, y, score_at(luma, sums, template, x, y));
+		}
+	}
+}
+
+// Finds where the template matches best. Large templates are first looked
+// for at half the resolution, which costs a sixteenth, then only around
+// the best few places at full resolution. Returns the score, -1 on error.
+static float
+match(const struct Luma *luma, const struct Template *template,
+	  int *found_x, int *found_y) {
+	const Sint64 cost = (Sint64)(luma->width - template->width + 1) *
+			(luma->height - template->height + 1) * template->pitch *
+			template->height;
+	struct Candidate candidates[MATCH_CANDIDATES];
+	struct Candidate best[MATCH_CANDIDATES];
+	struct Template half_template = {0};
+	struct Luma half = {0};
+	struct Sums sums = {0};
+	struct Sums half_sums = {0};
+	const bool coarse = cost > MATCH_FULL_COST &&
+			template_halve(template, &half_template);
+	float rv = -1;
+
+	for (int i = 0; i < MATCH_CANDIDATES; i++) {
+		candidates[i] = best[i] = (struct Candidate){0, 0, -1};
+	}
+	if (!sums_init(&sums, luma)) {
+		goto out;
+	}
+	if (!coarse) {
+		search(luma, &sums, template,
+			   &(SDL_Rect){0, 0, luma->width, luma->height}, best);
+		goto found;
+	}
+
+	if (!luma_halve(luma, &half) || !sums_init(&half_sums, &half)) {
+		goto out;
+	}
+	search(&half, &half_sums, &half_template,
+		   &(SDL_Rect){0, 0, half.width, half.height}, candidates);
+	for (int i = 0; i < MATCH_CANDIDATES && candidates[i].score >= 0; i++) {
+		const SDL_Rect around = {
+				2 * candidates[i].x - 1, 2 * candidates[i].y - 1, 4, 4};
+		search(luma, &sums, template, &around, best);
+	}
+found:
+	*found_x = best[0].x;
+	*found_y = best[0].y;
+	rv = SDL_max(best[0].score, 0);
+out:
+	SDL_free(half_template.pixels);
+	SDL_free(half.pixels);
+	sums_free(&sums);
+	sums_free(&half_sums);
+	return rv;
+}
+
+// Waits until the picture shows the reference image with a normalised
+// cross-correlation of at least `min_score`, 1 being a perfect match.
+// Positions are found to the block, so references that aren't aligned to
+// 8 pixels score a little lower. A timeout of 0 looks at the current
+// picture only. Returns false if it never showed up; `found` and `score`
+// are the best match of the last picture either way.
+bool
+camera_find(
+		struct Camera *camera, SDL_Surface *reference, float min_score,
+		Sint32 timeout, SDL_Rect *found, float *score) {
+	const Uint64 deadline = SDL_GetTicksNS() + SDL_MS_TO_NS(timeout);
+	struct Template template;
+	struct Luma luma = {0};
+	bool rv = false;
+	int got;
+
+	if (!template_init(&template, reference)) {
+		return false;
+	}
+	camera_watch(camera);
+	*score = -1;
+	got = wait_luma(camera, 0, first_deadline(deadline), &luma);
+	while (got > 0) {
+		int x = 0, y = 0;
+		*score = match(&luma, &template, &x, &y);
+		if (*score < 0) {
+			break;
+		}
+		found->x = x * CAMERA_BLOCK_SIZE;
+		found->y = y * CAMERA_BLOCK_SIZE;
+		found->w = template.width * CAMERA_BLOCK_SIZE;
+		found->h = template.height * CAMERA_BLOCK_SIZE;
+		if (*score >= min_score) {
+			rv = true;
+			break;
+		}
+		got = wait_luma(camera, luma.seq, deadline, &luma);
+	}
+	if (got == 0) {
+		SDL_SetError("The reference didn't show up, best match %.2f", *score);
+	}
+	camera_unwatch(camera);
+	SDL_free(luma.pixels);
+	SDL_free(template.pixels);
+	return rv;
+}
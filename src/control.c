@@ -0,0 +1,585 @@
+// accept4().
+#define _GNU_SOURCE
+#include "control.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define LISTEN_BACKLOG 64
+#define EPOLL_EVENTS 32
+// Requests taken from one client before the others get their turn.
+#define CLIENT_BURST 16
+#define MESSAGE_SIZE                                                           \
+	(sizeof(struct ControlHeader) +                                            \
+	 CONTROL_EVENTS_MAX * sizeof(struct ControlEvent))
+
+// A wait or search, run on a thread of its own so that the other clients
+// aren't kept waiting with it.
+struct Job {
+	struct Control *control;
+	struct Camera *camera;
+	// A duplicate of the client's socket, which may be dropped meanwhile.
+	int client;
+	struct ControlHeader header;
+	// The whole frame if `w` is 0.
+	SDL_Rect region;
+	Uint32 stable;
+	Sint32 timeout;
+	SDL_Surface *reference;
+	float min_score;
+};
+
+// Sends a reply, along with a file descriptor if `fd` isn't -1. Replies
+// are small, a client whose socket is full isn't reading them.
+static bool
+reply(int client, const void *data, size_t size, int fd) {
+	struct iovec iov = {.iov_base = (void *)data, .iov_len = size};
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(sizeof(int))];
+	} control = {0};
+	struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+
+	if (fd >= 0) {
+		struct cmsghdr *cmsg;
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = sizeof(control.buffer);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		SDL_memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	return sendmsg(client, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) ==
+			(ssize_t)size;
+}
+
+static int
+queue_input(
+		struct Device *device, const struct ControlHeader *request,
+		size_t size) {
+	const struct ControlEvent *events =
+			(const struct ControlEvent *)(request + 1);
+
+	if (size != sizeof(*request) + request->arg * sizeof(*events)) {
+		return EINVAL;
+	}
+	// All or nothing, a batch cut short may leave a key held.
+	for (int i = 0; i < request->arg; i++) {
+		if (events[i].kind >= MACRO_KIND_COUNT) {
+			return EINVAL;
+		}
+	}
+	if (!device->connected || !device_has_input(device)) {
+		return ENODEV;
+	} else if (input_playing(&device->input)) {
+		return EBUSY;
+	}
+	for (int i = 0; i < request->arg; i++) {
+		const struct MacroEvent event = {
+				.kind = events[i].kind,
+				.rel_mouse = events[i].rel_mouse,
+				.code = events[i].code,
+				.x = events[i].x,
+				.y = events[i].y,
+		};
+		input_inject(&device->input, &event);
+	}
+	return 0;
+}
+
+static void
+get_status(struct Device *device, struct ControlStatus *status) {
+	struct Input *input = &device->input;
+
+	if (!device_has_input(device)) {
+		status->header.arg = ENODEV;
+		return;
+	}
+	status->connected = input_status_connected(input);
+	status->num_lock = input_status_numpad(input);
+	status->caps_lock = input_status_capslock(input);
+	status->scroll_lock = input_status_scrolllock(input);
+}
+
+static int
+get_frame(
+		struct Device *device, const struct ControlHeader *request,
+		struct ControlFrame *frame) {
+	struct CameraFrame exported;
+	int fd;
+
+	if (request->arg > CONTROL_FRAME_COMPRESSED) {
+		frame->header.arg = EINVAL;
+		return -1;
+	}
+	fd = camera_export_frame(
+			&device->camera, request->arg == CONTROL_FRAME_COMPRESSED,
+			&exported);
+	if (fd < 0) {
+		frame->header.arg = EAGAIN;
+		return -1;
+	}
+	frame->format = exported.format;
+	frame->width = exported.width;
+	frame->height = exported.height;
+	frame->pitch = exported.pitch;
+	frame->size = exported.size;
+	frame->timestamp = exported.timestamp;
+	frame->sequence = exported.seq;
+	return fd;
+}
+
+static int
+job_thread(void *data) {
+	struct Job *job = data;
+	const SDL_Rect *region = job->region.w > 0 ? &job->region : NULL;
+	union {
+		struct ControlHeader header;
+		struct ControlFound found;
+	} answer = {.header = job->header};
+	size_t size = sizeof(answer.header);
+	SDL_Rect found = {0};
+	float score = -1;
+	bool done;
+
+	trace_thread("control_job");
+	switch (job->header.command) {
+	case CONTROL_WAIT_CHANGE:
+		done = camera_wait_change(job->camera, region, job->timeout);
+		break;
+	case CONTROL_WAIT_STABLE:
+		done = camera_wait_stable(
+				job->camera, region, job->stable, job->timeout);
+		break;
+	default:
+		done = camera_find(
+				job->camera, job->reference, job->min_score, job->timeout,
+				&found, &score);
+		size = sizeof(answer.found);
+		answer.found.x = found.x;
+		answer.found.y = found.y;
+		answer.found.w = found.w;
+		answer.found.h = found.h;
+		answer.found.score = score;
+		break;
+	}
+	if (!done) {
+		SDL_LockMutex(job->camera->mutex);
+		answer.header.arg = job->camera->closing ? ECANCELED : ETIMEDOUT;
+		SDL_UnlockMutex(job->camera->mutex);
+	}
+	reply(job->client, &answer, size, -1);
+
+	close(job->client);
+	SDL_DestroySurface(job->reference);
+	SDL_AddAtomicInt(&job->control->jobs, -1);
+	// Lets camera_cleanup() go on, the camera may be gone after this.
+	camera_unwatch(job->camera);
+	SDL_free(job);
+	return 0;
+}
+
+// Copies the reference image out of the file descriptor the client passed.
+static SDL_Surface *
+load_reference(const struct ControlFind *find, int fd) {
+	const size_t size = (size_t)find->pitch * find->height;
+	SDL_Surface *mapped;
+	SDL_Surface *reference = NULL;
+	struct stat st;
+	void *pixels;
+
+	if (fd < 0 || SDL_ISPIXELFORMAT_FOURCC(find->format) ||
+		SDL_BYTESPERPIXEL(find->format) == 0 ||
+		find->pitch < find->width * SDL_BYTESPERPIXEL(find->format) ||
+		size == 0 || size > CONTROL_REFERENCE_MAX || fstat(fd, &st) < 0 ||
+		(size_t)st.st_size < size) {
+		return NULL;
+	}
+	pixels = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (pixels == MAP_FAILED) {
+		return NULL;
+	}
+	mapped = SDL_CreateSurfaceFrom(
+			find->width, find->height, find->format, pixels, find->pitch);
+	if (mapped != NULL) {
+		reference = SDL_DuplicateSurface(mapped);
+		SDL_DestroySurface(mapped);
+	}
+	munmap(pixels, size);
+	return reference;
+}
+
+// Starts a wait or search on the device's camera. Returns 0 if the job
+// replies, or an errno value.
+static int
+start_job(
+		struct Control *control, struct Device *device, int client,
+		const struct ControlHeader *request, size_t size, int fd) {
+	const bool find = request->command == CONTROL_FIND;
+	struct Job *job;
+	SDL_Thread *thread;
+	int rv = ENOMEM;
+
+	if (size != (find ? sizeof(struct ControlFind)
+					  : sizeof(struct ControlWait))) {
+		return EINVAL;
+	}
+	if (SDL_AddAtomicInt(&control->jobs, 1) >= CONTROL_JOBS_MAX) {
+		SDL_AddAtomicInt(&control->jobs, -1);
+		return EBUSY;
+	}
+	job = SDL_calloc(1, sizeof(*job));
+	if (job == NULL) {
+		goto fail;
+	}
+	job->control = control;
+	job->camera = &device->camera;
+	job->header = *request;
+	job->client = fcntl(client, F_DUPFD_CLOEXEC, 0);
+	if (job->client < 0) {
+		goto fail;
+	}
+	if (find) {
+		const struct ControlFind *request_find =
+				(const struct ControlFind *)request;
+		job->timeout = request_find->timeout;
+		job->min_score = request_find->min_score;
+		job->reference = load_reference(request_find, fd);
+		if (job->reference == NULL) {
+			rv = EINVAL;
+			goto fail;
+		}
+	} else {
+		const struct ControlWait *wait = (const struct ControlWait *)request;
+		job->region = (SDL_Rect){wait->x, wait->y, wait->w, wait->h};
+		job->stable = wait->stable;
+		job->timeout = wait->timeout;
+	}
+
+	// The device can't go while the control mutex is held, and the camera
+	// stays until the job lets go of it.
+	camera_watch(job->camera);
+	thread = SDL_CreateThread(job_thread, "control_job", job);
+	if (thread == NULL) {
+		camera_unwatch(job->camera);
+		rv = EAGAIN;
+		goto fail;
+	}
+	SDL_DetachThread(thread);
+	return 0;
+fail:
+	if (job != NULL) {
+		if (job->client > 0) {
+			close(job->client);
+		}
+		SDL_DestroySurface(job->reference);
+		SDL_free(job);
+	}
+	SDL_AddAtomicInt(&control->jobs, -1);
+	return rv;
+}
+
+// Answers one request, `passed` being a file descriptor that came with it
+// or -1. Returns false if the client has to go.
+static bool
+handle_request(
+		struct Control *control, int client, const Uint8 *message,
+		size_t size, int passed) {
+	const struct ControlHeader *request =
+			(const struct ControlHeader *)message;
+	union {
+		struct ControlHeader header;
+		struct ControlStatus status;
+		struct ControlFrame frame;
+	} answer = {0};
+	size_t answer_size = sizeof(answer.header);
+	struct Device *device = NULL;
+	int fd = -1;
+	bool rv;
+
+	if (size < sizeof(*request)) {
+		return false;
+	}
+	answer.header.command = request->command;
+	answer.header.device = request->device;
+	control->requests++;
+
+	SDL_LockMutex(control->mutex);
+	if (request->device < control->device_count &&
+		control->devices[request->device].connected) {
+		device = &control->devices[request->device];
+	}
+	if (device == NULL) {
+		answer.header.arg = ENODEV;
+	} else if (request->command == CONTROL_INPUT) {
+		answer.header.arg = queue_input(device, request, size);
+	} else if (request->command == CONTROL_STATUS) {
+		answer_size = sizeof(answer.status);
+		get_status(device, &answer.status);
+	} else if (request->command == CONTROL_FRAME) {
+		answer_size = sizeof(answer.frame);
+		fd = get_frame(device, request, &answer.frame);
+	} else if (request->command >= CONTROL_WAIT_CHANGE &&
+			   request->command <= CONTROL_FIND) {
+		answer.header.arg =
+				start_job(control, device, client, request, size, passed);
+		if (answer.header.arg == 0) {
+			// The job replies when it's done.
+			SDL_UnlockMutex(control->mutex);
+			return true;
+		}
+	} else {
+		answer.header.arg = ENOSYS;
+	}
+	// The memfd stays the camera's, sending it makes a copy.
+	rv = reply(client, &answer, answer_size, fd);
+	SDL_UnlockMutex(control->mutex);
+	return rv;
+}
+
+static void
+drop_client(struct Control *control, int client) {
+	for (int i = 0; i < control->client_count; i++) {
+		if (control->clients[i] == client) {
+			control->clients[i] = control->clients[--control->client_count];
+			break;
+		}
+	}
+	close(client);
+}
+
+static void
+accept_clients(struct Control *control) {
+	int client;
+
+	while ((client = accept4(
+					control->listener, NULL, NULL,
+					SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		struct epoll_event event = {.events = EPOLLIN, .data.fd = client};
+
+		if (control->client_count == control->client_capacity) {
+			const int capacity = SDL_max(control->client_capacity * 2, 16);
+			int *clients =
+					SDL_realloc(control->clients, capacity * sizeof(int));
+			if (clients == NULL) {
+				close(client);
+				continue;
+			}
+			control->clients = clients;
+			control->client_capacity = capacity;
+		}
+		if (epoll_ctl(control->epoll, EPOLL_CTL_ADD, client, &event) < 0) {
+			close(client);
+			continue;
+		}
+		control->clients[control->client_count++] = client;
+	}
+}
+
+static void
+serve_client(struct Control *control, int client, Uint32 events) {
+	static Uint8 message[MESSAGE_SIZE];
+
+	for (int i = 0; i < CLIENT_BURST && (events & EPOLLIN); i++) {
+		struct iovec iov = {.iov_base = message, .iov_len = sizeof(message)};
+		union {
+			struct cmsghdr header;
+			char buffer[CMSG_SPACE(sizeof(int))];
+		} passed = {0};
+		struct msghdr msg = {
+				.msg_iov = &iov,
+				.msg_iovlen = 1,
+				.msg_control = passed.buffer,
+				.msg_controllen = sizeof(passed.buffer),
+		};
+		const ssize_t size =
+				recvmsg(client, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		struct cmsghdr *cmsg = size > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+		int fd = -1;
+		bool served;
+
+		if (size < 0 && (errno == EAGAIN || errno == EINTR)) {
+			return;
+		}
+		if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SCM_RIGHTS &&
+			cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+			SDL_memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+		served = size > 0 && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) &&
+				handle_request(control, client, message, size, fd);
+		if (fd >= 0) {
+			close(fd);
+		}
+		if (!served) {
+			control->dropped_clients += size > 0;
+			drop_client(control, client);
+			return;
+		}
+	}
+	if (events & (EPOLLHUP | EPOLLERR) && !(events & EPOLLIN)) {
+		drop_client(control, client);
+	}
+}
+
+static int
+control_thread(void *data) {
+	struct Control *control = data;
+	struct epoll_event events[EPOLL_EVENTS];
+
+	trace_thread("control_thread");
+	while (true) {
+		const int count =
+				epoll_wait(control->epoll, events, EPOLL_EVENTS, -1);
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			SDL_Log("Control socket failed: %s", strerror(errno));
+			break;
+		}
+		for (int i = 0; i < count; i++) {
+			const int fd = events[i].data.fd;
+			if (fd == control->wakeup) {
+				return 0;
+			} else if (fd == control->listener) {
+				accept_clients(control);
+			} else {
+				serve_client(control, fd, events[i].events);
+			}
+		}
+	}
+	return 0;
+}
+
+// Refuses to take over the socket of another kvsm that is still running.
+static bool
+in_use(const struct sockaddr_un *address) {
+	const int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	bool rv;
+
+	if (fd < 0) {
+		return false;
+	}
+	rv = connect(fd, (const struct sockaddr *)address, sizeof(*address)) ==
+			0;
+	close(fd);
+	return rv;
+}
+
+static bool
+listen_on(struct Control *control, const char *path) {
+	struct sockaddr_un address = {.sun_family = AF_UNIX};
+
+	if (SDL_strlcpy(address.sun_path, path, sizeof(address.sun_path)) >=
+		sizeof(address.sun_path)) {
+		return SDL_SetError("Socket path too long: %s", path);
+	}
+	if (in_use(&address)) {
+		return SDL_SetError("%s is in use", path);
+	}
+	unlink(path);
+
+	control->listener =
+			socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (control->listener < 0 ||
+		bind(control->listener, (struct sockaddr *)&address,
+			 sizeof(address)) < 0 ||
+		chmod(path, S_IRUSR | S_IWUSR) < 0 ||
+		listen(control->listener, LISTEN_BACKLOG) < 0) {
+		return SDL_SetError("Couldn't listen on %s: %s", path,
+							strerror(errno));
+	}
+	SDL_strlcpy(control->path, path, sizeof(control->path));
+	return true;
+}
+
+bool
+control_start(
+		struct Control *control, const char *path, struct Device *devices,
+		int device_count) {
+	struct epoll_event event = {.events = EPOLLIN};
+	bool rv = false;
+
+	control->devices = devices;
+	control->device_count = device_count;
+	control->mutex = SDL_CreateMutex();
+	if (control->mutex == NULL || !listen_on(control, path)) {
+		goto out;
+	}
+	control->wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	control->epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (control->wakeup < 0 || control->epoll < 0) {
+		SDL_SetError("Couldn't set up the control socket: %s",
+					 strerror(errno));
+		goto out;
+	}
+	event.data.fd = control->listener;
+	epoll_ctl(control->epoll, EPOLL_CTL_ADD, control->listener, &event);
+	event.data.fd = control->wakeup;
+	epoll_ctl(control->epoll, EPOLL_CTL_ADD, control->wakeup, &event);
+
+	control->thread =
+			SDL_CreateThread(control_thread, "control_thread", control);
+	rv = control->thread != NULL;
+out:
+	if (!rv) {
+		control_cleanup(control);
+	}
+	return rv;
+}
+
+void
+control_lock(struct Control *control) {
+	SDL_LockMutex(control->mutex);
+}
+
+void
+control_unlock(struct Control *control) {
+	SDL_UnlockMutex(control->mutex);
+}
+
+bool
+control_cleanup(struct Control *control) {
+	const Uint64 stop = 1;
+
+	if (control->thread) {
+		if (write(control->wakeup, &stop, sizeof(stop)) < 0) {
+			SDL_Log("Failed to stop control thread: %s", strerror(errno));
+		}
+		SDL_WaitThread(control->thread, NULL);
+		control->thread = NULL;
+		SDL_Log("Control socket: %" SDL_PRIu64 " requests, %" SDL_PRIu64
+				" clients dropped",
+				control->requests, control->dropped_clients);
+	}
+	for (int i = 0; i < control->client_count; i++) {
+		close(control->clients[i]);
+	}
+	SDL_free(control->clients);
+	if (control->path[0] != '\0') {
+		unlink(control->path);
+	}
+	if (control->listener > 0) {
+		close(control->listener);
+	}
+	if (control->epoll > 0) {
+		close(control->epoll);
+	}
+	if (control->wakeup > 0) {
+		close(control->wakeup);
+	}
+	SDL_DestroyMutex(control->mutex);
+	SDL_zerop(control);
+	return true;
+}
@@ -0,0 +1,250 @@
+#include "device.h"
+
+static void
+opened(struct Device *device, SDL_AtomicInt *state, bool success) {
+	SDL_SetAtomicInt(state, success ? DEVICE_OPEN_DONE : DEVICE_OPEN_FAILED);
+
+	SDL_Event event = {
+			.user = {
+					.type = SDL_EVENT_USER,
+					.code = DEVICE_EVENT_CODE,
+					.data1 = device,
+			}};
+	SDL_PushEvent(&event);
+}
+
+static int
+camera_opener(void *data) {
+	struct Device *device = data;
+	struct DeviceInfo *info = &device->info;
+	Uint64 start = SDL_GetTicksNS();
+	bool success =
+			camera_init(&device->camera, info->camera_name, info->camera_index);
+
+	device->camera_open_time = SDL_GetTicksNS() - start;
+	if (!success) {
+		SDL_Log("Couldn't initialize camera %s", info->camera_name);
+	}
+	opened(device, &device->camera_state, success);
+	return 0;
+}
+
+static int
+input_opener(void *data) {
+	struct Device *device = data;
+	struct DeviceInfo *info = &device->info;
+	Uint64 start = SDL_GetTicksNS();
+	bool success = input_init(&device->input, info->serial_path);
+
+	if (!success) {
+		SDL_Log("Couldn't initialize input %s: %s", info->serial_path,
+				SDL_GetError());
+		// input_init() already cleaned up after itself.
+		SDL_zero(device->input);
+	} else if (!input_start(&device->input)) {
+		SDL_Log("Couldn't start input %s", info->serial_path);
+		input_cleanup(&device->input);
+		SDL_zero(device->input);
+		success = false;
+	}
+
+	device->input_open_time = SDL_GetTicksNS() - start;
+	opened(device, &device->input_state, success);
+	return 0;
+}
+
+bool
+device_open_camera(struct Device *device) {
+	if (SDL_GetAtomicInt(&device->camera_state) != DEVICE_OPEN_IDLE) {
+		return true;
+	}
+
+	SDL_SetAtomicInt(&device->camera_state, DEVICE_OPEN_PENDING);
+	device->camera_opener =
+			SDL_CreateThread(camera_opener, "camera_opener", device);
+	if (!device->camera_opener) {
+		SDL_Log("Failed to create camera opener: %s", SDL_GetError());
+		SDL_SetAtomicInt(&device->camera_state, DEVICE_OPEN_FAILED);
+		return false;
+	}
+	return true;
+}
+
+bool
+device_open_input(struct Device *device) {
+	if (!device_has_input(device) ||
+		SDL_GetAtomicInt(&device->input_state) != DEVICE_OPEN_IDLE) {
+		return true;
+	}
+
+	SDL_SetAtomicInt(&device->input_state, DEVICE_OPEN_PENDING);
+	device->input_opener =
+			SDL_CreateThread(input_opener, "input_opener", device);
+	if (!device->input_opener) {
+		SDL_Log("Failed to create input opener: %s", SDL_GetError());
+		SDL_SetAtomicInt(&device->input_state, DEVICE_OPEN_FAILED);
+		return false;
+	}
+	return true;
+}
+
+bool
+device_open(struct Device *device) {
+	bool rv = device_open_input(device);
+	return device_open_camera(device) && rv;
+}
+
+bool
+device_opening(struct Device *device) {
+	return SDL_GetAtomicInt(&device->camera_state) == DEVICE_OPEN_PENDING ||
+			SDL_GetAtomicInt(&device->input_state) == DEVICE_OPEN_PENDING;
+}
+
+static void
+join_opener(SDL_Thread **opener, SDL_AtomicInt *state, bool wait) {
+	if (*opener && (wait || SDL_GetAtomicInt(state) != DEVICE_OPEN_PENDING)) {
+		SDL_WaitThread(*opener, NULL);
+		*opener = NULL;
+	}
+}
+
+bool
+device_finish_open(struct Device *device) {
+	int camera_state, input_state;
+
+	join_opener(&device->camera_opener, &device->camera_state, false);
+	join_opener(&device->input_opener, &device->input_state, false);
+	if (device->connected || device->camera_opener || device->input_opener) {
+		return false;
+	}
+
+	camera_state = SDL_GetAtomicInt(&device->camera_state);
+	input_state = SDL_GetAtomicInt(&device->input_state);
+	if (camera_state != DEVICE_OPEN_DONE) {
+		// Without a picture the device is useless. Start over on the next
+		// attempt.
+		if (input_state == DEVICE_OPEN_DONE) {
+			input_cleanup(&device->input);
+			SDL_zero(device->input);
+		}
+		camera_cleanup(&device->camera);
+		SDL_zero(device->camera);
+		SDL_SetAtomicInt(&device->camera_state, DEVICE_OPEN_IDLE);
+		SDL_SetAtomicInt(&device->input_state, DEVICE_OPEN_IDLE);
+		return true;
+	}
+
+	if (input_state == DEVICE_OPEN_FAILED) {
+		// Keep showing the device, but as view-only.
+		device->info.serial_path[0] = '\0';
+	} else if (input_state == DEVICE_OPEN_DONE) {
+		input_set_rect(&device->input, &device->rect);
+	}
+
+	device->connected = true;
+	return true;
+}
+
+bool
+device_has_input(struct Device *device) {
+	return device->info.serial_path[0] != '\0';
+}
+
+bool
+device_set_rect(struct Device *device, const SDL_FRect *rect) {
+	device->rect = *rect;
+	if (device->connected && device_has_input(device)) {
+		input_set_rect(&device->input, &device->rect);
+	}
+	return true;
+}
+
+bool
+device_visible(struct Device *device) {
+	return device->rect.w > 0 && device->rect.h > 0;
+}
+
+bool
+device_send_input_event(
+		struct Device *device, SDL_Event *event, bool rel_mouse) {
+	if (!device->connected || !device_has_input(device)) {
+		return false;
+	}
+	// Nothing may get in the way of a macro, but keys let go of must not
+	// get stuck.
+	if (input_playing(&device->input) && event->type != SDL_EVENT_KEY_UP) {
+		return false;
+	}
+	return input_send_input_event(&device->input, event, rel_mouse);
+}
+
+bool
+device_paste(
+		struct Device *device, const char *text, enum Ch9329Layout layout,
+		int interval) {
+	if (!device->connected || !device_has_input(device)) {
+		return false;
+	}
+	return input_paste(&device->input, text, layout, interval);
+}
+
+// Starts recording, or stops and saves the recording up to `until`.
+bool
+device_record(struct Device *device, const char *path, Uint64 until) {
+	if (!device->connected || !device_has_input(device)) {
+		return SDL_SetError("The device has no input");
+	}
+	if (input_recording(&device->input)) {
+		return input_record_stop(&device->input, path, until);
+	}
+	if (input_record_start(&device->input)) {
+		SDL_Log("Recording input for %s", path);
+		return true;
+	}
+	return false;
+}
+
+// Starts replaying a macro, or stops the one playing.
+bool
+device_play(struct Device *device, const char *path, bool fastest) {
+	if (!device->connected || !device_has_input(device)) {
+		return SDL_SetError("The device has no input");
+	}
+	if (input_playing(&device->input)) {
+		return input_play_stop(&device->input);
+	}
+	return input_play(&device->input, path, fastest);
+}
+
+// Cleans up after a macro that played to its end.
+bool
+device_play_done(struct Device *device) {
+	if (!device->connected || !device_has_input(device) ||
+		input_playing(&device->input)) {
+		return false;
+	}
+	return input_play_stop(&device->input);
+}
+
+bool
+device_cleanup(struct Device *device) {
+	// Wait for a bring-up that is still in flight, then tear down whatever it
+	// managed to open.
+	join_opener(&device->camera_opener, &device->camera_state, true);
+	join_opener(&device->input_opener, &device->input_state, true);
+
+	if (SDL_GetAtomicInt(&device->input_state) == DEVICE_OPEN_DONE) {
+		input_cleanup(&device->input);
+	}
+	if (SDL_GetAtomicInt(&device->camera_state) != DEVICE_OPEN_IDLE) {
+		camera_cleanup(&device->camera);
+	}
+
+	// Leave the device ready to be opened again on reconnect.
+	SDL_zero(device->input);
+	SDL_zero(device->camera);
+	SDL_SetAtomicInt(&device->camera_state, DEVICE_OPEN_IDLE);
+	SDL_SetAtomicInt(&device->input_state, DEVICE_OPEN_IDLE);
+	device->connected = false;
+	return true;
+}
@@ -0,0 +1,300 @@
+#include "discovery.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+static bool
+is_capture(struct udev_device *device) {
+	const char *capabilities =
+			udev_device_get_property_value(device, "ID_V4L_CAPABILITIES");
+	return capabilities && SDL_strstr(capabilities, ":capture:");
+}
+
+// The capture chip and the USB serial bridge of the CH9329 sit behind a hub
+// inside the dongle. Returns that hub, or NULL if the device isn't behind one.
+static struct udev_device *
+dongle_hub(struct udev_device *device) {
+	struct udev_device *usb, *hub;
+
+	usb = udev_device_get_parent_with_subsystem_devtype(
+			device, "usb", "usb_device");
+	if (!usb) {
+		return NULL;
+	}
+	hub = udev_device_get_parent_with_subsystem_devtype(
+			usb, "usb", "usb_device");
+	// Root hubs have no USB parent. Everything plugged into the machine
+	// directly shares one, so they don't pair anything.
+	if (!hub ||
+		!udev_device_get_parent_with_subsystem_devtype(
+				hub, "usb", "usb_device")) {
+		return NULL;
+	}
+	return hub;
+}
+
+// SDL picks identical cameras by the order they appeared in. Approximate
+// that by the minor number of the device node.
+static int
+camera_index(
+		struct Discovery *discovery, const char *name,
+		struct udev_device *video) {
+	int index = 0;
+	struct udev_list_entry *entry;
+	struct udev_enumerate *enumerate = udev_enumerate_new(discovery->udev);
+
+	udev_enumerate_add_match_subsystem(enumerate, "video4linux");
+	udev_enumerate_scan_devices(enumerate);
+	udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+		struct udev_device *device = udev_device_new_from_syspath(
+				discovery->udev, udev_list_entry_get_name(entry));
+		const char *device_name;
+
+		if (!device) {
+			continue;
+		}
+		device_name = udev_device_get_sysattr_value(device, "name");
+		if (is_capture(device) && device_name &&
+			SDL_strcmp(device_name, name) == 0 &&
+			minor(udev_device_get_devnum(device)) <
+					minor(udev_device_get_devnum(video))) {
+			index++;
+		}
+		udev_device_unref(device);
+	}
+	udev_enumerate_unref(enumerate);
+	return index;
+}
+
+static bool
+pair_devices(
+		struct Discovery *discovery, struct udev_device *hub,
+		struct DeviceInfo *info) {
+	bool has_video = false, has_serial = false;
+	struct udev_list_entry *entry;
+	struct udev_enumerate *enumerate = udev_enumerate_new(discovery->udev);
+
+	SDL_zerop(info);
+	udev_enumerate_add_match_parent(enumerate, hub);
+	udev_enumerate_add_match_subsystem(enumerate, "video4linux");
+	udev_enumerate_add_match_subsystem(enumerate, "tty");
+	udev_enumerate_scan_devices(enumerate);
+	udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+		struct udev_device *device = udev_device_new_from_syspath(
+				discovery->udev, udev_list_entry_get_name(entry));
+		const char *subsystem, *devnode, *name;
+
+		if (!device) {
+			continue;
+		}
+		subsystem = udev_device_get_subsystem(device);
+		devnode = udev_device_get_devnode(device);
+		name = udev_device_get_sysattr_value(device, "name");
+		if (!subsystem || !devnode) {
+			// Not a device node.
+		} else if (
+				!has_video && SDL_strcmp(subsystem, "video4linux") == 0 &&
+				name && is_capture(device)) {
+			SDL_strlcpy(
+					info->camera_name, name, sizeof(info->camera_name));
+			SDL_strlcpy(info->video_path, devnode, sizeof(info->video_path));
+			info->camera_index = camera_index(discovery, name, device);
+			has_video = true;
+		} else if (!has_serial && SDL_strcmp(subsystem, "tty") == 0) {
+			SDL_strlcpy(
+					info->serial_path, devnode, sizeof(info->serial_path));
+			has_serial = true;
+		}
+		udev_device_unref(device);
+	}
+	udev_enumerate_unref(enumerate);
+
+	SDL_strlcpy(
+			info->usb_path, udev_device_get_syspath(hub),
+			sizeof(info->usb_path));
+	return has_video && has_serial;
+}
+
+static void
+push_event(const struct DiscoveryEvent *event) {
+	struct DiscoveryEvent *copy = SDL_malloc(sizeof(struct DiscoveryEvent));
+	if (!copy) {
+		return;
+	}
+	SDL_memcpy(copy, event, sizeof(struct DiscoveryEvent));
+
+	SDL_Event sdl_event = {
+			.user = {
+					.type = SDL_EVENT_USER,
+					.code = DISCOVERY_EVENT_CODE,
+					.data1 = copy,
+			}};
+	if (!SDL_PushEvent(&sdl_event)) {
+		SDL_free(copy);
+	}
+}
+
+static void
+handle_device(struct Discovery *discovery, struct udev_device *device) {
+	struct DiscoveryEvent event = {0};
+	struct udev_device *hub;
+	const char *action = udev_device_get_action(device);
+	const char *devnode = udev_device_get_devnode(device);
+
+	if (!action || !devnode) {
+		return;
+	}
+
+	if (SDL_strcmp(action, "remove") == 0) {
+		// sysfs is gone already, so only the device node is left to match.
+		event.action = DISCOVERY_REMOVE;
+		SDL_strlcpy(event.devnode, devnode, sizeof(event.devnode));
+		push_event(&event);
+	} else if (SDL_strcmp(action, "add") == 0) {
+		// Video and serial port show up one after the other. Only the later
+		// one completes the pair.
+		hub = dongle_hub(device);
+		if (hub && pair_devices(discovery, hub, &event.info)) {
+			event.action = DISCOVERY_ADD;
+			push_event(&event);
+		}
+	}
+}
+
+static int
+discovery_thread(void *data) {
+	struct Discovery *discovery = data;
+	struct pollfd fds[] = {
+			{.fd = udev_monitor_get_fd(discovery->monitor), .events = POLLIN},
+			{.fd = discovery->wakeup, .events = POLLIN},
+	};
+
+	while (true) {
+		if (poll(fds, SDL_arraysize(fds), -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			SDL_Log("Device discovery failed: %s", strerror(errno));
+			break;
+		}
+		if (fds[1].revents) {
+			break;
+		}
+		if (fds[0].revents & POLLIN) {
+			struct udev_device *device =
+					udev_monitor_receive_device(discovery->monitor);
+			if (device) {
+				handle_device(discovery, device);
+				udev_device_unref(device);
+			}
+		}
+	}
+	return 0;
+}
+
+bool
+discovery_init(struct Discovery *discovery) {
+	bool rv = false;
+
+	discovery->udev = udev_new();
+	if (!discovery->udev) {
+		goto out;
+	}
+
+	// Start listening before the initial scan so that no dongle plugged in
+	// in between gets lost.
+	discovery->monitor =
+			udev_monitor_new_from_netlink(discovery->udev, "udev");
+	if (!discovery->monitor) {
+		goto out;
+	}
+	if (udev_monitor_filter_add_match_subsystem_devtype(
+				discovery->monitor, "video4linux", NULL) < 0 ||
+		udev_monitor_filter_add_match_subsystem_devtype(
+				discovery->monitor, "tty", NULL) < 0 ||
+		udev_monitor_enable_receiving(discovery->monitor) < 0) {
+		goto out;
+	}
+
+	discovery->wakeup = eventfd(0, EFD_CLOEXEC);
+	if (discovery->wakeup < 0) {
+		goto out;
+	}
+
+	rv = true;
+out:
+	if (!rv) {
+		discovery_cleanup(discovery);
+	}
+	return rv;
+}
+
+int
+discovery_scan(
+		struct Discovery *discovery, struct DeviceInfo *infos, int max) {
+	int count = 0;
+	struct udev_list_entry *entry;
+	struct udev_enumerate *enumerate = udev_enumerate_new(discovery->udev);
+
+	udev_enumerate_add_match_subsystem(enumerate, "video4linux");
+	udev_enumerate_scan_devices(enumerate);
+	udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+		struct udev_device *hub;
+		struct udev_device *device = udev_device_new_from_syspath(
+				discovery->udev, udev_list_entry_get_name(entry));
+		bool known = false;
+
+		if (!device) {
+			continue;
+		}
+		hub = is_capture(device) ? dongle_hub(device) : NULL;
+		for (int i = 0; hub && i < count; i++) {
+			known |= SDL_strcmp(
+							 infos[i].usb_path,
+							 udev_device_get_syspath(hub)) == 0;
+		}
+		if (hub && !known && count < max &&
+			pair_devices(discovery, hub, &infos[count])) {
+			count++;
+		}
+		udev_device_unref(device);
+	}
+	udev_enumerate_unref(enumerate);
+
+	return count;
+}
+
+bool
+discovery_start(struct Discovery *discovery) {
+	discovery->thread =
+			SDL_CreateThread(discovery_thread, "discovery_thread", discovery);
+	if (!discovery->thread) {
+		SDL_Log("Failed to create discovery thread: %s", SDL_GetError());
+		return false;
+	}
+	return true;
+}
+
+bool
+discovery_cleanup(struct Discovery *discovery) {
+	const uint64_t stop = 1;
+
+	if (discovery->thread) {
+		if (write(discovery->wakeup, &stop, sizeof(stop)) < 0) {
+			SDL_Log("Failed to stop discovery thread: %s", strerror(errno));
+		}
+		SDL_WaitThread(discovery->thread, NULL);
+	}
+	// Never set up when the devices come from the command line.
+	if (discovery->wakeup > 0) {
+		close(discovery->wakeup);
+	}
+	udev_monitor_unref(discovery->monitor);
+	udev_unref(discovery->udev);
+	SDL_zerop(discovery);
+	return true;
+}
@@ -1,8 +1,13 @@
 #include "input.h"
+#include "latency.h"
+#include "trace.h"
 #include "SDL3/SDL_scancode.h"
+#include <assert.h>
 #include <ch9329.h>
+#include <errno.h>
+#include <poll.h>
 #include <stdbool.h>
-#include <sys/select.h>
+#include <sys/eventfd.h>
 
 #define MOD_LCTRL (1 << 0)
 #define MOD_LSHIFT (1 << 1)
@@ -13,27 +18,193 @@
 #define MOD_RALT (1 << 6)
 #define MOD_RGUI (1 << 7)
 
-#define DEBOUNCE_THRESHOULD 5
+#define PIPELINE_WINDOW 4
+#define STATUS_INTERVAL_MIN 20
+#define STATUS_INTERVAL_MAX 1000
+
+#define QUEUE_MASK (INPUT_QUEUE_SIZE - 1)
+#define MOTION_VALID (1u << 31)
+
+static_assert(
+		(INPUT_QUEUE_SIZE & QUEUE_MASK) == 0,
+		"INPUT_QUEUE_SIZE must be a power of two");
+
+static int
+lag_bucket(int distance) {
+	int bucket = 0;
+	while (distance > 0 && bucket < INPUT_LAG_BUCKETS - 1) {
+		distance >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+// Follows the report just queued for a key or button, unless it changed
+// nothing and was never queued.
+static void
+track(struct Input *input, const struct InputEvent *event, int channel,
+	  enum Ch9329Command command) {
+	struct InputTrack *track;
+
+	if (input->track_count == INPUT_TRACKS) {
+		input->track_head = (input->track_head + 1) % INPUT_TRACKS;
+		input->track_count--;
+	}
+	track = &input->tracks[
+			(input->track_head + input->track_count++) % INPUT_TRACKS];
+	track->event = event->event.common.timestamp;
+	track->enqueued = event->enqueued;
+	track->written = 0;
+	track->command = command;
+	SDL_memcpy(track->report, input->hid.reports[channel],
+			   CH9329_REPORT_SIZE);
+}
+
+// Everything queued has been written once the library holds nothing back.
+static void
+tracks_written(struct Input *input) {
+	const Uint64 now = SDL_GetTicksNS();
+
+	if (input->hid.unsent > 0 || input->hid.tx_len > 0) {
+		return;
+	}
+	for (int i = input->track_count - 1; i >= 0; i--) {
+		struct InputTrack *track =
+				&input->tracks[(input->track_head + i) % INPUT_TRACKS];
+		if (track->written) {
+			break;
+		}
+		track->written = now;
+	}
+}
+
+// Finds the track of an acknowledged report. Reports are acknowledged in
+// order, tracks before it belong to reports that were lost or replaced.
+static void
+track_done(
+		struct Input *input, const struct Ch9329Frame *request,
+		const struct Ch9329Frame *response) {
+	const Uint64 now = SDL_GetTicksNS();
+	const int len = SDL_min(ch9329_frame_len(request), CH9329_REPORT_SIZE);
+
+	for (int i = 0; i < input->track_count; i++) {
+		const struct InputTrack *track =
+				&input->tracks[(input->track_head + i) % INPUT_TRACKS];
+		if (track->command != ch9329_frame_command(request) ||
+			SDL_memcmp(track->report, ch9329_frame_data(request), len)) {
+			continue;
+		}
+		if (response && track->written) {
+			latency_record(LATENCY_WRITE, track->enqueued, track->written);
+			latency_record(LATENCY_ACK, track->written, now);
+			latency_record(LATENCY_INPUT, track->event, now);
+		}
+		input->track_head = (input->track_head + i + 1) % INPUT_TRACKS;
+		input->track_count -= i + 1;
+		return;
+	}
+}
+
+static void
+background_done(struct Input *input) {
+	if (input->background > 0) {
+		input->background--;
+	}
+}
+
+// Notes how long the position took and how far behind the pointer it is.
+static void
+motion_done(
+		struct Input *input, const struct Ch9329Frame *request,
+		const struct Ch9329Frame *response) {
+	const Uint8 *data = ch9329_frame_data(request);
+	const Uint32 pointer = SDL_GetAtomicU32(&input->pointer);
+	const Uint64 rtt = SDL_GetTicksNS() - input->motion_sent_at;
+	int dx = (int)(pointer & 0xffff) - (data[2] | data[3] << 8);
+	int dy = (int)((pointer >> 16) & 0x7fff) - (data[4] | data[5] << 8);
+
+	// Skipped and superseded reports say nothing about the link.
+	if (response) {
+		input->motion_rtt = input->motion_rtt
+				? (input->motion_rtt * 7 + rtt) / 8
+				: rtt;
+	}
+	input->lag_histogram[lag_bucket(SDL_max(SDL_abs(dx), SDL_abs(dy)))]++;
+}
+
+static void
+hid_done(
+		struct Ch9329 *hid, const struct Ch9329Frame *request,
+		enum Ch9329Error error, const struct Ch9329Frame *response,
+		void *userdata) {
+	struct Input *input = userdata;
+	const Uint8 *data = ch9329_frame_data(request);
+	// A redundant report is done before it's queued. It has the bytes of
+	// the report still on its way, whose track must stay.
+	const bool saved = hid->reports_saved != input->reports_saved;
+
+	input->reports_saved = hid->reports_saved;
+	switch (ch9329_frame_command(request)) {
+	case CH9329_CMD_SEND_MS_ABS_DATA:
+		background_done(input);
+		motion_done(input, request, response);
+		break;
+	case CH9329_CMD_SEND_MS_REL_DATA:
+		// Button reports don't move anything, they aren't background.
+		if (data[2] || data[3] || data[4]) {
+			background_done(input);
+		} else if (!saved) {
+			track_done(input, request, error ? NULL : response);
+		}
+		break;
+	case CH9329_CMD_SEND_KB_GENERAL_DATA:
+		if (!saved) {
+			track_done(input, request, error ? NULL : response);
+		}
+		break;
+	default:
+		break;
+	}
+	if (error != CH9329_SUCCESS) {
+		SDL_Log("CH9329 command 0x%02x failed with 0x%02x",
+				ch9329_frame_command(request), error);
+	}
+}
 
 bool
 input_init(struct Input *input, const char *input_name) {
 	bool rv = false;
+	// Don't let a cleanup after an early failure close stdin.
+	input->hid.fd = -1;
+	input->wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (input->wakeup < 0) {
+		SDL_SetError("Couldn't create eventfd: %s", strerror(errno));
+		goto out;
+	}
 	input->mutex = SDL_CreateMutex();
 	if (input->mutex == NULL) {
 		goto out;
 	}
-	input->condition_mutex = SDL_CreateMutex();
-	if (input->condition_mutex == NULL) {
+
+	for (Uint32 i = 0; i < INPUT_QUEUE_SIZE; i++) {
+		SDL_SetAtomicU32(&input->queue[i].sequence, i);
+	}
+	input->status_interval = STATUS_INTERVAL_MIN;
+
+	if (ch9329_open(&input->hid, input_name, 100) < 0) {
 		goto out;
 	}
-	input->condition = SDL_CreateCondition();
-	if (input->condition == NULL) {
+	// A factory fresh chip talks at 9600 baud. Every report takes a
+	// fraction of the time at the fastest speed both ends support.
+	if (ch9329_detect_baud(&input->hid, CH9329_BAUD_MAX) < 0) {
+		SDL_SetError("No CH9329 answering on %s", input_name);
 		goto out;
 	}
-
-	input->status_interval = 100;
-
-	if (ch9329_open(&input->hid, input_name, 100) < 0) {
+	SDL_Log("CH9329 on %s talks at %d baud", input_name,
+			ch9329_negotiate_baud(&input->hid, CH9329_BAUD_MAX));
+	// Reports go out without waiting for the previous one to be
+	// acknowledged.
+	if (ch9329_pipeline(&input->hid, PIPELINE_WINDOW, hid_done, input) < 0) {
 		goto out;
 	}
 
@@ -67,57 +238,143 @@ button(struct Input *input, Uint8 button, bool pressed) {
 
 static bool
 mouse_abs(struct Input *input, Uint16 x, Uint16 y) {
-	x = (x - input->rect.x) * 4096 / input->rect.w;
-	y = (y - input->rect.y) * 4096 / input->rect.h;
-	if (x > 4095) {
-		x = 4095;
+	// Positions the target already has are acknowledged right away.
+	input->background++;
+	input->motion_sent_at = SDL_GetTicksNS();
+	if (ch9329_mouse_abs(&input->hid, x, y) < 0) {
+		// Reports still in flight are acknowledged as usual.
+		input->background--;
+		return false;
+	}
+	return true;
+}
+
+// Sends as much relative motion as fits into one report.
+static bool
+mouse_rel(struct Input *input) {
+	const int x = SDL_clamp(input->rel_x, INT8_MIN, INT8_MAX);
+	const int y = SDL_clamp(input->rel_y, INT8_MIN, INT8_MAX);
+
+	input->background++;
+	if (ch9329_mouse_rel(&input->hid, x, y) < 0) {
+		// The distance stays for the next report.
+		input->background--;
+		return false;
+	}
+	input->rel_x -= x;
+	input->rel_y -= y;
+	return true;
+}
+
+// Gets the pointer to where it was when a button changed.
+static void
+mouse_move(struct Input *input, const struct InputEvent *event) {
+	if (!event->rel_mouse) {
+		mouse_abs(input, event->x, event->y);
+		return;
+	}
+	while ((input->rel_x || input->rel_y) && mouse_rel(input)) {
 	}
-	if (y > 4095) {
-		y = 4095;
+}
+
+// Sends as many steps as fit into one report. Returns the rest.
+static int
+mouse_wheel(struct Input *input, int steps) {
+	const int step = SDL_clamp(steps, INT8_MIN, INT8_MAX);
+
+	input->background++;
+	if (ch9329_mouse_wheel(&input->hid, step) < 0) {
+		// The steps are tried again with the next report.
+		input->background--;
+		return steps;
 	}
-	return ch9329_mouse_abs(&input->hid, x, y) >= 0;
+	return steps - step;
 }
 
+// Something may change the LEDs soon, look more often for a while.
+static void
+status_boost(struct Input *input, Uint64 now) {
+	input->status_interval = STATUS_INTERVAL_MIN;
+	input->status_time = now;
+}
+
+// Returns false if the library had no room for the reports. The event is
+// handled again once some are acknowledged; pressing or releasing a key
+// twice changes nothing.
 static bool
-handle_input_event(struct Input *input, struct InputEvent *event) {
+handle_input_event(struct Input *input, const struct InputEvent *event) {
+	const unsigned long saved = input->hid.reports_saved;
+	bool sent = false;
+	bool rv = true;
+
+	TRACE_BEGIN("handle_input_event");
+	errno = 0;
 	switch (event->event.type) {
 	case SDL_EVENT_KEY_DOWN:
-		ch9329_keyboard(&input->hid, event->event.key.scancode, true);
+		sent = ch9329_keyboard(&input->hid, event->event.key.scancode, true) >=
+				0;
+		switch (event->event.key.scancode) {
+		case SDL_SCANCODE_CAPSLOCK:
+		case SDL_SCANCODE_NUMLOCKCLEAR:
+		case SDL_SCANCODE_SCROLLLOCK:
+			input->lock_key_time = SDL_GetTicks();
+			status_boost(input, input->lock_key_time);
+			break;
+		default:
+			break;
+		}
 		break;
 	case SDL_EVENT_KEY_UP:
-		ch9329_keyboard(&input->hid, event->event.key.scancode, false);
+		sent = ch9329_keyboard(&input->hid, event->event.key.scancode, false) >=
+				0;
 		break;
 	case SDL_EVENT_MOUSE_MOTION:
-		mouse_abs(input, event->event.motion.x, event->event.motion.y);
+		// Relative motion is merged into as few reports as possible.
+		if (input->rel_x || input->rel_y) {
+			SDL_AddAtomicInt(&input->coalesced, 1);
+		}
+		input->rel_x += event->dx;
+		input->rel_y += event->dy;
 		break;
 	case SDL_EVENT_MOUSE_BUTTON_DOWN:
-		button(input, event->event.button.button, true);
+		// The click belongs where the pointer was, not where it is now.
+		mouse_move(input, event);
+		sent = button(input, event->event.button.button, true);
 		break;
 	case SDL_EVENT_MOUSE_BUTTON_UP:
-		button(input, event->event.button.button, false);
-		break;
-	case SDL_EVENT_MOUSE_WHEEL:
-		ch9329_mouse_wheel(&input->hid, event->event.wheel.y);
+		mouse_move(input, event);
+		sent = button(input, event->event.button.button, false);
 		break;
 	}
-	return true;
+
+	if (sent && input->hid.reports_saved == saved) {
+		if (event->event.type == SDL_EVENT_KEY_DOWN ||
+			event->event.type == SDL_EVENT_KEY_UP) {
+			track(input, event, CH9329_CHANNEL_KEYBOARD,
+				  CH9329_CMD_SEND_KB_GENERAL_DATA);
+		} else {
+			track(input, event, CH9329_CHANNEL_MOUSE_REL,
+				  CH9329_CMD_SEND_MS_REL_DATA);
+		}
+	} else if (!sent && errno == EAGAIN) {
+		rv = false;
+	} else if (!sent && errno != 0) {
+		SDL_AddAtomicInt(&input->dropped, 1);
+	}
+	TRACE_END("handle_input_event");
+	return rv;
 }
 
+// Returns whether the status is different from the last one.
 static bool
-status_update(struct Input *input) {
-	bool rv = false;
+status_changed(struct Input *input, const struct Ch9329Frame *frame) {
 	bool changed;
-	struct Ch9329Frame frame = {0};
-	rv = ch9329_get_info(&input->hid, &frame) >= 0;
-	if (!rv) {
-		goto out;
-	}
 
-	SDL_LockMutex(input->mutex);
+	TRACE_LOCK(input->mutex, "input->mutex");
 	changed = 0 !=
-			SDL_memcmp(&input->hid_status, &frame, sizeof(struct Ch9329Frame));
+			SDL_memcmp(&input->hid_status, frame, sizeof(struct Ch9329Frame));
 	if (changed) {
-		SDL_memcpy(&input->hid_status, &frame, sizeof(struct Ch9329Frame));
+		SDL_memcpy(&input->hid_status, frame, sizeof(struct Ch9329Frame));
 	}
 	SDL_UnlockMutex(input->mutex);
 
@@ -126,70 +383,359 @@ status_update(struct Input *input) {
 				.user = {
 						.type = SDL_EVENT_USER,
 						.code = INPUT_EVENT_CODE,
+						.data1 = input,
 				}};
 		SDL_PushEvent(&event);
 	}
+	return changed;
+}
 
-	rv = true;
+static bool
+status_update(struct Input *input) {
+	bool rv = false;
+	struct Ch9329Frame frame = {0};
+	TRACE_BEGIN("ch9329_get_info");
+	rv = ch9329_get_info(&input->hid, &frame) >= 0;
+	TRACE_END("ch9329_get_info");
+	if (!rv) {
+		goto out;
+	}
+
+	status_changed(input, &frame);
 out:
 	return rv;
 }
 
+static void
+status_done(
+		struct Ch9329 *hid, const struct Ch9329Frame *request,
+		enum Ch9329Error error, const struct Ch9329Frame *response,
+		void *userdata) {
+	struct Input *input = userdata;
+	const Uint64 now = SDL_GetTicks();
+	const bool connected = ch9329_frame_data(&input->hid_status)[1] == 0x01;
+	(void)hid;
+	(void)request;
+
+	input->status_pending = false;
+	background_done(input);
+	if (error != CH9329_SUCCESS || !response) {
+		return;
+	}
+
+	if (!status_changed(input, response)) {
+		input->status_interval =
+				SDL_min(input->status_interval * 2, STATUS_INTERVAL_MAX);
+		if (now - input->lock_key_time > STATUS_INTERVAL_MAX) {
+			// The target doesn't seem to care about that key.
+			input->lock_key_time = 0;
+		}
+		return;
+	}
+
+	input->status_changes++;
+	if (input->lock_key_time) {
+		const Uint64 latency = now - input->lock_key_time;
+		input->status_latency_count++;
+		input->status_latency_total += latency;
+		input->status_latency_max = SDL_max(input->status_latency_max, latency);
+		input->lock_key_time = 0;
+	}
+	// Changes come in bursts. A target that just came up sets its LEDs
+	// once it has found the keyboard.
+	status_boost(input, now);
+	if (!connected && ch9329_frame_data(response)[1] == 0x01) {
+		SDL_Log("Target connected to the CH9329");
+	}
+}
+
+// Asks for the LED status once the input has been idle for status_interval.
+// That starts out short and doubles every time nothing changed.
+// Returns how long until the next request is due.
 static int
-debounce_events(struct Input *input) {
-	bool debounce = true;
-	while (debounce) {
-		SDL_LockMutex(input->mutex);
-		struct InputEvent *event_item =
-				&input->event_ring[input->event_ring_last_head];
-		if (event_item->event.type != SDL_EVENT_MOUSE_MOTION) {
-			debounce = false;
-		} else if (!SDL_WaitConditionTimeout(
-						   input->condition, input->condition_mutex,
-						   DEBOUNCE_THRESHOULD)) {
-			debounce = false;
+status_poll(struct Input *input, Uint64 now) {
+	struct Ch9329Frame frame = {0};
+	Uint64 due = input->status_time + input->status_interval;
+
+	// Only in the gaps: anything in flight or waiting to be sent comes
+	// first. Its acknowledgement wakes the input thread up again.
+	if (input->status_pending || input->hid.pending_count > 0) {
+		return -1;
+	} else if (now < due) {
+		return (int)(due - now);
+	}
+
+	ch9329_frame(&frame, CH9329_CMD_GET_INFO, NULL, 0);
+	if (ch9329_submit(&input->hid, &frame, status_done, input) >= 0) {
+		input->status_pending = true;
+		input->background++;
+		input->status_polls++;
+	}
+	input->status_time = now;
+	return (int)input->status_interval;
+}
+
+// Any thread may push, a producer claims a slot by advancing queue_head.
+// Each slot's sequence equals its position when free and position + 1 once
+// filled, so the consumer never needs a lock either.
+static bool
+queue_push(struct Input *input, const struct InputEvent *item) {
+	Uint32 head = SDL_GetAtomicU32(&input->queue_head);
+
+	for (;;) {
+		struct InputSlot *slot = &input->queue[head & QUEUE_MASK];
+		Sint32 diff = (Sint32)(SDL_GetAtomicU32(&slot->sequence) - head);
+
+		if (diff < 0) {
+			// The input thread hasn't got to this slot yet.
+			return false;
+		} else if (diff == 0 && SDL_CompareAndSwapAtomicU32(
+										&input->queue_head, head, head + 1)) {
+			slot->item = *item;
+			SDL_SetAtomicU32(&slot->sequence, head + 1);
+			return true;
 		}
-		SDL_UnlockMutex(input->mutex);
+		head = SDL_GetAtomicU32(&input->queue_head);
+	}
+}
+
+// The oldest event, left in its slot until queue_pop().
+static const struct InputEvent *
+queue_peek(struct Input *input) {
+	struct InputSlot *slot = &input->queue[input->queue_tail & QUEUE_MASK];
+
+	if (SDL_GetAtomicU32(&slot->sequence) != input->queue_tail + 1) {
+		return NULL;
+	}
+	return &slot->item;
+}
+
+static void
+queue_pop(struct Input *input) {
+	struct InputSlot *slot = &input->queue[input->queue_tail & QUEUE_MASK];
+
+	SDL_SetAtomicU32(
+			&slot->sequence, input->queue_tail + INPUT_QUEUE_SIZE);
+	input->queue_tail++;
+}
+
+// Keys and buttons are never dropped. Once the queue is full they go onto a
+// list, and so does everything after them until the input thread took it,
+// which keeps them in order.
+static void
+enqueue(struct Input *input, const struct InputEvent *item) {
+	struct InputOverflow *node;
+
+	if (SDL_GetAtomicPointer(&input->overflow) == NULL &&
+		queue_push(input, item)) {
+		return;
+	}
+
+	node = SDL_malloc(sizeof(struct InputOverflow));
+	if (node == NULL) {
+		SDL_AddAtomicInt(&input->dropped, 1);
+		return;
+	}
+	node->item = *item;
+	do {
+		node->next = SDL_GetAtomicPointer(&input->overflow);
+	} while (!SDL_CompareAndSwapAtomicPointer(
+			&input->overflow, node->next, node));
+	SDL_AddAtomicInt(&input->overflowed, 1);
+}
+
+// Takes everything that spilled over, oldest first.
+static struct InputOverflow *
+take_overflow(struct Input *input) {
+	struct InputOverflow *node = SDL_SetAtomicPointer(&input->overflow, NULL);
+	struct InputOverflow *list = NULL;
+
+	while (node) {
+		struct InputOverflow *next = node->next;
+		node->next = list;
+		list = node;
+		node = next;
+	}
+	return list;
+}
+
+// Handles the overflow taken before, oldest first. Returns false if the
+// library ran out of room.
+static bool
+drain_backlog(struct Input *input, int *count) {
+	while (input->backlog) {
+		struct InputOverflow *next = input->backlog->next;
+		if (!handle_input_event(input, &input->backlog->item)) {
+			return false;
+		}
+		SDL_free(input->backlog);
+		input->backlog = next;
+		(*count)++;
+	}
+	return true;
+}
+
+// Hands events to the library while it has room for their reports, the
+// rest wait for acknowledgements. Returns how many events were handled.
+static int
+drain_queue(struct Input *input) {
+	int count = 0;
+	const struct InputEvent *item;
+
+	// Taken from the overflow before, so older than anything queued.
+	if (!drain_backlog(input, &count)) {
+		return count;
+	}
+	while ((item = queue_peek(input)) != NULL) {
+		if (!handle_input_event(input, item)) {
+			return count;
+		}
+		queue_pop(input);
+		count++;
+	}
+	// Anything in the queue now came after the overflow.
+	input->backlog = take_overflow(input);
+	drain_backlog(input, &count);
+	return count;
+}
+
+// Types pasted text, a key at a time. Returns how long until the next one.
+static int
+type_paste(struct Input *input) {
+	int rv = -1;
+
+	if (!input->typing) {
+		input->typing = SDL_SetAtomicPointer(&input->paste, NULL);
+		if (!input->typing) {
+			goto out;
+		}
+		ch9329_typist_init(
+				&input->typist, input->typing->layout, input->typing->text,
+				input->typing->interval, input_status_capslock(input));
+		input->typing_since = SDL_GetTicksNS();
+	}
+
+	rv = ch9329_typist_step(&input->hid, &input->typist);
+	if (rv > 0) {
+		goto out;
+	} else if (rv == 0) {
+		const Uint64 elapsed = SDL_GetTicksNS() - input->typing_since;
+		SDL_Log("Typed %lu characters in %lu reports, %.1f characters/s, "
+				"%lu without a key",
+				input->typist.typed, input->typist.reports,
+				(double)input->typist.typed * SDL_NS_PER_SECOND /
+						(double)(elapsed ? elapsed : 1),
+				input->typist.unmapped);
+	} else {
+		SDL_Log("Couldn't type pasted text: %s", strerror(errno));
+	}
+	SDL_free(input->typing);
+	input->typing = NULL;
+	rv = -1;
+out:
+	return rv;
+}
+
+// Sends what's waiting by priority: keys and buttons all go out right away,
+// then one wheel report, then the newest position or relative motion.
+// Returns how long until pasted text needs the next key. Wheel and motion wait
+// while an earlier one is in flight, so there is never a backlog of stale
+// positions and the motion rate follows the round-trip time of the link.
+static int
+flush_events(struct Input *input, Uint64 now) {
+	Uint32 motion;
+	int wheel;
+	bool sent;
+	int rv;
+
+	// Reports from everything queued up go out in one write.
+	ch9329_cork(&input->hid);
+	sent = drain_queue(input) > 0;
+	rv = type_paste(input);
+	sent = sent || input->typing != NULL;
+
+	if (input->background == 0) {
+		wheel = SDL_SetAtomicInt(&input->wheel, 0);
+		if (wheel != 0) {
+			// Whatever didn't fit goes back, new steps may have come in.
+			SDL_AddAtomicInt(&input->wheel, mouse_wheel(input, wheel));
+			sent = true;
+		}
+	}
+	if (input->background == 0 && (input->rel_x || input->rel_y)) {
+		mouse_rel(input);
+		sent = true;
+	}
+	// A position taken is gone, leave it for later if it can't be queued.
+	if (input->background == 0 &&
+		input->hid.pending_count < CH9329_QUEUE_SIZE) {
+		motion = SDL_SetAtomicU32(&input->motion, 0);
+		if (motion & MOTION_VALID) {
+			mouse_abs(input, motion & 0xffff, (motion >> 16) & 0x7fff);
+			sent = true;
+		}
+	}
+	ch9329_uncork(&input->hid);
+	tracks_written(input);
+
+	if (sent) {
+		// Input counts as activity, the status can wait.
+		input->status_time = now;
+	}
+	return rv;
+}
+
+static int
+min_timeout(int a, int b) {
+	if (a < 0) {
+		return b;
+	} else if (b < 0) {
+		return a;
+	} else {
+		return a < b ? a : b;
 	}
-	return 0;
 }
 
 static int
 input_thread(void *data) {
 	struct Input *input = data;
-	SDL_LockMutex(input->condition_mutex);
-
-	while (true) {
-		struct InputEvent *event_item = NULL;
-		if (SDL_WaitConditionTimeout(
-					input->condition, input->condition_mutex,
-					input->status_interval)) {
-			debounce_events(input);
-
-			SDL_LockMutex(input->mutex);
-			while (input->event_ring_tail != input->event_ring_head) {
-				event_item = &input->event_ring[input->event_ring_tail];
-				input->event_ring_tail =
-						(input->event_ring_tail + 1) % INPUT_EVENT_RING_SIZE;
-				SDL_UnlockMutex(input->mutex);
-				handle_input_event(input, event_item);
-				memset(event_item, 0, sizeof(struct InputEvent));
-				SDL_LockMutex(input->mutex);
-			}
-			SDL_UnlockMutex(input->mutex);
-		} else if (input->status_interval == 0) {
+	struct pollfd fds[2] = {
+			{.fd = input->hid.fd},
+			{.fd = input->wakeup, .events = POLLIN},
+	};
+	int timeout = 0;
+
+	trace_thread("input_thread");
+	while (SDL_GetAtomicInt(&input->running)) {
+		Uint64 now;
+		Uint64 count;
+		bool processed;
+
+		fds[0].events = ch9329_events(&input->hid);
+		if (poll(fds, SDL_arraysize(fds), timeout) < 0 && errno != EINTR) {
+			SDL_Log("Couldn't poll input: %s", strerror(errno));
 			break;
-		} else {
-			if (event_item) {
-				handle_input_event(input, event_item);
-				memset(event_item, 0, sizeof(struct InputEvent));
-			} else {
-				status_update(input);
+		}
+		if (fds[1].revents & POLLIN) {
+			if (read(input->wakeup, &count, sizeof(count)) < 0) {
+				SDL_Log("Couldn't read input wakeup: %s", strerror(errno));
 			}
 		}
+
+		// Acknowledgements first, they may let the next position go.
+		TRACE_BEGIN("ch9329_process");
+		processed = ch9329_process(&input->hid) >= 0;
+		TRACE_END("ch9329_process");
+		if (!processed) {
+			SDL_Log("Lost CH9329: %s", strerror(errno));
+			break;
+		}
+		now = SDL_GetTicks();
+		timeout = flush_events(input, now);
+		timeout = min_timeout(timeout, status_poll(input, now));
+		timeout = min_timeout(timeout, ch9329_timeout(&input->hid));
 	}
 
-	SDL_UnlockMutex(input->condition_mutex);
 	return 0;
 }
 
@@ -197,7 +743,9 @@ bool
 input_start(struct Input *input) {
 	bool rv = false;
 
+	TRACE_BEGIN("ch9329_reset");
 	rv = ch9329_reset(&input->hid) >= 0;
+	TRACE_END("ch9329_reset");
 	if (!rv) {
 		goto out;
 	}
@@ -207,47 +755,326 @@ input_start(struct Input *input) {
 		goto out;
 	}
 
+	// From here on the input thread drives the port from its poll loop.
+	rv = ch9329_set_nonblocking(&input->hid, true) >= 0;
+	if (!rv) {
+		goto out;
+	}
+	input->status_time = SDL_GetTicks();
+	input->status_since = input->status_time;
+
+	SDL_SetAtomicInt(&input->running, 1);
 	input->thread = SDL_CreateThread(input_thread, "input_thread", input);
 	if (input->thread == NULL) {
+		SDL_SetAtomicInt(&input->running, 0);
+		rv = false;
 		goto out;
 	}
 out:
 	return rv;
 }
 
+// Maps a window position onto the 0..4095 grid of absolute mouse reports.
+// Returns false if it's outside of the video.
+static bool
+to_grid(struct Input *input, float x, float y, Uint16 *grid_x,
+		Uint16 *grid_y) {
+	SDL_FPoint p = {x, y};
+	if (!SDL_PointInRectFloat(&p, &input->rect)) {
+		return false;
+	}
+	*grid_x = SDL_min((x - input->rect.x) * 4096 / input->rect.w, 4095);
+	*grid_y = SDL_min((y - input->rect.y) * 4096 / input->rect.h, 4095);
+	return true;
+}
+
+// Hands an event over to the input thread. Safe to call from any thread,
+// the window is only looked at by input_send_input_event().
+static bool
+send_item(struct Input *input, struct InputEvent *item) {
+	const Uint64 one = 1;
+	Uint32 motion;
+
+	item->enqueued = SDL_GetTicksNS();
+	latency_record(
+			LATENCY_ENQUEUE, item->event.common.timestamp, item->enqueued);
+
+	switch (item->event.type) {
+	case SDL_EVENT_MOUSE_MOTION:
+		if (item->rel_mouse) {
+			// Queued along with the buttons, so they stay in order.
+			enqueue(input, item);
+			break;
+		}
+		// Only the latest position is sent, it replaces any older one.
+		motion = MOTION_VALID | (Uint32)item->y << 16 | item->x;
+		SDL_SetAtomicU32(&input->pointer, motion);
+		if (SDL_SetAtomicU32(&input->motion, motion) & MOTION_VALID) {
+			SDL_AddAtomicInt(&input->coalesced, 1);
+		}
+		break;
+	case SDL_EVENT_MOUSE_WHEEL:
+		// Steps add up, however many events they came in.
+		if (SDL_AddAtomicInt(&input->wheel, (int)item->event.wheel.y) != 0) {
+			SDL_AddAtomicInt(&input->coalesced, 1);
+		}
+		break;
+	case SDL_EVENT_MOUSE_BUTTON_DOWN:
+	case SDL_EVENT_MOUSE_BUTTON_UP:
+		if (!item->rel_mouse) {
+			// The button carries the position along, an older one must
+			// not be sent after it.
+			SDL_SetAtomicU32(
+					&input->pointer,
+					MOTION_VALID | (Uint32)item->y << 16 | item->x);
+			SDL_SetAtomicU32(&input->motion, 0);
+		}
+		enqueue(input, item);
+		break;
+	case SDL_EVENT_KEY_DOWN:
+	case SDL_EVENT_KEY_UP:
+		enqueue(input, item);
+		break;
+	default:
+		return false;
+	}
+
+	if (write(input->wakeup, &one, sizeof(one)) < 0) {
+		SDL_Log("Couldn't wake input thread: %s", strerror(errno));
+	}
+	return true;
+}
+
+// Adds an event to the recording, if there is one.
+static void
+record(struct Input *input, const struct InputEvent *item) {
+	struct MacroEvent event = {
+			.time = item->event.common.timestamp,
+			.rel_mouse = item->rel_mouse,
+			.x = item->x,
+			.y = item->y,
+	};
+
+	if (!input->recording.recording) {
+		return;
+	}
+	switch (item->event.type) {
+	case SDL_EVENT_KEY_DOWN:
+	case SDL_EVENT_KEY_UP:
+		event.kind = item->event.type == SDL_EVENT_KEY_DOWN ? MACRO_KEY_DOWN
+															: MACRO_KEY_UP;
+		event.code = item->event.key.scancode;
+		break;
+	case SDL_EVENT_MOUSE_BUTTON_DOWN:
+	case SDL_EVENT_MOUSE_BUTTON_UP:
+		event.kind = item->event.type == SDL_EVENT_MOUSE_BUTTON_DOWN
+				? MACRO_BUTTON_DOWN
+				: MACRO_BUTTON_UP;
+		event.code = item->event.button.button;
+		break;
+	case SDL_EVENT_MOUSE_MOTION:
+		event.kind = MACRO_MOTION;
+		if (item->rel_mouse) {
+			event.x = item->dx;
+			event.y = item->dy;
+		}
+		break;
+	case SDL_EVENT_MOUSE_WHEEL:
+		event.kind = MACRO_WHEEL;
+		event.code = (int)item->event.wheel.y;
+		break;
+	default:
+		return;
+	}
+	if (!macro_record(&input->recording, &event)) {
+		SDL_Log("Couldn't record an input event, the macro is cut short");
+		input->recording.recording = false;
+	}
+}
+
 bool
 input_send_input_event(struct Input *input, SDL_Event *event, bool rel_mouse) {
-	SDL_FPoint p = {event->motion.x, event->motion.y};
-	if (!SDL_PointInRectFloat(&p, &input->rect)) {
+	struct InputEvent item = {.event = *event, .rel_mouse = rel_mouse};
+
+	switch (event->type) {
+	case SDL_EVENT_MOUSE_MOTION:
+		if (rel_mouse) {
+			// Keep the fractions, only whole pixels can be sent.
+			input->rel_x_fraction += event->motion.xrel;
+			input->rel_y_fraction += event->motion.yrel;
+			item.dx = (int)input->rel_x_fraction;
+			item.dy = (int)input->rel_y_fraction;
+			input->rel_x_fraction -= item.dx;
+			input->rel_y_fraction -= item.dy;
+			if (item.dx == 0 && item.dy == 0) {
+				return true;
+			}
+			break;
+		}
+		if (!to_grid(input, event->motion.x, event->motion.y, &item.x,
+					 &item.y)) {
+			return false;
+		}
+		break;
+	case SDL_EVENT_MOUSE_WHEEL:
+		if (!rel_mouse &&
+			!to_grid(input, event->wheel.mouse_x, event->wheel.mouse_y,
+					 &item.x, &item.y)) {
+			return false;
+		}
+		break;
+	case SDL_EVENT_MOUSE_BUTTON_DOWN:
+	case SDL_EVENT_MOUSE_BUTTON_UP:
+		if (!rel_mouse && !to_grid(input, event->button.x, event->button.y,
+								   &item.x, &item.y)) {
+			return false;
+		}
+		break;
+	case SDL_EVENT_KEY_DOWN:
+		// The target repeats held keys itself.
+		if (event->key.repeat) {
+			SDL_AddAtomicInt(&input->repeats, 1);
+			return true;
+		}
+		break;
+	case SDL_EVENT_KEY_UP:
+		break;
+	default:
 		return false;
 	}
 
-	SDL_LockMutex(input->condition_mutex);
+	record(input, &item);
+	return send_item(input, &item);
+}
 
-	struct InputEvent *last_event_item =
-			&input->event_ring[input->event_ring_last_head];
-	if (event->type == SDL_EVENT_MOUSE_MOTION &&
-		last_event_item->event.type == SDL_EVENT_MOUSE_MOTION) {
-		SDL_memcpy(&last_event_item->event, event, sizeof(SDL_Event));
-	} else {
-		struct InputEvent *event_item =
-				&input->event_ring[input->event_ring_head];
-		int next_head = (input->event_ring_head + 1) % INPUT_EVENT_RING_SIZE;
-		SDL_memcpy(&event_item->event, event, sizeof(SDL_Event));
-		event_item->rel_mouse = rel_mouse;
-		input->event_ring_last_head = input->event_ring_head;
-		input->event_ring_head = next_head;
+// Sends an event the way macros keep it. Positions are already on the grid,
+// so it doesn't need the window and any thread may call it.
+bool
+input_inject(struct Input *input, const struct MacroEvent *event) {
+	struct InputEvent item = {.rel_mouse = event->rel_mouse};
+
+	item.event.common.timestamp = SDL_GetTicksNS();
+	if (!event->rel_mouse || event->kind != MACRO_MOTION) {
+		item.x = SDL_clamp(event->x, 0, 4095);
+		item.y = SDL_clamp(event->y, 0, 4095);
+	}
+	switch (event->kind) {
+	case MACRO_KEY_DOWN:
+	case MACRO_KEY_UP:
+		item.event.type = event->kind == MACRO_KEY_DOWN ? SDL_EVENT_KEY_DOWN
+														: SDL_EVENT_KEY_UP;
+		item.event.key.scancode = event->code;
+		item.event.key.down = event->kind == MACRO_KEY_DOWN;
+		break;
+	case MACRO_BUTTON_DOWN:
+	case MACRO_BUTTON_UP:
+		item.event.type = event->kind == MACRO_BUTTON_DOWN
+				? SDL_EVENT_MOUSE_BUTTON_DOWN
+				: SDL_EVENT_MOUSE_BUTTON_UP;
+		item.event.button.button = event->code;
+		item.event.button.down = event->kind == MACRO_BUTTON_DOWN;
+		break;
+	case MACRO_MOTION:
+		item.event.type = SDL_EVENT_MOUSE_MOTION;
+		item.dx = event->x;
+		item.dy = event->y;
+		break;
+	case MACRO_WHEEL:
+		item.event.type = SDL_EVENT_MOUSE_WHEEL;
+		item.event.wheel.y = event->code;
+		break;
+	default:
+		return false;
 	}
+	return send_item(input, &item);
+}
+
+// Replays a recorded event, on the player thread.
+static bool
+replay(void *userdata, const struct MacroEvent *event) {
+	return input_inject(userdata, event);
+}
 
-	SDL_SignalCondition(input->condition);
+bool
+input_record_start(struct Input *input) {
+	if (macro_playing(&input->player)) {
+		return SDL_SetError("Can't record while a macro is playing");
+	}
+	return macro_record_start(&input->recording);
+}
 
-	SDL_UnlockMutex(input->condition_mutex);
+bool
+input_recording(struct Input *input) {
+	return input->recording.recording;
+}
+
+bool
+input_record_stop(struct Input *input, const char *path, Uint64 until) {
+	bool rv = macro_record_stop(&input->recording, until) &&
+			macro_save(&input->recording, path);
+
+	if (rv) {
+		SDL_Log("Recorded %d input events in %.3f s to %s",
+				input->recording.count,
+				(double)input->recording.last_time / SDL_US_PER_SECOND, path);
+	}
+	macro_free(&input->recording);
+	return rv;
+}
+
+bool
+input_play(struct Input *input, const char *path, bool fastest) {
+	struct Macro macro = {0};
+
+	if (input->recording.recording) {
+		return SDL_SetError("Can't play a macro while recording one");
+	}
+	// A macro that ended is still around until its thread is joined.
+	if (!macro_playing(&input->player)) {
+		macro_stop(&input->player);
+	}
+	if (!macro_load(&macro, path)) {
+		return false;
+	}
+	return macro_play(&input->player, &macro, fastest, replay, input);
+}
+
+bool
+input_playing(struct Input *input) {
+	return macro_playing(&input->player);
+}
+
+bool
+input_play_stop(struct Input *input) {
+	return macro_stop(&input->player);
+}
+
+bool
+input_paste(
+		struct Input *input, const char *text, enum Ch9329Layout layout,
+		int interval) {
+	const Uint64 one = 1;
+	const size_t len = SDL_strlen(text);
+	struct InputPaste *paste = SDL_malloc(sizeof(struct InputPaste) + len + 1);
+
+	if (paste == NULL) {
+		return false;
+	}
+	paste->layout = layout;
+	paste->interval = interval;
+	SDL_memcpy(paste->text, text, len + 1);
+
+	// Replaces anything pasted before that isn't being typed yet.
+	SDL_free(SDL_SetAtomicPointer(&input->paste, paste));
+	if (write(input->wakeup, &one, sizeof(one)) < 0) {
+		SDL_Log("Couldn't wake input thread: %s", strerror(errno));
+	}
 	return true;
 }
 
 bool
 input_status_numpad(struct Input *input) {
-	SDL_LockMutex(input->mutex);
+	TRACE_LOCK(input->mutex, "input->mutex");
 	bool rv = ch9329_frame_data(&input->hid_status)[2] & 0x01;
 	SDL_UnlockMutex(input->mutex);
 	return rv;
@@ -255,7 +1082,7 @@ input_status_numpad(struct Input *input) {
 
 bool
 input_status_capslock(struct Input *input) {
-	SDL_LockMutex(input->mutex);
+	TRACE_LOCK(input->mutex, "input->mutex");
 	bool rv = ch9329_frame_data(&input->hid_status)[2] & 0x02;
 	SDL_UnlockMutex(input->mutex);
 	return rv;
@@ -263,7 +1090,7 @@ input_status_capslock(struct Input *input) {
 
 bool
 input_status_scrolllock(struct Input *input) {
-	SDL_LockMutex(input->mutex);
+	TRACE_LOCK(input->mutex, "input->mutex");
 	bool rv = ch9329_frame_data(&input->hid_status)[2] & 0x04;
 	SDL_UnlockMutex(input->mutex);
 	return rv;
@@ -271,7 +1098,7 @@ input_status_scrolllock(struct Input *input) {
 
 bool
 input_status_connected(struct Input *input) {
-	SDL_LockMutex(input->mutex);
+	TRACE_LOCK(input->mutex, "input->mutex");
 	bool rv = ch9329_frame_data(&input->hid_status)[1] == 0x01;
 	SDL_UnlockMutex(input->mutex);
 	return rv;
@@ -279,21 +1106,78 @@ input_status_connected(struct Input *input) {
 
 bool
 input_set_rect(struct Input *input, SDL_FRect *rect) {
-	SDL_LockMutex(input->mutex);
+	TRACE_LOCK(input->mutex, "input->mutex");
 	input->rect = *rect;
 	SDL_UnlockMutex(input->mutex);
 	return true;
 }
 
+static void
+log_status(struct Input *input) {
+	const Uint64 elapsed = SDL_GetTicks() - input->status_since;
+	SDL_Log("Status: %" SDL_PRIu64 " polls (%.2f/s), %" SDL_PRIu64
+			" changes, lock key to LED %" SDL_PRIu64 " ms average, %" SDL_PRIu64
+			" ms max",
+			input->status_polls,
+			(double)input->status_polls * 1000 / (double)SDL_max(elapsed, 1),
+			input->status_changes,
+			input->status_latency_count
+					? input->status_latency_total / input->status_latency_count
+					: 0,
+			input->status_latency_max);
+}
+
+static void
+log_motion(struct Input *input) {
+	SDL_Log("Absolute mouse round trip: %.2f ms",
+			(double)input->motion_rtt / SDL_NS_PER_MS);
+	for (int i = 0; i < INPUT_LAG_BUCKETS; i++) {
+		if (input->lag_histogram[i] == 0) {
+			continue;
+		}
+		SDL_Log("  lag %4d-%4d: %u", i ? 1 << (i - 1) : 0,
+				i ? (1 << i) - 1 : 0, input->lag_histogram[i]);
+	}
+}
+
 bool
 input_cleanup(struct Input *input) {
-	input->status_interval = 0;
-	SDL_SignalCondition(input->condition);
-	SDL_WaitThread(input->thread, NULL);
+	const Uint64 one = 1;
+	// Nothing may be replayed into an input thread that's gone.
+	macro_stop(&input->player);
+	macro_free(&input->recording);
+	SDL_SetAtomicInt(&input->running, 0);
+	if (input->thread) {
+		if (write(input->wakeup, &one, sizeof(one)) < 0) {
+			SDL_Log("Failed to stop input thread: %s", strerror(errno));
+		}
+		SDL_WaitThread(input->thread, NULL);
+		SDL_Log("Input events: %d coalesced, %d overflowed, %d dropped",
+				SDL_GetAtomicInt(&input->coalesced),
+				SDL_GetAtomicInt(&input->overflowed),
+				SDL_GetAtomicInt(&input->dropped));
+		SDL_Log("Reports skipped: %lu unchanged, %d key repeats",
+				input->hid.reports_saved, SDL_GetAtomicInt(&input->repeats));
+		log_motion(input);
+		log_status(input);
+	}
 
+	SDL_free(SDL_SetAtomicPointer(&input->paste, NULL));
+	SDL_free(input->typing);
+	for (struct InputOverflow *node = take_overflow(input); node;) {
+		struct InputOverflow *next = node->next;
+		SDL_free(node);
+		node = next;
+	}
+	while (input->backlog) {
+		struct InputOverflow *next = input->backlog->next;
+		SDL_free(input->backlog);
+		input->backlog = next;
+	}
 	SDL_DestroyMutex(input->mutex);
-	SDL_DestroyMutex(input->condition_mutex);
-	SDL_DestroyCondition(input->condition);
+	if (input->wakeup >= 0) {
+		close(input->wakeup);
+	}
 	ch9329_close(&input->hid);
 	return true;
 }
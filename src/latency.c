@@ -0,0 +1,138 @@
+#include "latency.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+static struct LatencyHistogram histograms[LATENCY_STAGE_COUNT];
+
+static const char *const stage_names[LATENCY_STAGE_COUNT] = {
+		[LATENCY_CAPTURE] = "capture",
+		[LATENCY_DECODE_WAIT] = "decode wait",
+		[LATENCY_DECODE] = "decode",
+		[LATENCY_UPLOAD] = "upload",
+		[LATENCY_PRESENT] = "present",
+		[LATENCY_FRAME] = "frame total",
+		[LATENCY_ENQUEUE] = "enqueue",
+		[LATENCY_WRITE] = "serial write",
+		[LATENCY_ACK] = "ack",
+		[LATENCY_INPUT] = "input total",
+};
+
+// Values below 2 * LATENCY_SUB_BUCKETS have a bucket each. Above, the top
+// bits pick the bucket within the power of two.
+static int
+bucket_of(Uint64 value) {
+	int shift;
+
+	if (value < 2 * LATENCY_SUB_BUCKETS) {
+		return (int)value;
+	}
+	shift = 63 - __builtin_clzll(value) - 5;
+	return SDL_min(shift * LATENCY_SUB_BUCKETS + (int)(value >> shift),
+				   LATENCY_BUCKETS - 1);
+}
+
+// The middle of the values in a bucket.
+static Uint64
+bucket_value(int bucket) {
+	int shift;
+
+	if (bucket < 2 * LATENCY_SUB_BUCKETS) {
+		return bucket;
+	}
+	shift = bucket / LATENCY_SUB_BUCKETS - 1;
+	return ((Uint64)(bucket - shift * LATENCY_SUB_BUCKETS) << shift) +
+			((Uint64)1 << shift) / 2;
+}
+
+// Records the time from `start` to `end`, unless either is unknown.
+void
+latency_record(enum LatencyStage stage, Uint64 start, Uint64 end) {
+	struct LatencyHistogram *histogram = &histograms[stage];
+	Uint64 value;
+	Uint32 us;
+	Uint32 max;
+
+	if (start == 0 || end < start) {
+		return;
+	}
+	value = end - start;
+	SDL_AddAtomicInt(&histogram->buckets[bucket_of(value)], 1);
+	SDL_AddAtomicInt(&histogram->count, 1);
+
+	us = (Uint32)SDL_min(value / SDL_NS_PER_US, SDL_MAX_UINT32);
+	max = SDL_GetAtomicU32(&histogram->max);
+	while (us > max &&
+		   !SDL_CompareAndSwapAtomicU32(&histogram->max, max, us)) {
+		max = SDL_GetAtomicU32(&histogram->max);
+	}
+}
+
+const char *
+latency_stage_name(enum LatencyStage stage) {
+	return stage_names[stage];
+}
+
+int
+latency_count(enum LatencyStage stage) {
+	return SDL_GetAtomicInt(&histograms[stage].count);
+}
+
+// Returns the value `percent` of the samples are at or below, in ns.
+Uint64
+latency_percentile(enum LatencyStage stage, double percent) {
+	struct LatencyHistogram *histogram = &histograms[stage];
+	const int count = SDL_GetAtomicInt(&histogram->count);
+	const int rank = (int)SDL_ceil(count * percent / 100);
+	int seen = 0;
+
+	for (int i = 0; i < LATENCY_BUCKETS && count > 0; i++) {
+		seen += SDL_GetAtomicInt(&histogram->buckets[i]);
+		if (seen >= SDL_max(rank, 1)) {
+			return bucket_value(i);
+		}
+	}
+	return 0;
+}
+
+Uint64
+latency_max(enum LatencyStage stage) {
+	return (Uint64)SDL_GetAtomicU32(&histograms[stage].max) * SDL_NS_PER_US;
+}
+
+// Writes the percentiles of every stage and the buckets behind them, in
+// microseconds, for comparing runs.
+bool
+latency_dump(const char *path) {
+	FILE *file = fopen(path, "w");
+
+	if (file == NULL) {
+		return SDL_SetError("Couldn't open %s: %s", path, strerror(errno));
+	}
+	fprintf(file, "# stage, count, p50, p90, p99, p99.9, max (us)\n");
+	for (int i = 0; i < LATENCY_STAGE_COUNT; i++) {
+		fprintf(file,
+				"%-13s %8d %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+				stage_names[i], latency_count(i),
+				(double)latency_percentile(i, 50) / SDL_NS_PER_US,
+				(double)latency_percentile(i, 90) / SDL_NS_PER_US,
+				(double)latency_percentile(i, 99) / SDL_NS_PER_US,
+				(double)latency_percentile(i, 99.9) / SDL_NS_PER_US,
+				(double)latency_max(i) / SDL_NS_PER_US);
+	}
+	fprintf(file, "\n# stage, bucket (us), count\n");
+	for (int i = 0; i < LATENCY_STAGE_COUNT; i++) {
+		for (int j = 0; j < LATENCY_BUCKETS; j++) {
+			const int count = SDL_GetAtomicInt(&histograms[i].buckets[j]);
+			if (count > 0) {
+				fprintf(file, "%-13s %12.3f %8d\n", stage_names[i],
+						(double)bucket_value(j) / SDL_NS_PER_US, count);
+			}
+		}
+	}
+	if (fclose(file) != 0) {
+		return SDL_SetError("Couldn't write %s: %s", path, strerror(errno));
+	}
+	return true;
+}
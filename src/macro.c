@@ -0,0 +1,412 @@
+#include "macro.h"
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MACRO_VERSION 1
+#define HEADER_SIZE 5
+// Longest varints of 64 and 32 bits.
+#define VARINT64_MAX_SIZE 10
+#define VARINT32_MAX_SIZE 5
+// Time, kind and three arguments.
+#define RECORD_MAX_SIZE (VARINT64_MAX_SIZE + 1 + 3 * VARINT32_MAX_SIZE)
+#define INITIAL_CAPACITY 4096
+
+static const Uint8 header[HEADER_SIZE] = {'K', 'V', 'S', 'M', MACRO_VERSION};
+
+static Uint64
+monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (Uint64)ts.tv_sec * SDL_NS_PER_SECOND + ts.tv_nsec;
+}
+
+static Uint8 *
+put_varint(Uint8 *out, Uint64 value) {
+	while (value >= 0x80) {
+		*out++ = (Uint8)(value | 0x80);
+		value >>= 7;
+	}
+	*out++ = (Uint8)value;
+	return out;
+}
+
+// Small negative numbers stay short: 0, -1, 1, -2, ...
+static Uint8 *
+put_signed(Uint8 *out, int value) {
+	return put_varint(out, ((Uint32)value << 1) ^ (Uint32)(value >> 31));
+}
+
+static bool
+get_varint(const struct Macro *macro, size_t *offset, Uint64 *value) {
+	*value = 0;
+	for (int shift = 0; shift < 64 && *offset < macro->size; shift += 7) {
+		const Uint8 byte = macro->data[(*offset)++];
+		*value |= (Uint64)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool
+get_signed(const struct Macro *macro, size_t *offset, int *value) {
+	Uint64 raw;
+	if (!get_varint(macro, offset, &raw)) {
+		return false;
+	}
+	*value = (int)((Uint32)(raw >> 1) ^ -(Uint32)(raw & 1));
+	return true;
+}
+
+static bool
+reserve(struct Macro *macro, size_t size) {
+	size_t capacity = macro->capacity ? macro->capacity : INITIAL_CAPACITY;
+	Uint8 *data;
+
+	if (macro->size + size <= macro->capacity) {
+		return true;
+	}
+	while (capacity < macro->size + size) {
+		capacity *= 2;
+	}
+	data = SDL_realloc(macro->data, capacity);
+	if (data == NULL) {
+		return false;
+	}
+	macro->data = data;
+	macro->capacity = capacity;
+	return true;
+}
+
+bool
+macro_record_start(struct Macro *macro) {
+	macro_free(macro);
+	if (!reserve(macro, HEADER_SIZE)) {
+		return false;
+	}
+	SDL_memcpy(macro->data, header, HEADER_SIZE);
+	macro->size = HEADER_SIZE;
+	macro->started_at = SDL_GetTicksNS();
+	macro->recording = true;
+	return true;
+}
+
+bool
+macro_record(struct Macro *macro, const struct MacroEvent *event) {
+	Uint64 time = 0;
+	Uint8 *out;
+
+	if (!macro->recording || !reserve(macro, RECORD_MAX_SIZE)) {
+		return false;
+	}
+	// Events queued before the recording started count as its start.
+	if (event->time > macro->started_at) {
+		time = (event->time - macro->started_at) / SDL_NS_PER_US;
+	}
+	if (time < macro->last_time) {
+		time = macro->last_time;
+	}
+
+	out = put_varint(&macro->data[macro->size], time - macro->last_time);
+	*out++ = (Uint8)(event->kind | (event->rel_mouse ? 0x80 : 0));
+	switch (event->kind) {
+	case MACRO_KEY_DOWN:
+	case MACRO_KEY_UP:
+		out = put_signed(out, event->code);
+		break;
+	case MACRO_MOTION:
+		out = put_signed(out, event->x);
+		out = put_signed(out, event->y);
+		break;
+	case MACRO_BUTTON_DOWN:
+	case MACRO_BUTTON_UP:
+	case MACRO_WHEEL:
+		out = put_signed(out, event->code);
+		out = put_signed(out, event->x);
+		out = put_signed(out, event->y);
+		break;
+	default:
+		return false;
+	}
+	macro->size = out - macro->data;
+	macro->last_time = time;
+	macro->count++;
+	return true;
+}
+
+int
+macro_next(
+		const struct Macro *macro, size_t *offset, struct MacroEvent *event) {
+	Uint64 delta;
+	Uint8 kind;
+	bool ok = true;
+
+	if (*offset == 0) {
+		*offset = HEADER_SIZE;
+		event->time = 0;
+	}
+	if (*offset >= macro->size) {
+		return 0;
+	}
+	if (!get_varint(macro, offset, &delta) || *offset >= macro->size) {
+		return -1;
+	}
+	kind = macro->data[(*offset)++];
+	event->time += delta * SDL_NS_PER_US;
+	event->kind = kind & 0x7f;
+	event->rel_mouse = kind & 0x80;
+	event->code = 0;
+	event->x = 0;
+	event->y = 0;
+
+	switch (event->kind) {
+	case MACRO_KEY_DOWN:
+	case MACRO_KEY_UP:
+		ok = get_signed(macro, offset, &event->code);
+		break;
+	case MACRO_MOTION:
+		ok = get_signed(macro, offset, &event->x) &&
+				get_signed(macro, offset, &event->y);
+		break;
+	case MACRO_BUTTON_DOWN:
+	case MACRO_BUTTON_UP:
+	case MACRO_WHEEL:
+		ok = get_signed(macro, offset, &event->code) &&
+				get_signed(macro, offset, &event->x) &&
+				get_signed(macro, offset, &event->y);
+		break;
+	default:
+		ok = false;
+		break;
+	}
+	return ok ? 1 : -1;
+}
+
+bool
+macro_record_stop(struct Macro *macro, Uint64 until) {
+	struct MacroEvent event = {0};
+	size_t offset = 0;
+	size_t end = HEADER_SIZE;
+	Uint64 last = 0;
+	int count = 0;
+
+	if (!macro->recording) {
+		return false;
+	}
+	macro->recording = false;
+	if (until == 0) {
+		return true;
+	}
+
+	// Drops what came in after `until`, like the keys that ended the
+	// recording.
+	until = until > macro->started_at ? until - macro->started_at : 0;
+	while (macro_next(macro, &offset, &event) > 0 && event.time < until) {
+		end = offset;
+		last = event.time;
+		count++;
+	}
+	macro->size = end;
+	macro->count = count;
+	macro->last_time = last / SDL_NS_PER_US;
+	return true;
+}
+
+bool
+macro_save(const struct Macro *macro, const char *path) {
+	return SDL_SaveFile(path, macro->data, macro->size);
+}
+
+bool
+macro_load(struct Macro *macro, const char *path) {
+	struct MacroEvent event = {0};
+	size_t offset = 0;
+	size_t size = 0;
+	int rv;
+
+	macro_free(macro);
+	macro->data = SDL_LoadFile(path, &size);
+	if (macro->data == NULL) {
+		return false;
+	}
+	macro->size = size;
+	macro->capacity = size;
+	if (size < HEADER_SIZE || SDL_memcmp(macro->data, header, HEADER_SIZE)) {
+		macro_free(macro);
+		return SDL_SetError("%s is not a kvsm macro", path);
+	}
+
+	while ((rv = macro_next(macro, &offset, &event)) > 0) {
+		macro->count++;
+	}
+	if (rv < 0) {
+		macro_free(macro);
+		return SDL_SetError("%s is truncated or corrupt", path);
+	}
+	macro->last_time = event.time / SDL_NS_PER_US;
+	return true;
+}
+
+void
+macro_free(struct Macro *macro) {
+	SDL_free(macro->data);
+	SDL_zerop(macro);
+}
+
+static int
+compare_lateness(const void *a, const void *b) {
+	const Uint64 x = *(const Uint64 *)a;
+	const Uint64 y = *(const Uint64 *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+log_replay(
+		struct MacroPlayer *player, Uint64 *lateness, int played,
+		Uint64 duration) {
+	SDL_Log("Macro: %d of %d events in %.3f s, recorded in %.3f s", played,
+			player->macro.count, (double)duration / SDL_NS_PER_SECOND,
+			(double)player->macro.last_time / SDL_US_PER_SECOND);
+	if (player->fastest || played == 0) {
+		return;
+	}
+	SDL_qsort(lateness, played, sizeof(Uint64), compare_lateness);
+	SDL_Log("Macro lateness: p50 %" SDL_PRIu64 " us, p99 %" SDL_PRIu64
+			" us, max %" SDL_PRIu64 " us",
+			lateness[(played - 1) / 2] / SDL_NS_PER_US,
+			lateness[(played - 1) * 99 / 100] / SDL_NS_PER_US,
+			lateness[played - 1] / SDL_NS_PER_US);
+}
+
+// Waits for an absolute deadline on CLOCK_MONOTONIC. Returns false if the
+// replay was stopped meanwhile.
+static bool
+wait_until(struct MacroPlayer *player, Uint64 deadline) {
+	struct itimerspec spec = {
+			.it_value = {
+					.tv_sec = deadline / SDL_NS_PER_SECOND,
+					.tv_nsec = deadline % SDL_NS_PER_SECOND,
+			}};
+	struct pollfd fds[2] = {
+			{.fd = player->timer, .events = POLLIN},
+			{.fd = player->wakeup, .events = POLLIN},
+	};
+	Uint64 expirations;
+
+	if (timerfd_settime(player->timer, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+		return false;
+	}
+	while (poll(fds, 2, -1) < 0) {
+		if (errno != EINTR) {
+			return false;
+		}
+	}
+	if (fds[1].revents & POLLIN) {
+		return false;
+	}
+	return read(player->timer, &expirations, sizeof(expirations)) > 0;
+}
+
+static int
+player_thread(void *data) {
+	struct MacroPlayer *player = data;
+	struct MacroEvent event = {0};
+	Uint64 *lateness = SDL_malloc(sizeof(Uint64) * (player->macro.count + 1));
+	const Uint64 start = monotonic_ns();
+	size_t offset = 0;
+	int played = 0;
+
+	SDL_SetCurrentThreadPriority(SDL_THREAD_PRIORITY_TIME_CRITICAL);
+	while (lateness != NULL && SDL_GetAtomicInt(&player->running) &&
+		   macro_next(&player->macro, &offset, &event) > 0) {
+		// Replayed as fast as the input thread takes them, it merges
+		// motion and sends at the speed of the link.
+		if (!player->fastest && !wait_until(player, start + event.time)) {
+			break;
+		}
+		lateness[played++] = monotonic_ns() - (start + event.time);
+		player->send(player->userdata, &event);
+	}
+
+	if (lateness != NULL) {
+		log_replay(player, lateness, played, monotonic_ns() - start);
+	}
+	SDL_free(lateness);
+	SDL_SetAtomicInt(&player->running, 0);
+
+	SDL_Event done = {
+			.user = {
+					.type = SDL_EVENT_USER,
+					.code = MACRO_EVENT_CODE,
+					.data1 = player->userdata,
+			}};
+	SDL_PushEvent(&done);
+	return 0;
+}
+
+bool
+macro_play(
+		struct MacroPlayer *player, struct Macro *macro, bool fastest,
+		MacroSend send, void *userdata) {
+	bool rv = false;
+
+	if (player->thread != NULL) {
+		return SDL_SetError("A macro is already playing");
+	}
+	// The player owns the recording from here on.
+	player->macro = *macro;
+	SDL_zerop(macro);
+	player->timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	player->wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (player->timer < 0 || player->wakeup < 0) {
+		SDL_SetError("Couldn't create timer: %s", strerror(errno));
+		goto out;
+	}
+
+	player->fastest = fastest;
+	player->send = send;
+	player->userdata = userdata;
+	SDL_SetAtomicInt(&player->running, 1);
+	player->thread = SDL_CreateThread(player_thread, "macro_player", player);
+	rv = player->thread != NULL;
+out:
+	if (!rv) {
+		macro_stop(player);
+	}
+	return rv;
+}
+
+bool
+macro_playing(struct MacroPlayer *player) {
+	return SDL_GetAtomicInt(&player->running) != 0;
+}
+
+bool
+macro_stop(struct MacroPlayer *player) {
+	const Uint64 one = 1;
+
+	SDL_SetAtomicInt(&player->running, 0);
+	if (player->thread != NULL) {
+		if (write(player->wakeup, &one, sizeof(one)) < 0) {
+			SDL_Log("Failed to stop macro player: %s", strerror(errno));
+		}
+		SDL_WaitThread(player->thread, NULL);
+		player->thread = NULL;
+	}
+	if (player->timer > 0) {
+		close(player->timer);
+	}
+	if (player->wakeup > 0) {
+		close(player->wakeup);
+	}
+	player->timer = 0;
+	player->wakeup = 0;
+	macro_free(&player->macro);
+	return true;
+}
@@ -2,13 +2,17 @@
 #include <SDL3/SDL_events.h>
 #include <SDL3/SDL_log.h>
 #include <SDL3/SDL_pixels.h>
+#include <getopt.h>
 #include <jpeglib.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <unistd.h>
 
-#include "camera.h"
-#include "input.h"
+#include "control.h"
+#include "device.h"
+#include "discovery.h"
+#include "latency.h"
+#include "trace.h"
 
 #define MAGIC_KEY SDLK_LALT
 #define MAGIC_KEY_TIMEOUT 500
@@ -16,6 +20,13 @@
 #define INDICATOR_TIMEOUT 1000
 #define COMMAND_MODE_TIMEOUT_CODE 'D'
 #define INDICATOR_TIMEOUT_CODE 'I'
+#define MAX_DEVICES 16
+#define WINDOW_WIDTH 1280
+#define WINDOW_HEIGHT 720
+#define TILE_GAP 4
+#define DEFAULT_MACRO_PATH "kvsm.macro"
+// Frame ring of each device without a window, by tile index.
+#define RING_NAME_FORMAT "/kvsm-%d"
 
 static const SDL_Color color_tint = {0, 255, 255, SDL_ALPHA_OPAQUE};
 static const SDL_Color color_green = {0, 255, 0, SDL_ALPHA_OPAQUE};
@@ -47,16 +58,64 @@ static const Uint8 cursor_msb[2][8] = {
 
 struct Ui {
 	bool running;
+	// No window, frames only go to the frame rings.
+	bool headless;
+	Uint64 launched;
+	bool presented;
+	bool configured;
 	SDL_Window *window;
 	SDL_Renderer *renderer;
 	SDL_TimerID command_mode;
 	SDL_TimerID show_indicator;
-	struct Camera camera;
-	SDL_FRect camera_rect;
 	Uint64 last_magic_key_timestamp;
-	struct Input input;
+	// When the magic key went down the first time, so a recording can end
+	// before it.
+	Uint64 command_mode_since;
+	bool hidden;
+	bool zoomed;
+	// Sends mouse motion as relative reports, for targets that don't
+	// understand an absolute pointer.
+	bool rel_mouse;
+	// How pasted text is typed on the targets.
+	enum Ch9329Layout layout;
+	int type_interval;
+	// Where input macros are recorded to and played from.
+	const char *macro_path;
+	// Other programs drive the devices through this socket, if given.
+	const char *control_path;
+	struct Control control;
+	// Per-stage latencies on top of the tiles.
+	bool show_latency;
+	// Where the latencies are written on exit, if given.
+	const char *latency_path;
+	int focused;
+	int device_count;
+	struct Device devices[MAX_DEVICES];
+	struct Discovery discovery;
 };
 
+static struct Device *
+focused_device(struct Ui *ui) {
+	return &ui->devices[ui->focused];
+}
+
+static struct Device *
+find_device(struct Ui *ui, void *camera_or_input) {
+	for (int i = 0; i < ui->device_count; i++) {
+		struct Device *device = &ui->devices[i];
+		if (camera_or_input == &device->camera ||
+			camera_or_input == &device->input) {
+			return device;
+		}
+	}
+	return NULL;
+}
+
+static bool
+wall_mode(struct Ui *ui) {
+	return ui->device_count > 1 && !ui->zoomed;
+}
+
 static bool
 draw_indicator(
 		struct Ui *ui, const SDL_Point *position,
@@ -64,9 +123,10 @@ draw_indicator(
 	const int width = 8;
 	const int height = 32;
 	const SDL_Color *color = &color_red;
+	struct Input *input = &focused_device(ui)->input;
 
-	if (input_status_connected(&ui->input)) {
-		color = get_status(&ui->input) ? &color_green : &color_gray;
+	if (input_status_connected(input)) {
+		color = get_status(input) ? &color_green : &color_gray;
 	}
 
 	SDL_SetRenderDrawColor(
@@ -83,36 +143,133 @@ draw_indicator(
 	return true;
 }
 
+static void
+fit_rect(struct Device *device, const SDL_FRect *cell, SDL_FRect *rect) {
+	int camera_width = 16;
+	int camera_height = 9;
+	// The camera of a device still being opened belongs to its opener.
+	if (device->connected) {
+		camera_size(&device->camera, &camera_width, &camera_height);
+	}
+
+	float camera_aspect = (float)camera_width / (float)camera_height;
+	float cell_aspect = cell->w / cell->h;
+
+	if (cell_aspect > camera_aspect) {
+		rect->h = cell->h;
+		rect->w = cell->h * camera_aspect;
+		rect->x = cell->x + (cell->w - rect->w) / 2;
+		rect->y = cell->y;
+	} else {
+		rect->w = cell->w;
+		rect->h = cell->w / camera_aspect;
+		rect->x = cell->x;
+		rect->y = cell->y + (cell->h - rect->h) / 2;
+	}
+}
+
+static int
+tile_scale(struct Device *device, bool focused) {
+	int camera_width = 0;
+	int camera_height = 0;
+	int scale = 1;
+
+	if (focused || !device->connected ||
+		!camera_size(&device->camera, &camera_width, &camera_height)) {
+		return scale;
+	}
+
+	// Pick the smallest decode that still covers the tile.
+	while (scale < CAMERA_MAX_SCALE &&
+		   camera_width / (scale * 2) >= device->rect.w &&
+		   camera_height / (scale * 2) >= device->rect.h) {
+		scale *= 2;
+	}
+	return scale;
+}
+
 static bool
-update_camera_rect(struct Ui *ui) {
+update_layout(struct Ui *ui) {
 	int window_height = 0;
 	int window_width = 0;
-	SDL_GetWindowSize(ui->window, &window_width, &window_height);
-	int camera_width = 0;
-	int camera_height = 0;
-	if (!camera_size(&ui->camera, &camera_width, &camera_height)) {
+	int columns = 1;
+	int rows = 1;
+	static const SDL_FRect hidden = {0};
+
+	if (!ui->window) {
 		return false;
 	}
+	SDL_GetWindowSize(ui->window, &window_width, &window_height);
 
-	float camera_aspect = (float)camera_width / (float)camera_height;
-	float win_aspect = (float)window_width / (float)window_height;
+	if (wall_mode(ui)) {
+		while (columns * columns < ui->device_count) {
+			columns++;
+		}
+		rows = (ui->device_count + columns - 1) / columns;
+	}
 
-	if (win_aspect > camera_aspect) {
-		ui->camera_rect.h = window_height;
-		ui->camera_rect.w = window_height * camera_aspect;
-		ui->camera_rect.x = (window_width - ui->camera_rect.w) / 2;
-		ui->camera_rect.y = 0;
-	} else {
-		ui->camera_rect.w = window_width;
-		ui->camera_rect.h = window_width / camera_aspect;
-		ui->camera_rect.x = 0;
-		ui->camera_rect.y = (window_height - ui->camera_rect.h) / 2;
+	for (int i = 0; i < ui->device_count; i++) {
+		struct Device *device = &ui->devices[i];
+		SDL_FRect rect = hidden;
+
+		if (wall_mode(ui)) {
+			SDL_FRect cell = {
+					.x = (float)(i % columns) * window_width / columns,
+					.y = (float)(i / columns) * window_height / rows,
+					.w = (float)window_width / columns - TILE_GAP,
+					.h = (float)window_height / rows - TILE_GAP,
+			};
+			fit_rect(device, &cell, &rect);
+		} else if (i == ui->focused) {
+			SDL_FRect cell = {
+					.w = window_width,
+					.h = window_height,
+			};
+			fit_rect(device, &cell, &rect);
+		}
+		device_set_rect(device, &rect);
+
+		if (!device->connected) {
+			continue;
+		}
+		// Tiles that are not on screen are not worth decoding at all.
+		camera_suspend(&device->camera, ui->hidden || !device_visible(device));
+		camera_set_scale(&device->camera, tile_scale(device, i == ui->focused));
 	}
 
-	input_set_rect(&ui->input, &ui->camera_rect);
 	return true;
 }
 
+static void
+draw_latency(struct Ui *ui) {
+	const float line = SDL_DEBUG_TEXT_FONT_CHARACTER_SIZE * 1.5f;
+	SDL_FRect rect = {
+			.x = 0,
+			.y = 0,
+			.w = 56 * SDL_DEBUG_TEXT_FONT_CHARACTER_SIZE,
+			.h = (LATENCY_STAGE_COUNT + 2) * line,
+	};
+
+	SDL_SetRenderDrawBlendMode(ui->renderer, SDL_BLENDMODE_BLEND);
+	SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, SDL_ALPHA_OPAQUE * 3 / 4);
+	SDL_RenderFillRect(ui->renderer, &rect);
+	SDL_SetRenderDrawBlendMode(ui->renderer, SDL_BLENDMODE_NONE);
+
+	SDL_SetRenderDrawColor(
+			ui->renderer, color_tint.r, color_tint.g, color_tint.b,
+			color_tint.a);
+	SDL_RenderDebugText(
+			ui->renderer, line / 2, line / 2,
+			"stage           count    p50 ms    p99 ms    max ms");
+	for (int i = 0; i < LATENCY_STAGE_COUNT; i++) {
+		SDL_RenderDebugTextFormat(
+				ui->renderer, line / 2, line / 2 + (i + 1) * line,
+				"%-13s %7d %9.2f %9.2f %9.2f", latency_stage_name(i),
+				latency_count(i), latency_percentile(i, 50) / 1e6,
+				latency_percentile(i, 99) / 1e6, latency_max(i) / 1e6);
+	}
+}
+
 static bool
 redraw(struct Ui *ui) {
 	if (!ui->window) {
@@ -120,16 +277,34 @@ redraw(struct Ui *ui) {
 	}
 
 	SDL_LogTrace(SDL_LOG_CATEGORY_RENDER, "Redrawing");
-
-	SDL_Texture *texture = camera_texture(&ui->camera);
+	TRACE_BEGIN("redraw");
 
 	SDL_SetRenderDrawColor(
 			ui->renderer, color_tint.r / 4, color_tint.g / 4, color_tint.b / 4,
 			color_tint.a);
 	SDL_RenderClear(ui->renderer);
 
-	if (texture) {
-		SDL_RenderTexture(ui->renderer, texture, NULL, &ui->camera_rect);
+	for (int i = 0; i < ui->device_count; i++) {
+		struct Device *device = &ui->devices[i];
+		SDL_Texture *texture =
+				device->connected ? camera_texture(&device->camera) : NULL;
+
+		if (texture && device_visible(device)) {
+			SDL_RenderTexture(ui->renderer, texture, NULL, &device->rect);
+		} else if (device_visible(device)) {
+			// Placeholder for a device that is (re)connecting.
+			SDL_SetRenderDrawColor(
+					ui->renderer, color_tint.r / 8, color_tint.g / 8,
+					color_tint.b / 8, color_tint.a);
+			SDL_RenderFillRect(ui->renderer, &device->rect);
+		}
+	}
+
+	if (wall_mode(ui)) {
+		SDL_SetRenderDrawColor(
+				ui->renderer, color_tint.r, color_tint.g, color_tint.b,
+				color_tint.a);
+		SDL_RenderRect(ui->renderer, &focused_device(ui)->rect);
 	}
 
 	if (ui->command_mode) {
@@ -148,8 +323,9 @@ redraw(struct Ui *ui) {
 		SDL_SetRenderScale(ui->renderer, 1.0, 1.0);
 	}
 
-	if (ui->show_indicator || ui->command_mode ||
-		!input_status_connected(&ui->input)) {
+	if (device_has_input(focused_device(ui)) &&
+		(ui->show_indicator || ui->command_mode ||
+		 !input_status_connected(&focused_device(ui)->input))) {
 		int window_height = 0;
 		int window_width = 0;
 		SDL_GetWindowSize(ui->window, &window_width, &window_height);
@@ -162,41 +338,73 @@ redraw(struct Ui *ui) {
 		draw_indicator(ui, &position, input_status_numpad);
 	}
 
+	if (ui->show_latency) {
+		draw_latency(ui);
+	}
+
 	SDL_RenderPresent(ui->renderer);
 
+	const Uint64 now = SDL_GetTicksNS();
+	for (int i = 0; i < ui->device_count; i++) {
+		if (ui->devices[i].connected) {
+			camera_presented(&ui->devices[i].camera, now);
+		}
+	}
+
+	TRACE_END("redraw");
 	return true;
 }
 
+static void
+log_stage(struct Ui *ui, const char *stage, Uint64 duration) {
+	SDL_Log("%s took %" SDL_PRIu64 " ms (%" SDL_PRIu64 " ms since launch)",
+			stage, SDL_NS_TO_MS(duration),
+			SDL_NS_TO_MS(SDL_GetTicksNS() - ui->launched));
+}
+
 bool
 start_ui(struct Ui *ui) {
 	static const int flags = SDL_WINDOW_RESIZABLE;
-	int width = 0, height = 0;
+	Uint64 start = SDL_GetTicksNS();
 	if (ui->window) {
 		return true;
 	}
 
-	if (!input_start(&ui->input)) {
-		return false;
-	}
-
-	camera_size(&ui->camera, &width, &height);
-
+	// The camera size isn't known yet. Open a window of a sensible size with
+	// placeholder tiles and fit it to the camera once the first frame is in.
 	if (!SDL_CreateWindowAndRenderer(
-				"kvsm", width, height, flags, &ui->window, &ui->renderer)) {
+				"kvsm", WINDOW_WIDTH, WINDOW_HEIGHT, flags, &ui->window,
+				&ui->renderer)) {
 		SDL_Log("Couldn't create window/renderer: %s", SDL_GetError());
 		return false;
 	}
 
-	float aspect_ratio = (float)width / (float)height;
-	SDL_SetWindowAspectRatio(ui->window, aspect_ratio, aspect_ratio);
-
-	if (!update_camera_rect(ui)) {
+	if (!update_layout(ui)) {
 		return false;
 	}
+	redraw(ui);
+	log_stage(ui, "Window creation", SDL_GetTicksNS() - start);
 
 	return true;
 }
 
+static void
+first_frame(struct Ui *ui, struct Device *device) {
+	int width, height;
+	if (ui->presented || !camera_size(&device->camera, &width, &height)) {
+		return;
+	}
+	ui->presented = true;
+
+	if (ui->window && ui->device_count == 1) {
+		float aspect_ratio = (float)width / (float)height;
+		SDL_SetWindowSize(ui->window, width, height);
+		SDL_SetWindowAspectRatio(ui->window, aspect_ratio, aspect_ratio);
+	}
+	update_layout(ui);
+	log_stage(ui, "First frame", 0);
+}
+
 static Uint32
 user_event_timer(void *userdata, SDL_TimerID timerID, Uint32 interval) {
 	(void)timerID;
@@ -234,11 +442,54 @@ handle_command(struct Ui *ui, SDL_Event *event) {
 		ui->running = false;
 	} break;
 	case SDLK_O: {
-		SDL_Texture *texture = camera_texture(&ui->camera);
-		if (texture) {
-			SDL_SetWindowSize(ui->window, texture->w, texture->h);
+		int width = 0, height = 0;
+		if (camera_size(&focused_device(ui)->camera, &width, &height)) {
+			SDL_SetWindowSize(ui->window, width, height);
 		}
 	} break;
+	case SDLK_TAB: {
+		ui->focused = (ui->focused + 1) % ui->device_count;
+		update_layout(ui);
+	} break;
+	case SDLK_Z: {
+		ui->zoomed = !ui->zoomed;
+		update_layout(ui);
+	} break;
+	case SDLK_V: {
+		char *text = SDL_GetClipboardText();
+		if (text[0] != '\0' &&
+			!device_paste(
+					focused_device(ui), text, ui->layout, ui->type_interval)) {
+			SDL_Log("Couldn't paste to the selected device");
+		}
+		SDL_free(text);
+	} break;
+	case SDLK_M: {
+		if (!device_record(
+					focused_device(ui), ui->macro_path,
+					ui->command_mode_since)) {
+			SDL_Log("Couldn't record a macro: %s", SDL_GetError());
+		}
+	} break;
+	case SDLK_P: {
+		if (!device_play(
+					focused_device(ui), ui->macro_path,
+					event->key.mod & SDL_KMOD_SHIFT)) {
+			SDL_Log("Couldn't play %s: %s", ui->macro_path, SDL_GetError());
+		}
+	} break;
+	case SDLK_R: {
+		// Captures the pointer, SDL reports motion as deltas then.
+		if (SDL_SetWindowRelativeMouseMode(ui->window, !ui->rel_mouse)) {
+			ui->rel_mouse = !ui->rel_mouse;
+		} else {
+			SDL_Log("Couldn't switch relative mouse mode: %s",
+					SDL_GetError());
+		}
+	} break;
+	case SDLK_L: {
+		ui->show_latency = !ui->show_latency;
+	} break;
 	}
 	SDL_RemoveTimer(ui->command_mode);
 	ui->command_mode = 0;
@@ -246,55 +497,370 @@ handle_command(struct Ui *ui, SDL_Event *event) {
 	return true;
 }
 
+static void
+usage(const char *name) {
+	printf("Usage: %s [--headless] [-l LAYOUT] [-t MS] [-m FILE] [-S SOCKET] "
+		   "[-L FILE] [-c CAMERA [-s SERIAL]]...\n",
+		   name);
+	puts("  -c CAMERA  add a device showing the camera named CAMERA");
+	puts("  -s SERIAL  use the CH9329 at SERIAL for input to the last device");
+	puts("  -l LAYOUT  keyboard layout of the targets for pasting: us, de, fr");
+	puts("  -t MS      hold each pasted key for MS milliseconds");
+	puts("  -m FILE    record input macros to and play them from FILE");
+	puts("  -S SOCKET  let other programs control the devices through SOCKET");
+	puts("  -L FILE    write the latency histograms to FILE on exit");
+	puts("  --headless publish the frames to /kvsm-N rather than show them");
+	puts("Without arguments, KVM dongles are discovered through udev.");
+}
+
+static struct Device *
+add_device(struct Ui *ui, const char *camera_name) {
+	struct Device *device;
+
+	if (ui->device_count == MAX_DEVICES) {
+		SDL_Log("At most %d devices are supported", MAX_DEVICES);
+		return NULL;
+	}
+	device = &ui->devices[ui->device_count++];
+	SDL_strlcpy(
+			device->info.camera_name, camera_name,
+			sizeof(device->info.camera_name));
+	// Repeating a camera name selects the next camera of that name.
+	for (struct Device *other = ui->devices; other != device; other++) {
+		if (SDL_strcmp(other->info.camera_name, camera_name) == 0) {
+			device->info.camera_index++;
+		}
+	}
+	return device;
+}
+
+static bool
+parse_args(struct Ui *ui, int argc, char *argv[]) {
+	static const struct option options[] = {
+			{"headless", no_argument, NULL, 'H'},
+			{NULL, 0, NULL, 0},
+	};
+	int opt;
+	struct Device *device = NULL;
+	ui->type_interval = CH9329_TYPE_INTERVAL;
+	ui->macro_path = DEFAULT_MACRO_PATH;
+	while ((opt = getopt_long(
+					argc, argv, "c:s:l:t:m:S:L:h", options, NULL)) != -1) {
+		switch (opt) {
+		case 'H':
+			ui->headless = true;
+			break;
+		case 'l':
+			if (ch9329_layout_from_name(optarg) < 0) {
+				usage(argv[0]);
+				return false;
+			}
+			ui->layout = ch9329_layout_from_name(optarg);
+			break;
+		case 't':
+			ui->type_interval = SDL_atoi(optarg);
+			break;
+		case 'm':
+			ui->macro_path = optarg;
+			break;
+		case 'S':
+			ui->control_path = optarg;
+			break;
+		case 'L':
+			ui->latency_path = optarg;
+			break;
+		case 'c':
+			device = add_device(ui, optarg);
+			if (!device) {
+				return false;
+			}
+			break;
+		case 's':
+			if (!device) {
+				device = add_device(ui, DEVICE_DEFAULT_CAMERA);
+			}
+			SDL_strlcpy(
+					device->info.serial_path, optarg,
+					sizeof(device->info.serial_path));
+			break;
+		default:
+			usage(argv[0]);
+			return false;
+		}
+	}
+	if (optind != argc) {
+		usage(argv[0]);
+		return false;
+	}
+	return true;
+}
+
+static bool
+discover_devices(struct Ui *ui) {
+	struct DeviceInfo infos[MAX_DEVICES];
+	int count;
+
+	if (!discovery_init(&ui->discovery)) {
+		SDL_Log("Couldn't start device discovery, using %s and %s",
+				DEVICE_DEFAULT_CAMERA, DEVICE_DEFAULT_SERIAL);
+		struct Device *device = add_device(ui, DEVICE_DEFAULT_CAMERA);
+		SDL_strlcpy(
+				device->info.serial_path, DEVICE_DEFAULT_SERIAL,
+				sizeof(device->info.serial_path));
+		return true;
+	}
+
+	count = discovery_scan(&ui->discovery, infos, MAX_DEVICES);
+	for (int i = 0; i < count; i++) {
+		ui->devices[i].info = infos[i];
+	}
+	ui->device_count = count;
+	if (count == 0) {
+		// Keep an empty tile around for the first dongle plugged in.
+		SDL_Log("No KVM device found, waiting for one to be plugged in");
+		ui->device_count = 1;
+	}
+
+	return discovery_start(&ui->discovery);
+}
+
+static void
+connect_device(struct Device *device) {
+	if (device->connected || device_opening(device) ||
+		device->info.camera_name[0] == '\0') {
+		return;
+	}
+	device_open(device);
+}
+
+static bool
+device_opened(struct Ui *ui, struct Device *device) {
+	struct DeviceInfo *info = &device->info;
+	bool finished;
+
+	control_lock(&ui->control);
+	finished = device_finish_open(device);
+	control_unlock(&ui->control);
+	if (!finished) {
+		return true;
+	}
+
+	if (!device->connected) {
+		// Dongles from the command line must be there. Discovered ones are
+		// retried when SDL sees a new camera.
+		SDL_Log("Couldn't initialize device: %s", info->camera_name);
+		return !ui->configured;
+	}
+
+	log_stage(ui, "Camera open", device->camera_open_time);
+	if (device_has_input(device)) {
+		log_stage(ui, "Serial open and reset", device->input_open_time);
+	}
+	if (info->usb_path[0] != '\0') {
+		SDL_Log("Connected %s (%s, %s)", info->usb_path, info->video_path,
+				info->serial_path);
+	}
+
+	if (ui->headless) {
+		char name[RING_NAME_MAX];
+		SDL_snprintf(name, sizeof(name), RING_NAME_FORMAT,
+					 (int)(device - ui->devices));
+		if (!camera_publish(&device->camera, name)) {
+			SDL_Log("Couldn't publish frames: %s", SDL_GetError());
+		}
+	}
+	// Permission may have been granted while the camera was still opening.
+	if (SDL_GetCameraPermissionState(device->camera.camera) > 0) {
+		camera_start(&device->camera);
+	}
+	update_layout(ui);
+	return true;
+}
+
+static struct Device *
+claim_device(struct Ui *ui, const struct DeviceInfo *info) {
+	struct Device *empty = NULL;
+
+	// A dongle plugged back into the same port gets its old tile back.
+	for (int i = 0; i < ui->device_count; i++) {
+		struct Device *device = &ui->devices[i];
+		if (SDL_strcmp(device->info.usb_path, info->usb_path) == 0) {
+			return device;
+		} else if (!empty && device->info.usb_path[0] == '\0') {
+			empty = device;
+		}
+	}
+
+	if (!empty && ui->device_count < MAX_DEVICES) {
+		empty = &ui->devices[ui->device_count++];
+	}
+	return empty;
+}
+
+static void
+handle_discovery(struct Ui *ui, struct DiscoveryEvent *event) {
+	struct Device *device;
+
+	switch (event->action) {
+	case DISCOVERY_ADD:
+		device = claim_device(ui, &event->info);
+		if (!device) {
+			SDL_Log("No room for %s", event->info.usb_path);
+		} else if (!device->connected && !device_opening(device)) {
+			device->info = event->info;
+			connect_device(device);
+		}
+		break;
+	case DISCOVERY_REMOVE:
+		for (int i = 0; i < ui->device_count; i++) {
+			device = &ui->devices[i];
+			if (device->connected && device->info.usb_path[0] != '\0' &&
+				(SDL_strcmp(device->info.video_path, event->devnode) == 0 ||
+				 SDL_strcmp(device->info.serial_path, event->devnode) == 0)) {
+				SDL_Log("Disconnected %s", device->info.usb_path);
+				control_lock(&ui->control);
+				device_cleanup(device);
+				control_unlock(&ui->control);
+				update_layout(ui);
+			}
+		}
+		break;
+	}
+}
+
+static void
+set_hidden(struct Ui *ui, bool hidden) {
+	if (ui->hidden != hidden) {
+		ui->hidden = hidden;
+		update_layout(ui);
+	}
+}
+
+static bool
+focus_at(struct Ui *ui, float x, float y) {
+	SDL_FPoint p = {x, y};
+	for (int i = 0; i < ui->device_count; i++) {
+		if (i != ui->focused &&
+			SDL_PointInRectFloat(&p, &ui->devices[i].rect)) {
+			ui->focused = i;
+			update_layout(ui);
+			redraw(ui);
+			return true;
+		}
+	}
+	return false;
+}
+
 int
 main(int argc, char *argv[]) {
-	(void)argc;
-	(void)argv;
 	struct Ui ui = {0};
+	Uint64 start;
+
+	ui.launched = SDL_GetTicksNS();
+	if (!parse_args(&ui, argc, argv)) {
+		return 1;
+	}
+	ui.configured = ui.device_count > 0;
+	trace_init();
+	trace_thread("main");
 
-	if (!SDL_Init(SDL_INIT_VIDEO | SDL_INIT_CAMERA)) {
+	// Without a window, SDL is only there for the cameras and events.
+	if (!SDL_Init(ui.headless ? SDL_INIT_EVENTS : SDL_INIT_VIDEO)) {
 		SDL_Log("Couldn't initialize SDL: %s", SDL_GetError());
 		return 1;
 	}
 
-	if (!camera_init(&ui.camera, "Openterface: Openterface")) {
-		SDL_Log("Couldn't initialize camera: %s", SDL_GetError());
+	if (!ui.configured && !discover_devices(&ui)) {
+		SDL_Quit();
 		return 1;
 	}
 
-	if (!input_init(&ui.input, "/dev/ttyUSB0")) {
-		SDL_Log("Couldn't initialize input: %s", SDL_GetError());
+	// Bring-up is dominated by the serial reset, opening the camera and
+	// creating the renderer. None of them depend on each other, so the serial
+	// ports and cameras are opened on threads while the window is created
+	// here. The camera subsystem is initialized first as the camera openers
+	// need its device list.
+	for (int i = 0; i < ui.device_count; i++) {
+		if (ui.devices[i].info.camera_name[0] != '\0') {
+			device_open_input(&ui.devices[i]);
+		}
+	}
+	start = SDL_GetTicksNS();
+	if (!SDL_InitSubSystem(SDL_INIT_CAMERA)) {
+		SDL_Log("Couldn't initialize SDL camera: %s", SDL_GetError());
+		discovery_cleanup(&ui.discovery);
+		for (int i = 0; i < ui.device_count; i++) {
+			device_cleanup(&ui.devices[i]);
+		}
+		SDL_Quit();
 		return 1;
 	}
+	log_stage(&ui, "Camera subsystem", SDL_GetTicksNS() - start);
+	for (int i = 0; i < ui.device_count; i++) {
+		connect_device(&ui.devices[i]);
+	}
 
-	SDL_Cursor *cursor =
-			SDL_CreateCursor(cursor_msb[0], cursor_msb[1], 8, 8, 1, 1);
-	SDL_SetCursor(cursor);
+	ui.running = ui.headless || start_ui(&ui);
+	if (ui.running && ui.control_path &&
+		!control_start(
+				&ui.control, ui.control_path, ui.devices, MAX_DEVICES)) {
+		SDL_Log("Couldn't start the control socket: %s", SDL_GetError());
+		ui.running = false;
+	}
+
+	SDL_Cursor *cursor = NULL;
+	if (!ui.headless) {
+		cursor = SDL_CreateCursor(cursor_msb[0], cursor_msb[1], 8, 8, 1, 1);
+		SDL_SetCursor(cursor);
+	}
 
 	SDL_Event event;
 
-	ui.running = true;
 	while (ui.running && SDL_WaitEvent(&event)) {
+		struct Device *device = NULL;
 		switch (event.type) {
+		case SDL_EVENT_WINDOW_MINIMIZED:
+		case SDL_EVENT_WINDOW_HIDDEN:
+		case SDL_EVENT_WINDOW_OCCLUDED:
+			set_hidden(&ui, true);
+			break;
+		case SDL_EVENT_WINDOW_SHOWN:
+		case SDL_EVENT_WINDOW_RESTORED:
+			set_hidden(&ui, false);
+			break;
 		case SDL_EVENT_WINDOW_EXPOSED:
+			set_hidden(&ui, false);
 			redraw(&ui);
 			break;
 		case SDL_EVENT_USER:
 			switch (event.user.code) {
 			case CAMERA_EVENT_CODE:
-				// If we get a camera frame make sure the ui is visible.
-				if (!start_ui(&ui)) {
-					ui.running = false;
+				device = find_device(&ui, event.user.data1);
+				if (!device || !device->connected) {
 					break;
 				}
-				camera_update_texture(&ui.camera, ui.renderer);
+				camera_update_texture(&device->camera, ui.renderer);
+				first_frame(&ui, device);
+				break;
+			case DEVICE_EVENT_CODE:
+				ui.running = device_opened(&ui, event.user.data1);
 				break;
 			case INPUT_EVENT_CODE:
+				if (find_device(&ui, event.user.data1) !=
+					focused_device(&ui)) {
+					break;
+				}
 				SDL_RemoveTimer(ui.show_indicator);
 				ui.show_indicator = SDL_AddTimer(
 						INDICATOR_TIMEOUT, user_event_timer,
 						(void *)INDICATOR_TIMEOUT_CODE);
 				break;
+			case MACRO_EVENT_CODE:
+				device = find_device(&ui, event.user.data1);
+				if (device) {
+					device_play_done(device);
+				}
+				break;
 			case COMMAND_MODE_TIMEOUT_CODE:
 				SDL_RemoveTimer(ui.command_mode);
 				ui.command_mode = 0;
@@ -303,6 +869,10 @@ main(int argc, char *argv[]) {
 				SDL_RemoveTimer(ui.show_indicator);
 				ui.show_indicator = 0;
 				break;
+			case DISCOVERY_EVENT_CODE:
+				handle_discovery(&ui, event.user.data1);
+				SDL_free(event.user.data1);
+				break;
 			}
 			redraw(&ui);
 			break;
@@ -310,33 +880,61 @@ main(int argc, char *argv[]) {
 			if (ui.command_mode) {
 				handle_command(&ui, &event);
 			} else {
-				input_send_input_event(&ui.input, &event, false);
+				device_send_input_event(focused_device(&ui), &event, false);
 			}
 			if (event.key.key == MAGIC_KEY) {
 				Uint64 timestamp = event.key.timestamp / 1000 / 1000;
 				if (timestamp - MAGIC_KEY_TIMEOUT <
 					ui.last_magic_key_timestamp) {
+					ui.command_mode_since =
+							SDL_MS_TO_NS(ui.last_magic_key_timestamp);
 					enable_command_mode(&ui);
 					redraw(&ui);
 				}
 				ui.last_magic_key_timestamp = timestamp;
 			}
 			break;
+		case SDL_EVENT_MOUSE_BUTTON_DOWN:
+			// Clicking another tile of the wall selects it. A captured
+			// pointer has no position on the wall.
+			if (wall_mode(&ui) && !ui.rel_mouse &&
+				focus_at(&ui, event.button.x, event.button.y)) {
+				break;
+			}
+			device_send_input_event(
+					focused_device(&ui), &event, ui.rel_mouse);
+			break;
 		case SDL_EVENT_KEY_UP:
+			device_send_input_event(focused_device(&ui), &event, false);
+			break;
 		case SDL_EVENT_MOUSE_MOTION:
 		case SDL_EVENT_MOUSE_BUTTON_UP:
-		case SDL_EVENT_MOUSE_BUTTON_DOWN:
 		case SDL_EVENT_MOUSE_WHEEL:
-			input_send_input_event(&ui.input, &event, false);
+			device_send_input_event(
+					focused_device(&ui), &event, ui.rel_mouse);
 			break;
 		case SDL_EVENT_QUIT:
 			ui.running = false;
 			break;
+		case SDL_EVENT_CAMERA_DEVICE_ADDED:
+			// udev may announce a dongle before SDL knows its camera.
+			for (int i = 0; i < ui.device_count; i++) {
+				if (ui.devices[i].info.usb_path[0] != '\0') {
+					connect_device(&ui.devices[i]);
+				}
+			}
+			break;
 		case SDL_EVENT_CAMERA_DEVICE_APPROVED:
 			SDL_LogTrace(
 					SDL_LOG_CATEGORY_APPLICATION,
 					"Camera use approved by user!");
-			camera_start(&ui.camera);
+			for (int i = 0; i < ui.device_count; i++) {
+				struct Camera *camera = &ui.devices[i].camera;
+				if (ui.devices[i].connected && !camera->thread &&
+					SDL_GetCameraID(camera->camera) == event.cdevice.which) {
+					camera_start(camera);
+				}
+			}
 			break;
 		case SDL_EVENT_CAMERA_DEVICE_DENIED:
 			SDL_LogWarn(
@@ -344,14 +942,23 @@ main(int argc, char *argv[]) {
 			ui.running = false;
 			break;
 		case SDL_EVENT_WINDOW_RESIZED:
-			update_camera_rect(&ui);
+			update_layout(&ui);
 			redraw(&ui);
 			break;
 		}
 	}
 
-	input_cleanup(&ui.input);
-	camera_cleanup(&ui.camera);
+	control_cleanup(&ui.control);
+	discovery_cleanup(&ui.discovery);
+	for (int i = 0; i < ui.device_count; i++) {
+		device_cleanup(&ui.devices[i]);
+	}
+	if (ui.latency_path && !latency_dump(ui.latency_path)) {
+		SDL_Log("Couldn't save latencies: %s", SDL_GetError());
+	}
+	if (!trace_save()) {
+		SDL_Log("Couldn't save the trace: %s", SDL_GetError());
+	}
 
 	SDL_DestroyRenderer(ui.renderer);
 	SDL_DestroyWindow(ui.window);
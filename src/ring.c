@@ -0,0 +1,341 @@
+#include "ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static size_t
+page_align(size_t size) {
+	const size_t page = sysconf(_SC_PAGESIZE);
+	return (size + page - 1) / page * page;
+}
+
+// The ring is shared between processes, so the futex can't be private.
+static long
+futex(const SDL_AtomicU32 *word, int op, Uint32 value,
+	  const struct timespec *timeout) {
+	return syscall(SYS_futex, &word->value, op, value, timeout, NULL, 0);
+}
+
+Uint64
+ring_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (Uint64)ts.tv_sec * SDL_NS_PER_SECOND + ts.tv_nsec;
+}
+
+bool
+ring_init(struct Ring *ring, const char *name) {
+	SDL_zerop(ring);
+	if (name[0] != '/' ||
+		SDL_strlcpy(ring->name, name, sizeof(ring->name)) >=
+				sizeof(ring->name)) {
+		SDL_zerop(ring);
+		return SDL_SetError("Invalid frame ring name: %s", name);
+	}
+	return true;
+}
+
+bool
+ring_enabled(struct Ring *ring) {
+	return ring->name[0] != '\0';
+}
+
+// Tells the readers to open the name again and lets go of the mapping.
+static void
+ring_unmap(struct Ring *ring) {
+	if (ring->header != NULL) {
+		SDL_SetAtomicU32(&ring->header->closed, 1);
+		SDL_SetAtomicU32(
+				&ring->header->sequence,
+				SDL_GetAtomicU32(&ring->header->sequence) + 1);
+		futex(&ring->header->sequence, FUTEX_WAKE, INT_MAX, NULL);
+		munmap(ring->header, ring->size);
+	}
+	if (ring->fd > 0) {
+		close(ring->fd);
+	}
+	ring->header = NULL;
+	ring->fd = 0;
+	ring->size = 0;
+	ring->slot = NULL;
+}
+
+// Makes a ring for frames of up to `frame_size` bytes. Readers of an
+// older, smaller ring are sent over to the new one.
+static bool
+ring_create(struct Ring *ring, size_t frame_size) {
+	const size_t header_size = page_align(sizeof(struct RingHeader));
+	const size_t slot_size = page_align(frame_size);
+	const size_t size = header_size + RING_SLOTS * slot_size;
+	struct RingHeader *header = MAP_FAILED;
+	int fd;
+
+	shm_unlink(ring->name);
+	fd = shm_open(
+			ring->name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+			S_IRUSR | S_IWUSR);
+	if (fd < 0 || ftruncate(fd, size) < 0 ||
+		(header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+					   0)) == MAP_FAILED) {
+		SDL_SetError("Couldn't create frame ring %s: %s", ring->name,
+					 strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			shm_unlink(ring->name);
+		}
+		return false;
+	}
+
+	header->version = RING_VERSION;
+	header->slot_count = RING_SLOTS;
+	header->slot_size = slot_size;
+	for (int i = 0; i < RING_SLOTS; i++) {
+		header->slots[i].offset = header_size + i * slot_size;
+	}
+	// Readers check the magic last.
+	SDL_MemoryBarrierRelease();
+	header->magic = RING_MAGIC;
+
+	ring_unmap(ring);
+	ring->fd = fd;
+	ring->header = header;
+	ring->size = size;
+	SDL_Log("Publishing frames to %s, %d slots of %zu bytes", ring->name,
+			RING_SLOTS, slot_size);
+	return true;
+}
+
+// Returns where the next frame goes, or NULL. The frame must be committed
+// or aborted before the next one begins.
+Uint8 *
+ring_begin(
+		struct Ring *ring, int width, int height, SDL_PixelFormat format,
+		int pitch) {
+	const size_t size = (size_t)pitch * height;
+	struct RingSlot *slot;
+
+	if (ring->header == NULL || size > ring->header->slot_size) {
+		if (!ring_create(ring, size)) {
+			return NULL;
+		}
+	}
+
+	// Never the slot of the latest frame, readers have the time of
+	// RING_SLOTS - 1 frames to look at that.
+	slot = &ring->header->slots[ring->sequence % RING_SLOTS];
+	SDL_SetAtomicU32(&slot->lock, SDL_GetAtomicU32(&slot->lock) + 1);
+	SDL_MemoryBarrierRelease();
+	slot->format = format;
+	slot->width = width;
+	slot->height = height;
+	slot->pitch = pitch;
+	slot->size = size;
+	ring->slot = slot;
+	return (Uint8 *)ring->header + slot->offset;
+}
+
+// Publishes the frame and wakes one reader, which wakes the next, so the
+// camera thread doesn't pay for every reader.
+void
+ring_commit(struct Ring *ring, Uint64 timestamp) {
+	struct RingSlot *slot = ring->slot;
+
+	if (slot == NULL) {
+		return;
+	}
+	slot->timestamp = timestamp;
+	slot->published = ring_now();
+	slot->sequence = ++ring->sequence;
+	SDL_MemoryBarrierRelease();
+	SDL_SetAtomicU32(&slot->lock, SDL_GetAtomicU32(&slot->lock) + 1);
+	SDL_SetAtomicU32(&ring->header->sequence, (Uint32)ring->sequence);
+	futex(&ring->header->sequence, FUTEX_WAKE, 1, NULL);
+	ring->slot = NULL;
+}
+
+// Leaves the slot empty, the latest frame is still the one before.
+void
+ring_abort(struct Ring *ring) {
+	struct RingSlot *slot = ring->slot;
+
+	if (slot == NULL) {
+		return;
+	}
+	slot->size = 0;
+	slot->sequence = 0;
+	SDL_MemoryBarrierRelease();
+	SDL_SetAtomicU32(&slot->lock, SDL_GetAtomicU32(&slot->lock) + 1);
+	ring->slot = NULL;
+}
+
+void
+ring_cleanup(struct Ring *ring) {
+	if (ring->header != NULL) {
+		shm_unlink(ring->name);
+		SDL_Log("Published %" SDL_PRIu64 " frames to %s", ring->sequence,
+				ring->name);
+	}
+	ring_unmap(ring);
+	SDL_zerop(ring);
+}
+
+bool
+ring_open(struct RingReader *reader, const char *name) {
+	const struct RingHeader *header = MAP_FAILED;
+	struct stat st;
+	int fd;
+
+	SDL_zerop(reader);
+	if (SDL_strlcpy(reader->name, name, sizeof(reader->name)) >=
+		sizeof(reader->name)) {
+		return SDL_SetError("Invalid frame ring name: %s", name);
+	}
+	fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		SDL_SetError("Couldn't open frame ring %s: %s", name,
+					 strerror(errno));
+		goto fail;
+	}
+	if ((size_t)st.st_size < sizeof(*header) ||
+		(header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+				MAP_FAILED) {
+		SDL_SetError("Couldn't map frame ring %s", name);
+		goto fail;
+	}
+	SDL_MemoryBarrierAcquire();
+	if (header->magic != RING_MAGIC || header->version != RING_VERSION ||
+		header->slot_count == 0 || header->slot_count > RING_SLOTS) {
+		SDL_SetError("%s is not a kvsm frame ring", name);
+		goto fail;
+	}
+	reader->fd = fd;
+	reader->header = header;
+	reader->size = st.st_size;
+	return true;
+fail:
+	if (header != MAP_FAILED) {
+		munmap((void *)header, st.st_size);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	SDL_zerop(reader);
+	return false;
+}
+
+// Waits up to `timeout` ms, or forever if negative, for a frame newer than
+// the last one read. Follows kvsm to a new ring. Returns 1 if there is a
+// frame, 0 on timeout, -1 if the ring is gone.
+int
+ring_wait(struct RingReader *reader, Sint32 timeout) {
+	const Uint64 deadline = ring_now() + SDL_MS_TO_NS((Sint64)timeout);
+	struct timespec left;
+	const struct timespec *limit = timeout >= 0 ? &left : NULL;
+	char name[RING_NAME_MAX];
+
+	while (reader->header != NULL) {
+		SDL_AtomicU32 *sequence = (SDL_AtomicU32 *)&reader->header->sequence;
+		const Uint32 current = SDL_GetAtomicU32(sequence);
+		Uint64 now;
+
+		if (SDL_GetAtomicU32((SDL_AtomicU32 *)&reader->header->closed)) {
+			SDL_strlcpy(name, reader->name, sizeof(name));
+			ring_close(reader);
+			if (!ring_open(reader, name)) {
+				return -1;
+			}
+			continue;
+		}
+		if (current != reader->seen) {
+			return 1;
+		}
+		now = ring_now();
+		if (timeout >= 0 && now >= deadline) {
+			return 0;
+		}
+		left.tv_sec = (deadline - now) / SDL_NS_PER_SECOND;
+		left.tv_nsec = (deadline - now) % SDL_NS_PER_SECOND;
+		if (futex(sequence, FUTEX_WAIT, current, limit) == 0) {
+			// Passes the wake-up on to the next reader.
+			futex(sequence, FUTEX_WAKE, 1, NULL);
+		} else if (errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+			SDL_SetError("Couldn't wait for a frame: %s", strerror(errno));
+			return -1;
+		}
+	}
+	SDL_SetError("The frame ring is closed");
+	return -1;
+}
+
+// Points `frame` at the latest frame in the ring, without copying it.
+bool
+ring_latest(struct RingReader *reader, struct RingFrame *frame) {
+	const struct RingHeader *header = reader->header;
+
+	if (header == NULL) {
+		return SDL_SetError("The frame ring is closed");
+	}
+	// Only a reader that sleeps between reading the sequence and the slot
+	// has to try again.
+	for (int i = 0; i < RING_SLOTS; i++) {
+		const Uint32 sequence =
+				SDL_GetAtomicU32((SDL_AtomicU32 *)&header->sequence);
+		const struct RingSlot *slot;
+
+		if (sequence == 0) {
+			return SDL_SetError("No frame yet");
+		}
+		slot = &header->slots[(sequence - 1) % header->slot_count];
+		frame->slot = slot;
+		frame->lock = SDL_GetAtomicU32((SDL_AtomicU32 *)&slot->lock);
+		if (frame->lock & 1) {
+			continue;
+		}
+		frame->format = slot->format;
+		frame->width = slot->width;
+		frame->height = slot->height;
+		frame->pitch = slot->pitch;
+		frame->size = slot->size;
+		frame->timestamp = slot->timestamp;
+		frame->published = slot->published;
+		frame->sequence = slot->sequence;
+		if (slot->offset > reader->size ||
+			frame->size > reader->size - slot->offset) {
+			return SDL_SetError("Frame out of the ring");
+		}
+		frame->pixels = (const Uint8 *)header + slot->offset;
+		if (frame->sequence != 0 && ring_frame_valid(frame)) {
+			reader->seen = sequence;
+			return true;
+		}
+	}
+	return SDL_SetError("Frames come faster than they are read");
+}
+
+// Whether the frame is still whole. Check after reading the pixels, or
+// after copying them.
+bool
+ring_frame_valid(const struct RingFrame *frame) {
+	SDL_MemoryBarrierAcquire();
+	return SDL_GetAtomicU32((SDL_AtomicU32 *)&frame->slot->lock) ==
+			frame->lock;
+}
+
+void
+ring_close(struct RingReader *reader) {
+	if (reader->header != NULL) {
+		munmap((void *)reader->header, reader->size);
+	}
+	if (reader->fd > 0) {
+		close(reader->fd);
+	}
+	SDL_zerop(reader);
+}
@@ -0,0 +1,186 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+bool trace_enabled;
+
+static const char *path;
+// Every thread's buffer, pushed without a lock as threads start recording.
+static void *buffers;
+static _Thread_local struct TraceBuffer *current;
+static _Thread_local const char *current_name;
+
+// Traces to the file named by TRACE_ENV, if it is set. Call before
+// starting any thread.
+bool
+trace_init(void) {
+	path = SDL_getenv(TRACE_ENV);
+	trace_enabled = path != NULL && path[0] != '\0';
+	if (trace_enabled) {
+		SDL_Log("Tracing to %s", path);
+	}
+	return true;
+}
+
+static struct TraceBuffer *
+thread_buffer(void) {
+	struct TraceBuffer *head;
+
+	if (current != NULL) {
+		return current;
+	}
+	current = SDL_calloc(1, sizeof(*current));
+	if (current == NULL) {
+		return NULL;
+	}
+	current->thread = SDL_GetCurrentThreadID();
+	current->thread_name = current_name;
+	do {
+		head = SDL_GetAtomicPointer(&buffers);
+		current->next = head;
+	} while (!SDL_CompareAndSwapAtomicPointer(&buffers, head, current));
+	return current;
+}
+
+static struct TraceChunk *
+add_chunk(struct TraceBuffer *buffer) {
+	struct TraceChunk *chunk;
+
+	if (buffer->chunks == TRACE_EVENTS / TRACE_CHUNK) {
+		return NULL;
+	}
+	chunk = SDL_calloc(1, sizeof(*chunk));
+	if (chunk == NULL) {
+		return NULL;
+	}
+	if (buffer->last == NULL) {
+		SDL_SetAtomicPointer(&buffer->first, chunk);
+	} else {
+		SDL_SetAtomicPointer(&buffer->last->next, chunk);
+	}
+	buffer->last = chunk;
+	buffer->chunks++;
+	return chunk;
+}
+
+// Names the calling thread in the trace. Nothing is allocated until the
+// thread records an event.
+void
+trace_thread(const char *name) {
+	current_name = name;
+	if (current != NULL) {
+		current->thread_name = name;
+	}
+}
+
+void
+trace_event(const char *name, char phase) {
+	struct TraceBuffer *buffer = thread_buffer();
+	struct TraceChunk *chunk;
+	int count;
+
+	if (buffer == NULL) {
+		return;
+	}
+	chunk = buffer->last;
+	count = chunk != NULL ? SDL_GetAtomicInt(&chunk->count) : TRACE_CHUNK;
+	if (count == TRACE_CHUNK) {
+		chunk = add_chunk(buffer);
+		if (chunk == NULL) {
+			buffer->dropped++;
+			return;
+		}
+		count = 0;
+	}
+	chunk->events[count] = (struct TraceEvent){
+			.name = name,
+			.time = SDL_GetTicksNS(),
+			.phase = phase,
+	};
+	SDL_SetAtomicInt(&chunk->count, count + 1);
+}
+
+// Uncontended locks aren't worth an event.
+void
+trace_lock(SDL_Mutex *mutex, const char *name) {
+	if (SDL_TryLockMutex(mutex)) {
+		return;
+	}
+	trace_event(name, 'B');
+	SDL_LockMutex(mutex);
+	trace_event(name, 'E');
+}
+
+// Writes the events of every thread and stops tracing. Call after the
+// other threads are done.
+bool
+trace_save(void) {
+	struct TraceBuffer *list;
+	FILE *file;
+	const char *separator = "";
+	const int pid = getpid();
+	bool rv = true;
+
+	if (!trace_enabled) {
+		return true;
+	}
+	trace_enabled = false;
+	current = NULL;
+	list = SDL_SetAtomicPointer(&buffers, NULL);
+
+	file = fopen(path, "w");
+	if (file == NULL) {
+		rv = SDL_SetError("Couldn't open %s: %s", path, strerror(errno));
+		goto out;
+	}
+	fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (struct TraceBuffer *b = list; b != NULL; b = b->next) {
+		struct TraceChunk *chunk = SDL_GetAtomicPointer(&b->first);
+
+		fprintf(file,
+				"%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+				"\"tid\":%" SDL_PRIu64 ",\"args\":{\"name\":\"%s\"}}",
+				separator, pid, b->thread,
+				b->thread_name ? b->thread_name : "thread");
+		separator = ",";
+		for (; chunk != NULL; chunk = SDL_GetAtomicPointer(&chunk->next)) {
+			const int count = SDL_GetAtomicInt(&chunk->count);
+
+			for (int i = 0; i < count; i++) {
+				const struct TraceEvent *event = &chunk->events[i];
+				fprintf(file,
+						",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,"
+						"\"tid\":%" SDL_PRIu64 ",\"ts\":%" SDL_PRIu64
+						".%03d}",
+						event->name, event->phase, pid, b->thread,
+						event->time / SDL_NS_PER_US,
+						(int)(event->time % SDL_NS_PER_US));
+			}
+		}
+		if (b->dropped > 0) {
+			SDL_Log("Trace buffer full, dropped %d events of thread %s",
+					b->dropped, b->thread_name ? b->thread_name : "thread");
+		}
+	}
+	fprintf(file, "\n]}\n");
+	if (fclose(file) != 0) {
+		rv = SDL_SetError("Couldn't write %s: %s", path, strerror(errno));
+	}
+out:
+	while (list != NULL) {
+		struct TraceBuffer *next = list->next;
+		struct TraceChunk *chunk = list->first;
+
+		while (chunk != NULL) {
+			struct TraceChunk *next_chunk = chunk->next;
+			SDL_free(chunk);
+			chunk = next_chunk;
+		}
+		SDL_free(list);
+		list = next;
+	}
+	return rv;
+}
@@ -0,0 +1,77 @@
+#include "emulator.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void
+usage(const char *arg0) {
+	fprintf(stderr,
+			"Usage: %s [-b BAUD] [-d USEC] [-x N] [-e N] [-g N] [-s SEED]\n"
+			"Emulates a CH9329 on a pseudo terminal and logs what the target\n"
+			"sees to stdout.\n"
+			"  -b BAUD  speed the chip starts at (default 9600)\n"
+			"  -d USEC  time the chip takes per command\n"
+			"  -x N     lose one in N commands\n"
+			"  -e N     answer one in N commands with a checksum error\n"
+			"  -g N     break the checksum of one in N answers\n"
+			"  -s SEED  seed for the faults\n",
+			arg0);
+}
+
+int
+main(int argc, char *argv[]) {
+	struct EmulatorOptions options = {.log = stdout};
+	struct Emulator emulator;
+	struct EmulatorStats stats;
+	sigset_t signals;
+	int signal;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:d:x:e:g:s:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			options.baud = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			options.delay = atoi(optarg);
+			break;
+		case 'x':
+			options.drop = atoi(optarg);
+			break;
+		case 'e':
+			options.error = atoi(optarg);
+			break;
+		case 'g':
+			options.garble = atoi(optarg);
+			break;
+		case 's':
+			options.seed = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	// Blocked before the emulator thread starts, so it inherits the mask.
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	if (emulator_start(&emulator, &options) < 0) {
+		perror("emulator_start");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "CH9329 emulator on %s\n", emulator.path);
+
+	sigwait(&signals, &signal);
+	emulator_stats(&emulator, &stats);
+	emulator_stop(&emulator);
+	fprintf(stderr,
+			"%lu frames, %lu answers, %lu dropped, %lu errors, %lu garbled, "
+			"%lu overruns, %lu bytes at the wrong speed, %lu resets\n",
+			stats.frames, stats.answers, stats.dropped, stats.errors,
+			stats.garbled, stats.overruns, stats.garbage, stats.resets);
+	return EXIT_SUCCESS;
+}
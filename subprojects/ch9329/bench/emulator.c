@@ -0,0 +1,603 @@
+// posix_openpt() and ppoll().
+#define _GNU_SOURCE
+#include "emulator.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
+// Offset of the big endian baud rate in the parameter block, see config.c.
+#define CONFIG_BAUD 3
+#define CONFIG_VID 11
+#define CONFIG_PID 13
+#define DEFAULT_BAUD 9600
+// Start, eight data and one stop bit.
+#define BITS_PER_BYTE 10
+#define NS_PER_SECOND 1000000000ull
+#define NUM_LOCK_KEY 0x53
+#define CAPS_LOCK_KEY 0x39
+#define SCROLL_LOCK_KEY 0x47
+
+static const struct {
+	speed_t speed;
+	uint32_t baud;
+} speeds[] = {
+		{B9600, 9600},     {B19200, 19200},   {B38400, 38400},
+		{B57600, 57600},   {B115200, 115200}, {B230400, 230400},
+		{B460800, 460800}, {B921600, 921600},
+};
+
+uint64_t
+emulator_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_SECOND + ts.tv_nsec;
+}
+
+static speed_t
+baud_speed(uint32_t baud) {
+	for (size_t i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++) {
+		if (speeds[i].baud == baud) {
+			return speeds[i].speed;
+		}
+	}
+	return B0;
+}
+
+// What the host set its end of the line to.
+static uint32_t
+line_baud(struct Emulator *emulator) {
+	struct termios tio;
+	if (tcgetattr(emulator->slave, &tio) < 0) {
+		return 0;
+	}
+	for (size_t i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++) {
+		if (speeds[i].speed == cfgetospeed(&tio)) {
+			return speeds[i].baud;
+		}
+	}
+	return 0;
+}
+
+static uint64_t
+byte_time(const struct Emulator *emulator) {
+	return NS_PER_SECOND * BITS_PER_BYTE / emulator->baud;
+}
+
+static uint32_t
+config_baud(const uint8_t *config) {
+	const uint8_t *data = config + CONFIG_BAUD;
+	return (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 |
+			(uint32_t)data[2] << 8 | data[3];
+}
+
+static void
+default_config(uint8_t *config) {
+	memset(config, 0, EMULATOR_CONFIG_SIZE);
+	config[CONFIG_BAUD + 0] = 0;
+	config[CONFIG_BAUD + 1] = 0;
+	config[CONFIG_BAUD + 2] = (DEFAULT_BAUD >> 8) & 0xff;
+	config[CONFIG_BAUD + 3] = DEFAULT_BAUD & 0xff;
+	config[CONFIG_VID + 0] = 0x1a;
+	config[CONFIG_VID + 1] = 0x86;
+	config[CONFIG_PID + 0] = 0xe1;
+	config[CONFIG_PID + 1] = 0x29;
+}
+
+// xorshift32, the same faults for the same seed.
+static bool
+one_in(struct Emulator *emulator, int n) {
+	uint32_t x = emulator->random;
+	if (n <= 0) {
+		return false;
+	}
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	emulator->random = x;
+	return x % n == 0;
+}
+
+static void
+log_state(struct Emulator *emulator, enum Ch9329Command command) {
+	const struct EmulatorState *s = &emulator->state;
+	FILE *log = emulator->options.log;
+	if (log == NULL) {
+		return;
+	}
+
+	fprintf(log, "%.6f ",
+			(double)(emulator_now() - emulator->started_at) / NS_PER_SECOND);
+	switch (command) {
+	case CH9329_CMD_SEND_KB_GENERAL_DATA:
+		fprintf(log, "keyboard %02x", s->keyboard[0]);
+		for (int i = 2; i < 8; i++) {
+			fprintf(log, " %02x", s->keyboard[i]);
+		}
+		fprintf(log, " leds %x\n", s->leds);
+		break;
+	case CH9329_CMD_SEND_KB_MEDIA_DATA:
+		fprintf(log, "media %02x %02x %02x acpi %02x\n", s->media[0],
+				s->media[1], s->media[2], s->acpi);
+		break;
+	case CH9329_CMD_SEND_MS_ABS_DATA:
+	case CH9329_CMD_SEND_MS_REL_DATA:
+		fprintf(log, "mouse buttons %x abs %u %u rel %ld %ld wheel %ld\n",
+				s->buttons, s->x, s->y, s->rel_x, s->rel_y, s->wheel);
+		break;
+	case CH9329_CMD_SET_PARA_CFG:
+		fprintf(log, "config baud %u\n", config_baud(emulator->config));
+		break;
+	case CH9329_CMD_RESET:
+		fprintf(log, "reset baud %u\n", emulator->baud);
+		break;
+	default:
+		break;
+	}
+	fflush(log);
+}
+
+// Lock keys toggle their LED on the target when they go down.
+static void
+toggle_leds(struct Emulator *emulator, const uint8_t *keyboard) {
+	static const struct {
+		uint8_t key;
+		uint8_t led;
+	} locks[] = {
+			{NUM_LOCK_KEY, CH9329_INDICATOR_NUM_LOCK},
+			{CAPS_LOCK_KEY, CH9329_INDICATOR_CAPS_LOCK},
+			{SCROLL_LOCK_KEY, CH9329_INDICATOR_SCROLL_LOCK},
+	};
+	for (size_t i = 0; i < sizeof(locks) / sizeof(locks[0]); i++) {
+		bool was_down = memchr(&emulator->state.keyboard[2], locks[i].key,
+								6) != NULL;
+		bool is_down = memchr(&keyboard[2], locks[i].key, 6) != NULL;
+		if (is_down && !was_down) {
+			emulator->state.leds ^= locks[i].led;
+		}
+	}
+}
+
+static void
+clear_hid(struct EmulatorState *state) {
+	memset(state->keyboard, 0, sizeof(state->keyboard));
+	memset(state->media, 0, sizeof(state->media));
+	state->acpi = 0;
+	state->buttons = 0;
+	state->x = 0;
+	state->y = 0;
+	state->rel_x = 0;
+	state->rel_y = 0;
+	state->wheel = 0;
+}
+
+// Works out the answer to a command. Reports only change the state once
+// they take effect, see apply().
+static enum Ch9329Error
+answer(struct Emulator *emulator, const struct Ch9329Frame *request,
+	   struct Ch9329Frame *response) {
+	const enum Ch9329Command command = ch9329_frame_command(request);
+	const uint8_t len = ch9329_frame_len(request);
+	const uint8_t *data = ch9329_frame_data(request);
+	enum Ch9329Error error = CH9329_SUCCESS;
+	uint8_t info[8] = {0};
+	uint8_t status;
+
+	switch (command) {
+	case CH9329_CMD_GET_INFO:
+		info[0] = 0x30;
+		info[1] = emulator->state.connected;
+		info[2] = emulator->state.leds;
+		ch9329_frame(response, command | 0x80, info, sizeof(info));
+		return CH9329_SUCCESS;
+	case CH9329_CMD_GET_PARA_CFG:
+		ch9329_frame(
+				response, command | 0x80, emulator->config,
+				EMULATOR_CONFIG_SIZE);
+		return CH9329_SUCCESS;
+	case CH9329_CMD_SEND_KB_GENERAL_DATA:
+		error = len == 8 ? CH9329_SUCCESS : CH9329_ERR_PARA;
+		break;
+	case CH9329_CMD_SEND_KB_MEDIA_DATA:
+		error = (len == 4 && data[0] == 0x02) || (len == 2 && data[0] == 0x01)
+				? CH9329_SUCCESS
+				: CH9329_ERR_PARA;
+		break;
+	case CH9329_CMD_SEND_MS_ABS_DATA:
+		error = len == 7 && data[0] == 0x02 ? CH9329_SUCCESS : CH9329_ERR_PARA;
+		break;
+	case CH9329_CMD_SEND_MS_REL_DATA:
+		error = len == 5 && data[0] == 0x01 ? CH9329_SUCCESS : CH9329_ERR_PARA;
+		break;
+	case CH9329_CMD_SET_PARA_CFG:
+		error = len == EMULATOR_CONFIG_SIZE &&
+								baud_speed(config_baud(data)) != B0
+				? CH9329_SUCCESS
+				: CH9329_ERR_PARA;
+		break;
+	case CH9329_CMD_SET_DEFAULT_CFG:
+	case CH9329_CMD_RESET:
+		break;
+	default:
+		error = CH9329_ERR_CMD;
+		break;
+	}
+
+	status = error;
+	ch9329_frame(
+			response, command | (error == CH9329_SUCCESS ? 0x80 : 0xc0),
+			&status, 1);
+	return error;
+}
+
+// Lets a command take effect on the target.
+static void
+apply(struct Emulator *emulator, const struct Ch9329Frame *request) {
+	const enum Ch9329Command command = ch9329_frame_command(request);
+	const uint8_t *data = ch9329_frame_data(request);
+	struct EmulatorState *state = &emulator->state;
+
+	switch (command) {
+	case CH9329_CMD_SEND_KB_GENERAL_DATA:
+		toggle_leds(emulator, data);
+		memcpy(state->keyboard, data, sizeof(state->keyboard));
+		break;
+	case CH9329_CMD_SEND_KB_MEDIA_DATA:
+		if (data[0] == 0x02) {
+			memcpy(state->media, &data[1], sizeof(state->media));
+		} else {
+			state->acpi = data[1];
+		}
+		break;
+	case CH9329_CMD_SEND_MS_ABS_DATA:
+		state->buttons = data[1];
+		state->x = data[2] | data[3] << 8;
+		state->y = data[4] | data[5] << 8;
+		state->wheel += (int8_t)data[6];
+		break;
+	case CH9329_CMD_SEND_MS_REL_DATA:
+		state->buttons = data[1];
+		state->rel_x += (int8_t)data[2];
+		state->rel_y += (int8_t)data[3];
+		state->wheel += (int8_t)data[4];
+		break;
+	case CH9329_CMD_SET_PARA_CFG:
+		memcpy(emulator->config, data, EMULATOR_CONFIG_SIZE);
+		break;
+	case CH9329_CMD_SET_DEFAULT_CFG:
+		default_config(emulator->config);
+		break;
+	case CH9329_CMD_RESET:
+		// The chip comes back at the configured speed, with nothing
+		// pressed. Its answer still goes out at the old one.
+		emulator->baud = config_baud(emulator->config);
+		clear_hid(state);
+		emulator->stats.resets++;
+		break;
+	default:
+		return;
+	}
+
+	state->reports++;
+	log_state(emulator, command);
+	if (emulator->options.callback != NULL) {
+		emulator->options.callback(
+				state, command, emulator_now(), emulator->options.userdata);
+	}
+}
+
+// Queues the answer to a complete frame whose last byte arrived at
+// `arrived`.
+static void
+receive(struct Emulator *emulator, const struct Ch9329Frame *request,
+		uint64_t arrived, uint64_t byte_ns) {
+	struct EmulatorAnswer *answer_slot;
+	const uint8_t error = CH9329_ERR_SUM;
+	uint64_t start;
+
+	emulator->stats.frames++;
+	if (emulator->answer_count == EMULATOR_QUEUE_SIZE) {
+		emulator->stats.overruns++;
+		return;
+	}
+	answer_slot = &emulator->answers
+			[(emulator->answer_head + emulator->answer_count++) %
+			 EMULATOR_QUEUE_SIZE];
+	memset(answer_slot, 0, sizeof(*answer_slot));
+	answer_slot->request = *request;
+
+	start = arrived > emulator->busy_until ? arrived : emulator->busy_until;
+	answer_slot->done_at = start + emulator->options.delay * 1000ull;
+	emulator->busy_until = answer_slot->done_at;
+
+	if (one_in(emulator, emulator->options.drop)) {
+		// Lost on the line, the chip never saw it.
+		answer_slot->drop = true;
+		answer_slot->applied = true;
+		answer_slot->due_at = answer_slot->done_at;
+		emulator->stats.dropped++;
+		return;
+	}
+	if (one_in(emulator, emulator->options.error)) {
+		ch9329_frame(
+				&answer_slot->response,
+				ch9329_frame_command(request) | 0xc0, &error, 1);
+		answer_slot->applied = true;
+		emulator->stats.errors++;
+	} else if (answer(emulator, request, &answer_slot->response) !=
+			   CH9329_SUCCESS) {
+		answer_slot->applied = true;
+	}
+	if (one_in(emulator, emulator->options.garble)) {
+		answer_slot->garble = true;
+		emulator->stats.garbled++;
+	}
+
+	start = answer_slot->done_at > emulator->tx_free ? answer_slot->done_at
+													 : emulator->tx_free;
+	answer_slot->due_at = start +
+			(sizeof(answer_slot->response.header) +
+			 ch9329_frame_len(&answer_slot->response) + 1) *
+					byte_ns;
+	emulator->tx_free = answer_slot->due_at;
+}
+
+static void
+send_answer(struct Emulator *emulator, const struct EmulatorAnswer *answer) {
+	const struct Ch9329Frame *frame = &answer->response;
+	const size_t len = sizeof(frame->header) + ch9329_frame_len(frame);
+	uint8_t bytes[sizeof(frame->header) + sizeof(frame->data) + 1];
+
+	memcpy(bytes, frame->header, len);
+	bytes[len] = ch9329_frame_checksum(frame) + (answer->garble ? 1 : 0);
+	if (write(emulator->master, bytes, len + 1) < 0) {
+		return;
+	}
+	emulator->stats.answers++;
+}
+
+// Lets what is due take effect and go out. Returns when something is due
+// next, 0 if nothing is waiting.
+static uint64_t
+run_due(struct Emulator *emulator, uint64_t now) {
+	uint64_t next = 0;
+
+	for (int i = 0; i < emulator->answer_count; i++) {
+		struct EmulatorAnswer *answer_slot = &emulator->answers
+				[(emulator->answer_head + i) % EMULATOR_QUEUE_SIZE];
+		if (answer_slot->applied) {
+			continue;
+		} else if (answer_slot->done_at > now) {
+			next = answer_slot->done_at;
+			break;
+		}
+		apply(emulator, &answer_slot->request);
+		answer_slot->applied = true;
+	}
+
+	while (emulator->answer_count > 0) {
+		struct EmulatorAnswer *answer_slot =
+				&emulator->answers[emulator->answer_head];
+		if (answer_slot->due_at > now) {
+			if (next == 0 || answer_slot->due_at < next) {
+				next = answer_slot->due_at;
+			}
+			break;
+		} else if (!answer_slot->applied) {
+			// Takes effect before its answer is out.
+			break;
+		}
+		if (!answer_slot->drop) {
+			send_answer(emulator, answer_slot);
+		}
+		emulator->answer_head =
+				(emulator->answer_head + 1) % EMULATOR_QUEUE_SIZE;
+		emulator->answer_count--;
+	}
+	return next;
+}
+
+// Reads what the host sent and splits it into frames. The bytes are timed
+// as if they came over a line at the chip's speed.
+static int
+read_line(struct Emulator *emulator, uint64_t now) {
+	uint8_t bytes[CH9329_RX_SIZE];
+	struct Ch9329Frame frame;
+	const uint64_t byte_ns = byte_time(emulator);
+	unsigned int start;
+	uint64_t first;
+	ssize_t len;
+
+	len = read(emulator->master, bytes, sizeof(bytes));
+	if (len <= 0) {
+		return len;
+	}
+	if (line_baud(emulator) != emulator->baud) {
+		// Noise to a chip listening at another speed.
+		emulator->stats.garbage += len;
+		return len;
+	}
+
+	first = now > emulator->rx_free ? now : emulator->rx_free;
+	emulator->rx_free = first + len * byte_ns;
+	start = emulator->parser.rx_tail;
+	ch9329_feed(&emulator->parser, bytes, len);
+	while (ch9329_parse(&emulator->parser, &frame) > 0) {
+		receive(emulator, &frame,
+				first + (emulator->parser.rx_head - start) * byte_ns,
+				byte_ns);
+	}
+	return len;
+}
+
+static void *
+emulator_thread(void *data) {
+	struct Emulator *emulator = data;
+	struct pollfd fds[2] = {
+			{.fd = emulator->master, .events = POLLIN},
+			{.fd = emulator->wakeup, .events = POLLIN},
+	};
+
+	pthread_mutex_lock(&emulator->mutex);
+	while (true) {
+		uint64_t now = emulator_now();
+		const uint64_t next = run_due(emulator, now);
+		struct timespec timeout = {0};
+
+		if (next > now) {
+			timeout.tv_sec = (next - now) / NS_PER_SECOND;
+			timeout.tv_nsec = (next - now) % NS_PER_SECOND;
+		}
+		pthread_mutex_unlock(&emulator->mutex);
+		if (ppoll(fds, 2, next == 0 ? NULL : &timeout, NULL) < 0 &&
+			errno != EINTR) {
+			pthread_mutex_lock(&emulator->mutex);
+			break;
+		}
+		pthread_mutex_lock(&emulator->mutex);
+
+		if (fds[1].revents & POLLIN) {
+			break;
+		}
+		if (fds[0].revents & POLLIN) {
+			read_line(emulator, emulator_now());
+		}
+	}
+	pthread_mutex_unlock(&emulator->mutex);
+	return NULL;
+}
+
+static int
+open_pty(struct Emulator *emulator) {
+	int rv = 0;
+	struct termios tio;
+	const char *path;
+
+	emulator->master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (emulator->master < 0) {
+		rv = -1;
+		goto out;
+	}
+	rv = grantpt(emulator->master);
+	if (rv < 0) {
+		goto out;
+	}
+	rv = unlockpt(emulator->master);
+	if (rv < 0) {
+		goto out;
+	}
+	path = ptsname(emulator->master);
+	if (path == NULL || strlen(path) >= sizeof(emulator->path)) {
+		rv = -1;
+		goto out;
+	}
+	strcpy(emulator->path, path);
+
+	// Held open so the line keeps its settings between hosts, and to read
+	// back the speed the host chose.
+	emulator->slave = open(emulator->path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (emulator->slave < 0) {
+		rv = -1;
+		goto out;
+	}
+	rv = tcgetattr(emulator->slave, &tio);
+	if (rv < 0) {
+		goto out;
+	}
+	cfmakeraw(&tio);
+	cfsetispeed(&tio, baud_speed(emulator->baud));
+	cfsetospeed(&tio, baud_speed(emulator->baud));
+	rv = tcsetattr(emulator->slave, TCSANOW, &tio);
+out:
+	return rv;
+}
+
+int
+emulator_start(
+		struct Emulator *emulator, const struct EmulatorOptions *options) {
+	int rv = 0;
+
+	memset(emulator, 0, sizeof(*emulator));
+	emulator->master = -1;
+	emulator->slave = -1;
+	emulator->wakeup = -1;
+	emulator->options = *options;
+	pthread_mutex_init(&emulator->mutex, NULL);
+	emulator->baud = options->baud != 0 ? options->baud : DEFAULT_BAUD;
+	if (baud_speed(emulator->baud) == B0) {
+		errno = EINVAL;
+		rv = -1;
+		goto out;
+	}
+	default_config(emulator->config);
+	emulator->config[CONFIG_BAUD + 0] = (emulator->baud >> 24) & 0xff;
+	emulator->config[CONFIG_BAUD + 1] = (emulator->baud >> 16) & 0xff;
+	emulator->config[CONFIG_BAUD + 2] = (emulator->baud >> 8) & 0xff;
+	emulator->config[CONFIG_BAUD + 3] = emulator->baud & 0xff;
+	emulator->random = options->seed != 0 ? options->seed : 1;
+	emulator->state.connected = true;
+	emulator->started_at = emulator_now();
+
+	emulator->wakeup = eventfd(0, EFD_CLOEXEC);
+	if (emulator->wakeup < 0) {
+		rv = -1;
+		goto out;
+	}
+	rv = open_pty(emulator);
+	if (rv < 0) {
+		goto out;
+	}
+
+	rv = -pthread_create(&emulator->thread, NULL, emulator_thread, emulator);
+	if (rv < 0) {
+		errno = -rv;
+		rv = -1;
+	}
+out:
+	if (rv < 0) {
+		int saved = errno;
+		if (emulator->slave >= 0) {
+			close(emulator->slave);
+		}
+		if (emulator->master >= 0) {
+			close(emulator->master);
+		}
+		if (emulator->wakeup >= 0) {
+			close(emulator->wakeup);
+		}
+		pthread_mutex_destroy(&emulator->mutex);
+		errno = saved;
+	}
+	return rv;
+}
+
+void
+emulator_state(struct Emulator *emulator, struct EmulatorState *state) {
+	pthread_mutex_lock(&emulator->mutex);
+	*state = emulator->state;
+	pthread_mutex_unlock(&emulator->mutex);
+}
+
+void
+emulator_stats(struct Emulator *emulator, struct EmulatorStats *stats) {
+	pthread_mutex_lock(&emulator->mutex);
+	*stats = emulator->stats;
+	pthread_mutex_unlock(&emulator->mutex);
+}
+
+int
+emulator_stop(struct Emulator *emulator) {
+	const uint64_t one = 1;
+	int rv = write(emulator->wakeup, &one, sizeof(one)) < 0 ? -1 : 0;
+	if (rv >= 0) {
+		pthread_join(emulator->thread, NULL);
+	}
+	close(emulator->slave);
+	close(emulator->master);
+	close(emulator->wakeup);
+	pthread_mutex_destroy(&emulator->mutex);
+	return rv;
+}
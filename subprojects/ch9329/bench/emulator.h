@@ -0,0 +1,113 @@
+#ifndef CH9329_EMULATOR_H
+#define CH9329_EMULATOR_H
+#include <ch9329.h>
+#include <pthread.h>
+#include <stdio.h>
+
+// Answers not sent yet. A real chip has a small receive buffer too, what
+// doesn't fit is lost.
+#define EMULATOR_QUEUE_SIZE 64
+#define EMULATOR_CONFIG_SIZE 50
+
+// What the target sees of the chip.
+struct EmulatorState {
+	bool connected;
+	uint8_t leds;
+	uint8_t keyboard[8];
+	uint8_t media[3];
+	uint8_t acpi;
+	uint8_t buttons;
+	uint16_t x;
+	uint16_t y;
+	// Sums of all relative motion and wheel steps since the last reset.
+	long rel_x;
+	long rel_y;
+	long wheel;
+	unsigned long reports;
+};
+
+struct EmulatorStats {
+	unsigned long frames;
+	unsigned long answers;
+	unsigned long dropped;
+	unsigned long errors;
+	unsigned long garbled;
+	unsigned long overruns;
+	// Bytes sent at a speed the chip wasn't set to.
+	unsigned long garbage;
+	unsigned long resets;
+};
+
+// Called from the emulator thread, with its lock held, whenever a command
+// took effect. now is on the emulator_now() clock.
+typedef void (*EmulatorCallback)(
+		const struct EmulatorState *state, enum Ch9329Command command,
+		uint64_t now, void *userdata);
+
+struct EmulatorOptions {
+	// Speed the chip starts at, 9600 like a new one if 0.
+	uint32_t baud;
+	// Microseconds the chip takes for a command after its last byte.
+	int delay;
+	// One in this many commands is lost, answered with a checksum error or
+	// answered with a broken checksum. 0 for never.
+	int drop;
+	int error;
+	int garble;
+	unsigned int seed;
+	// Every change of the HID state is written here, if set.
+	FILE *log;
+	EmulatorCallback callback;
+	void *userdata;
+};
+
+struct EmulatorAnswer {
+	struct Ch9329Frame request;
+	struct Ch9329Frame response;
+	// When the command takes effect and when its answer is on the wire.
+	uint64_t done_at;
+	uint64_t due_at;
+	bool applied;
+	bool drop;
+	bool garble;
+};
+
+struct Emulator {
+	struct EmulatorOptions options;
+	int master;
+	int slave;
+	char path[64];
+	int wakeup;
+	pthread_t thread;
+	uint64_t started_at;
+
+	pthread_mutex_t mutex;
+	struct EmulatorState state;
+	struct EmulatorStats stats;
+	uint32_t baud;
+	uint8_t config[EMULATOR_CONFIG_SIZE];
+	uint32_t random;
+
+	// Only the receive buffer is used, to split the byte stream into
+	// frames the same way the host does.
+	struct Ch9329 parser;
+	// When the receive line, the chip and the send line are free again.
+	uint64_t rx_free;
+	uint64_t busy_until;
+	uint64_t tx_free;
+	struct EmulatorAnswer answers[EMULATOR_QUEUE_SIZE];
+	int answer_head;
+	int answer_count;
+};
+
+uint64_t emulator_now(void);
+
+int emulator_start(
+		struct Emulator *emulator, const struct EmulatorOptions *options);
+
+void emulator_state(struct Emulator *emulator, struct EmulatorState *state);
+
+void emulator_stats(struct Emulator *emulator, struct EmulatorStats *stats);
+
+int emulator_stop(struct Emulator *emulator);
+#endif
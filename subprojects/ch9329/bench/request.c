@@ -0,0 +1,218 @@
+#include "emulator.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_COUNT 1000
+// Same as kvsm. A full window at 9600 baud takes more than 50 ms.
+#define DEFAULT_TIMEOUT 100
+#define NS_PER_MS 1000000.0
+
+struct Bench {
+	int count;
+	int submitted;
+	int completed;
+	int failed;
+	uint64_t *sent_at;
+	uint64_t *latency;
+};
+
+static void
+usage(const char *arg0) {
+	fprintf(stderr,
+			"Usage: %s [-b BAUD] [-d USEC] [-w WINDOW] [-n COUNT] [-t MS] "
+			"[-x N] [-e N] [-g N]\n"
+			"Sends COUNT absolute mouse reports to an emulated CH9329, one at a\n"
+			"time with ch9329_request() if WINDOW is 0, pipelined otherwise.\n",
+			arg0);
+}
+
+static uint16_t
+position(int i, int step) {
+	return (uint16_t)(i * step % 4096);
+}
+
+static int
+compare(const void *a, const void *b) {
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double
+percentile(const uint64_t *sorted, int count, int percent) {
+	return sorted[(count - 1) * percent / 100] / NS_PER_MS;
+}
+
+// Reports complete in the order they were submitted, none are superseded
+// as the window is never overfilled.
+static void
+report_done(
+		struct Ch9329 *ch9329, const struct Ch9329Frame *request,
+		enum Ch9329Error error, const struct Ch9329Frame *response,
+		void *userdata) {
+	struct Bench *bench = userdata;
+	(void)ch9329;
+	(void)request;
+	(void)response;
+
+	bench->latency[bench->completed] =
+			emulator_now() - bench->sent_at[bench->completed];
+	if (error != CH9329_SUCCESS) {
+		bench->failed++;
+	}
+	bench->completed++;
+}
+
+static int
+run_blocking(struct Ch9329 *ch9329, struct Bench *bench) {
+	for (int i = 0; i < bench->count; i++) {
+		bench->sent_at[i] = emulator_now();
+		if (ch9329_mouse_abs(ch9329, position(i, 7), position(i, 13)) < 0) {
+			bench->failed++;
+		}
+		bench->latency[i] = emulator_now() - bench->sent_at[i];
+		bench->completed++;
+	}
+	return 0;
+}
+
+static int
+run_pipelined(struct Ch9329 *ch9329, struct Bench *bench, int window) {
+	int rv = 0;
+
+	rv = ch9329_set_nonblocking(ch9329, true);
+	while (rv >= 0 && bench->completed < bench->count) {
+		struct pollfd fd = {.fd = ch9329->fd};
+
+		while (bench->submitted < bench->count &&
+			   ch9329->pending_count < window) {
+			const int i = bench->submitted++;
+			bench->sent_at[i] = emulator_now();
+			rv = ch9329_mouse_abs(ch9329, position(i, 7), position(i, 13));
+			if (rv < 0) {
+				goto out;
+			}
+		}
+
+		fd.events = ch9329_events(ch9329);
+		rv = poll(&fd, 1, ch9329_timeout(ch9329));
+		if (rv < 0 && errno != EINTR) {
+			goto out;
+		}
+		rv = ch9329_process(ch9329);
+	}
+out:
+	return rv;
+}
+
+int
+main(int argc, char *argv[]) {
+	int rv = EXIT_FAILURE;
+	struct EmulatorOptions options = {.baud = CH9329_BAUD_MAX};
+	struct Emulator emulator;
+	struct EmulatorState state;
+	struct EmulatorStats stats;
+	struct Ch9329 ch9329;
+	struct Bench bench = {.count = DEFAULT_COUNT};
+	int window = 0;
+	int timeout = DEFAULT_TIMEOUT;
+	uint64_t started_at;
+	double elapsed;
+	uint16_t x, y;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:d:w:n:t:x:e:g:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			options.baud = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			options.delay = atoi(optarg);
+			break;
+		case 'w':
+			window = atoi(optarg);
+			break;
+		case 'n':
+			bench.count = atoi(optarg);
+			break;
+		case 't':
+			timeout = atoi(optarg);
+			break;
+		case 'x':
+			options.drop = atoi(optarg);
+			break;
+		case 'e':
+			options.error = atoi(optarg);
+			break;
+		case 'g':
+			options.garble = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (bench.count <= 0 || window < 0 || window > CH9329_PIPELINE_SIZE) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	bench.sent_at = calloc(bench.count, sizeof(uint64_t));
+	bench.latency = calloc(bench.count, sizeof(uint64_t));
+	if (bench.sent_at == NULL || bench.latency == NULL) {
+		perror("calloc");
+		goto out;
+	}
+	if (emulator_start(&emulator, &options) < 0) {
+		perror("emulator_start");
+		goto out;
+	}
+	if (ch9329_open(&ch9329, emulator.path, timeout) < 0 ||
+		ch9329_set_speed(&ch9329, options.baud) < 0) {
+		perror(emulator.path);
+		goto stop;
+	}
+	if (window > 0 &&
+		ch9329_pipeline(&ch9329, window, report_done, &bench) < 0) {
+		perror("ch9329_pipeline");
+		goto close;
+	}
+
+	started_at = emulator_now();
+	if ((window > 0 ? run_pipelined(&ch9329, &bench, window)
+					: run_blocking(&ch9329, &bench)) < 0) {
+		perror("ch9329");
+		goto close;
+	}
+	elapsed = (double)(emulator_now() - started_at) / 1e9;
+
+	qsort(bench.latency, bench.count, sizeof(uint64_t), compare);
+	emulator_state(&emulator, &state);
+	emulator_stats(&emulator, &stats);
+	x = position(bench.count - 1, 7);
+	y = position(bench.count - 1, 13);
+	printf("%s, window %d, %u baud, %d reports: %.0f reports/s\n",
+		   window > 0 ? "pipelined" : "blocking", window, options.baud,
+		   bench.count, bench.count / elapsed);
+	printf("latency p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+		   percentile(bench.latency, bench.count, 50),
+		   percentile(bench.latency, bench.count, 99),
+		   percentile(bench.latency, bench.count, 100));
+	printf("%d failed, %lu dropped, %lu errors, %lu garbled, %lu bytes "
+		   "resynchronised\n",
+		   bench.failed, stats.dropped, stats.errors, stats.garbled,
+		   ch9329.rx_dropped);
+	printf("target at %u,%u, expected %u,%u\n", state.x, state.y, x, y);
+	// Whatever went wrong on the way, the target must end up where the
+	// last report put it.
+	rv = state.x == x && state.y == y ? EXIT_SUCCESS : EXIT_FAILURE;
+close:
+	ch9329_close(&ch9329);
+stop:
+	emulator_stop(&emulator);
+out:
+	free(bench.sent_at);
+	free(bench.latency);
+	return rv;
+}
@@ -1,6 +1,7 @@
 #ifndef CH9329_H
 #define CH9329_H
 #include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <termios.h>
@@ -8,15 +9,17 @@
 
 typedef int SerialPort;
 
-struct Ch9329 {
-	SerialPort fd;
-	struct termios oldtio;
-	int timeout;
-	uint8_t keyboard_state[8];
-	uint8_t acpi_key_state[4];
-	uint8_t media_key_state[4];
-	uint8_t mouse_button_state;
-};
+#define CH9329_PIPELINE_SIZE 8
+#define CH9329_RETRIES 2
+#define CH9329_BATCH_SIZE CH9329_PIPELINE_SIZE
+#define CH9329_QUEUE_SIZE 32
+#define CH9329_RX_SIZE 1024
+#define CH9329_TX_SIZE 4096
+// How long a typed key is held if nothing else is known. Full speed USB
+// keyboards are usually polled every 8 or 10 ms.
+#define CH9329_TYPE_INTERVAL 10
+// Longest of the keyboard, media and mouse reports.
+#define CH9329_REPORT_SIZE 8
 
 struct Ch9329Frame {
 	uint8_t header[5];
@@ -69,6 +72,72 @@ enum Ch9329Error {
 	CH9329_ERR_OPERATE = 0xE6 // Normal operation, but execution failed
 };
 
+// Reports carrying a whole state, each replacing the previous one.
+enum Ch9329Channel {
+	CH9329_CHANNEL_KEYBOARD,
+	CH9329_CHANNEL_MEDIA,
+	CH9329_CHANNEL_ACPI,
+	CH9329_CHANNEL_MOUSE_ABS,
+	CH9329_CHANNEL_MOUSE_REL,
+	CH9329_CHANNEL_COUNT
+};
+
+struct Ch9329;
+
+// Called once a pipelined command is done. response is NULL if the command
+// got no answer or was superseded by a later report.
+typedef void (*Ch9329Callback)(
+		struct Ch9329 *ch9329, const struct Ch9329Frame *request,
+		enum Ch9329Error error, const struct Ch9329Frame *response,
+		void *userdata);
+
+struct Ch9329Pending {
+	struct Ch9329Frame frame;
+	Ch9329Callback callback;
+	void *userdata;
+	int retries;
+	uint64_t sent_at;
+};
+
+struct Ch9329 {
+	SerialPort fd;
+	struct termios oldtio;
+	uint32_t baud;
+	int timeout;
+	uint8_t keyboard_state[8];
+	uint8_t acpi_key_state[4];
+	uint8_t media_key_state[4];
+	uint8_t mouse_button_state;
+
+	// The last report queued on each channel. Sending the same again
+	// changes nothing on the target, so it is skipped.
+	uint8_t reports[CH9329_CHANNEL_COUNT][CH9329_REPORT_SIZE];
+	unsigned int reports_valid;
+	unsigned long reports_saved;
+
+	// Commands not yet acknowledged, oldest first. Up to `window` of them
+	// are sent, the last `unsent` ones wait for room or ch9329_uncork().
+	int window;
+	Ch9329Callback callback;
+	void *userdata;
+	struct Ch9329Pending pending[CH9329_QUEUE_SIZE];
+	int pending_head;
+	int pending_count;
+	int unsent;
+	bool corked;
+
+	// Bytes received but not yet parsed into frames.
+	uint8_t rx[CH9329_RX_SIZE];
+	unsigned int rx_head;
+	unsigned int rx_tail;
+	unsigned long rx_dropped;
+
+	// Bytes a non-blocking write didn't take yet.
+	bool nonblocking;
+	uint8_t tx[CH9329_TX_SIZE];
+	size_t tx_len;
+};
+
 ////////////////////////////////////////
 // frame.c
 int ch9329_frame(
@@ -81,6 +150,8 @@ uint8_t ch9329_frame_len(const struct Ch9329Frame *frame);
 
 const uint8_t *ch9329_frame_data(const struct Ch9329Frame *frame);
 
+uint8_t ch9329_frame_checksum(const struct Ch9329Frame *frame);
+
 enum Ch9329Error ch9329_frame_error(const struct Ch9329Frame *frame);
 
 ////////////////////////////////////////
@@ -89,16 +160,62 @@ int ch9329_init(struct Ch9329 *ch9329, int fd, int timeout);
 
 int ch9329_open(struct Ch9329 *ch9329, const char *path, int timeout);
 
+int ch9329_set_speed(struct Ch9329 *ch9329, uint32_t baud);
+
+int ch9329_wait(struct Ch9329 *ch9329, int timeout);
+
 int ch9329_receive(struct Ch9329 *ch9329, struct Ch9329Frame *frame);
 
 int ch9329_send(struct Ch9329 *ch9329, const struct Ch9329Frame *frame);
 
+int ch9329_send_batch(
+		struct Ch9329 *ch9329, const struct Ch9329Frame *const frames[],
+		int count);
+
+int ch9329_transmit(struct Ch9329 *ch9329, bool wait);
+
+int ch9329_set_nonblocking(struct Ch9329 *ch9329, bool nonblocking);
+
 int ch9329_request(struct Ch9329 *ch9329, struct Ch9329Frame *frame);
 
 int ch9329_reset(struct Ch9329 *ch9329);
 
 int ch9329_close(struct Ch9329 *ch9329);
 
+////////////////////////////////////////
+// parser.c
+int ch9329_feed(struct Ch9329 *ch9329, const void *data, int len);
+
+int ch9329_fill(struct Ch9329 *ch9329);
+
+int ch9329_parse(struct Ch9329 *ch9329, struct Ch9329Frame *frame);
+
+int ch9329_skip(struct Ch9329 *ch9329);
+
+////////////////////////////////////////
+// pipeline.c
+int ch9329_pipeline(
+		struct Ch9329 *ch9329, int window, Ch9329Callback callback,
+		void *userdata);
+
+int ch9329_submit(
+		struct Ch9329 *ch9329, const struct Ch9329Frame *frame,
+		Ch9329Callback callback, void *userdata);
+
+int ch9329_report(struct Ch9329 *ch9329, struct Ch9329Frame *frame);
+
+int ch9329_cork(struct Ch9329 *ch9329);
+
+int ch9329_uncork(struct Ch9329 *ch9329);
+
+int ch9329_flush(struct Ch9329 *ch9329);
+
+short ch9329_events(const struct Ch9329 *ch9329);
+
+int ch9329_timeout(const struct Ch9329 *ch9329);
+
+int ch9329_process(struct Ch9329 *ch9329);
+
 ////////////////////////////////////////
 // info.c
 int ch9329_get_info(struct Ch9329 *ch9329, struct Ch9329Frame *frame);
@@ -113,6 +230,24 @@ bool ch9329_info_caps_lock(const struct Ch9329Frame *frame);
 
 bool ch9329_info_scroll_lock(const struct Ch9329Frame *frame);
 
+////////////////////////////////////////
+// config.c
+#define CH9329_BAUD_MAX 115200
+
+int ch9329_get_config(struct Ch9329 *ch9329, struct Ch9329Frame *frame);
+
+int ch9329_set_config(struct Ch9329 *ch9329, const struct Ch9329Frame *config);
+
+uint32_t ch9329_config_baud(const struct Ch9329Frame *config);
+
+void ch9329_config_set_baud(struct Ch9329Frame *config, uint32_t baud);
+
+int ch9329_detect_baud(struct Ch9329 *ch9329, uint32_t max);
+
+int ch9329_set_baud(struct Ch9329 *ch9329, uint32_t baud);
+
+int ch9329_negotiate_baud(struct Ch9329 *ch9329, uint32_t max);
+
 ////////////////////////////////////////
 // keyboard.c
 
@@ -173,4 +308,56 @@ int ch9329_mouse_wheel(struct Ch9329 *ch9329, int8_t wheel);
 
 int ch9329_mouse_button(struct Ch9329 *ch9329, uint8_t button, bool pressed);
 
+////////////////////////////////////////
+// type.c
+enum Ch9329Layout {
+	CH9329_LAYOUT_US,
+	CH9329_LAYOUT_DE,
+	CH9329_LAYOUT_FR,
+};
+
+struct Ch9329Keystroke {
+	uint8_t modifiers;
+	uint8_t scan_code;
+};
+
+// Types text as keystrokes, one report at a time. Each report is held for
+// interval ms, so the host's keyboard polling sees it.
+struct Ch9329Typist {
+	enum Ch9329Layout layout;
+	const char *text;
+	size_t pos;
+	int interval;
+	bool caps_lock;
+
+	// Keys of the character being typed, a dead key may come first.
+	struct Ch9329Keystroke strokes[2];
+	int stroke;
+	int stroke_count;
+	uint8_t held;
+	uint64_t next_at;
+
+	unsigned long typed;
+	unsigned long unmapped;
+	unsigned long reports;
+};
+
+int ch9329_layout_from_name(const char *name);
+
+int ch9329_layout_keystrokes(
+		enum Ch9329Layout layout, uint32_t codepoint, bool caps_lock,
+		struct Ch9329Keystroke strokes[2]);
+
+void ch9329_typist_init(
+		struct Ch9329Typist *typist, enum Ch9329Layout layout,
+		const char *text, int interval, bool caps_lock);
+
+int ch9329_typist_step(struct Ch9329 *ch9329, struct Ch9329Typist *typist);
+
+int ch9329_type(
+		struct Ch9329 *ch9329, enum Ch9329Layout layout, const char *text,
+		int interval);
+
+int ch9329_type_calibrate(struct Ch9329 *ch9329);
+
 #endif
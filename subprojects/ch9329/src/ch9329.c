@@ -1,39 +1,53 @@
+#include <assert.h>
 #include <ch9329.h>
+#include <errno.h>
+#include <stddef.h>
 #include <string.h>
 #include <sys/select.h>
+#include <sys/uio.h>
+
+// Header and data are sent straight from the frame in one piece.
+static_assert(
+		offsetof(struct Ch9329Frame, data) ==
+				sizeof(((struct Ch9329Frame *)0)->header),
+		"frame header and data must be contiguous");
 
 static int
-serial_write(SerialPort port, const uint8_t *buf, int len) {
-	return write(port, buf, len);
+serial_wait_writable(SerialPort port) {
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(port, &fds);
+	return select(port + 1, NULL, &fds, NULL, NULL);
 }
 
+// Keeps what a write didn't take, skipping the first `skip` bytes.
 static int
-serial_read(SerialPort port, uint8_t *buf, int len) {
-	return read(port, buf, len);
+tx_append(
+		struct Ch9329 *ch9329, const struct iovec *iov, int iovcnt,
+		size_t skip) {
+	for (int i = 0; i < iovcnt; i++) {
+		size_t len = iov[i].iov_len;
+		const uint8_t *base = iov[i].iov_base;
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
+		base += skip;
+		len -= skip;
+		skip = 0;
+		if (len > sizeof(ch9329->tx) - ch9329->tx_len) {
+			errno = ENOBUFS;
+			return -1;
+		}
+		memcpy(&ch9329->tx[ch9329->tx_len], base, len);
+		ch9329->tx_len += len;
+	}
+	return 0;
 }
 
 static int
 serial_wait(struct Ch9329 *ch9329, int timeout) {
-	fd_set fds;
-	FD_ZERO(&fds);
-	FD_SET(ch9329->fd, &fds);
-	struct timeval tv = {0};
-	tv.tv_usec = timeout * 1000;
-	tv.tv_sec = timeout / 1000;
-	return select(ch9329->fd + 1, &fds, NULL, NULL, &tv) > 0;
-}
-
-static uint8_t
-gen_checksum(const struct Ch9329Frame *frame) {
-	uint8_t checksum = 0;
-	const uint8_t len = ch9329_frame_len(frame);
-	for (int i = 0; i < 5; i++) {
-		checksum += frame->header[i];
-	}
-	for (int i = 0; i < len; i++) {
-		checksum += frame->data[i];
-	}
-	return checksum;
+	return ch9329_wait(ch9329, timeout) > 0;
 }
 
 int
@@ -56,25 +70,48 @@ ch9329_init(struct Ch9329 *ch9329, int fd, int timeout) {
 			CS8 | CREAD | CLOCAL; // Enable receiver, ignore modem control lines
 
 	// Set raw mode (disable canonical mode, echo, signal chars)
-	tio.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
+	tio.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG | IEXTEN);
 
 	// Disable software flow control
 	tio.c_iflag &= ~(IXON | IXOFF | IXANY);
 
+	// Pass every received byte through unchanged, 0x0D included
+	tio.c_iflag &= ~(ICRNL | INLCR | IGNCR | ISTRIP | BRKINT | PARMRK);
+
 	// Disable special handling of bytes in output
 	tio.c_oflag &= ~OPOST;
 
-	rv = tcsetattr(fd, TCSANOW, &tio);
+	// The speed is part of the attributes, so it has to be set before
+	// they are applied.
+	rv = cfsetispeed(&tio, B115200);
 	if (rv < 0) {
 		goto out;
 	}
-
 	rv = cfsetospeed(&tio, B115200);
 	if (rv < 0) {
 		goto out;
 	}
 
+	rv = tcsetattr(fd, TCSANOW, &tio);
+	if (rv < 0) {
+		goto out;
+	}
+
+	ch9329->baud = 115200;
 	ch9329->timeout = timeout;
+	ch9329->window = 0;
+	ch9329->callback = NULL;
+	ch9329->pending_head = 0;
+	ch9329->pending_count = 0;
+	ch9329->unsent = 0;
+	ch9329->corked = false;
+	ch9329->rx_head = 0;
+	ch9329->rx_tail = 0;
+	ch9329->rx_dropped = 0;
+	ch9329->reports_valid = 0;
+	ch9329->reports_saved = 0;
+	ch9329->tx_len = 0;
+	ch9329->nonblocking = false;
 out:
 	return rv;
 }
@@ -82,7 +119,9 @@ out:
 int
 ch9329_open(struct Ch9329 *ch9329, const char *path, int timeout) {
 	int rv = 0;
-	int fd = open(path, O_RDWR | O_NOCTTY | O_SYNC);
+	// No O_SYNC: each frame is a single write that the driver should be
+	// free to put into one USB transfer.
+	int fd = open(path, O_RDWR | O_NOCTTY);
 	if (fd < 0) {
 		rv = fd;
 		goto out;
@@ -93,117 +132,240 @@ out:
 	return rv;
 }
 
+static speed_t
+baud_speed(uint32_t baud) {
+	switch (baud) {
+	case 9600:
+		return B9600;
+	case 19200:
+		return B19200;
+	case 38400:
+		return B38400;
+	case 57600:
+		return B57600;
+	case 115200:
+		return B115200;
+	case 230400:
+		return B230400;
+	case 460800:
+		return B460800;
+	case 921600:
+		return B921600;
+	default:
+		return B0;
+	}
+}
+
 int
-ch9329_receive(struct Ch9329 *ch9329, struct Ch9329Frame *frame) {
+ch9329_set_speed(struct Ch9329 *ch9329, uint32_t baud) {
 	int rv = 0;
-	uint8_t checksum = 0;
-	memset(frame, 0, sizeof(struct Ch9329Frame));
+	struct termios tio;
+	const speed_t speed = baud_speed(baud);
 
-	// header
-	if (ch9329->timeout > 0) {
-		rv = serial_wait(ch9329, ch9329->timeout);
-		if (rv < 0) {
-			goto out;
-		}
-	}
-	rv = serial_read(ch9329->fd, frame->header, sizeof(frame->header));
-	if (rv < (int)sizeof(frame->header)) {
+	if (speed == B0) {
+		errno = EINVAL;
 		rv = -1;
 		goto out;
 	}
 
-	// data
-	uint8_t len = ch9329_frame_len(frame);
-	if (len > 0) {
-		if (ch9329->timeout > 0) {
-			rv = serial_wait(ch9329, ch9329->timeout);
-			if (rv < 0) {
-				goto out;
-			}
-		}
-		rv = serial_read(ch9329->fd, frame->data, len);
-		if (rv < len) {
-			rv = -1;
-			goto out;
-		}
-	}
-
-	// checksum
-	if (ch9329->timeout > 0) {
-		rv = serial_wait(ch9329, ch9329->timeout);
-		if (rv < 0) {
-			goto out;
-		}
+	rv = tcgetattr(ch9329->fd, &tio);
+	if (rv < 0) {
+		goto out;
 	}
-	rv = serial_read(ch9329->fd, &checksum, 1);
-	if (rv < 1) {
-		rv = -1;
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+	// Let what is still queued go out at the old speed.
+	rv = tcsetattr(ch9329->fd, TCSADRAIN, &tio);
+	if (rv < 0) {
 		goto out;
 	}
-	if (checksum != gen_checksum(frame)) {
+
+	// Some USB serial bridges silently keep their old speed.
+	rv = tcgetattr(ch9329->fd, &tio);
+	if (rv < 0) {
+		goto out;
+	} else if (cfgetospeed(&tio) != speed) {
+		errno = EINVAL;
 		rv = -1;
 		goto out;
 	}
 
+	// Whatever arrived so far was sent at the old speed.
+	tcflush(ch9329->fd, TCIFLUSH);
+	ch9329->rx_head = ch9329->rx_tail;
+	ch9329->baud = baud;
 out:
 	return rv;
 }
 
 int
-ch9329_send(struct Ch9329 *ch9329, const struct Ch9329Frame *frame) {
+ch9329_wait(struct Ch9329 *ch9329, int timeout) {
+	fd_set fds;
+	struct timeval tv = {0};
+	FD_ZERO(&fds);
+	FD_SET(ch9329->fd, &fds);
+	tv.tv_usec = (timeout % 1000) * 1000;
+	tv.tv_sec = timeout / 1000;
+	// A negative timeout waits forever.
+	return select(ch9329->fd + 1, &fds, NULL, NULL, timeout < 0 ? NULL : &tv);
+}
+
+int
+ch9329_receive(struct Ch9329 *ch9329, struct Ch9329Frame *frame) {
 	int rv = 0;
-	uint8_t checksum = gen_checksum(frame);
+	memset(frame, 0, sizeof(struct Ch9329Frame));
 
-	// header
-	rv = serial_write(ch9329->fd, frame->header, sizeof(frame->header));
-	if (rv < (int)sizeof(frame->header)) {
-		rv = -1;
-		goto out;
+	// Take whatever the port has in one read until a whole frame is there.
+	while ((rv = ch9329_parse(ch9329, frame)) == 0) {
+		if (ch9329->timeout > 0 && !serial_wait(ch9329, ch9329->timeout)) {
+			// A garbled length byte may have us wait for data that never
+			// comes. Skip past it so the next frame can be found.
+			ch9329_skip(ch9329);
+			rv = -1;
+			goto out;
+		}
+		rv = ch9329_fill(ch9329);
+		if (rv <= 0) {
+			rv = -1;
+			goto out;
+		}
 	}
+out:
+	return rv < 0 ? rv : 0;
+}
 
-	// data
-	uint8_t len = ch9329_frame_len(frame);
-	rv = serial_write(ch9329->fd, frame->data, len);
-	if (rv < len) {
-		rv = -1;
-		goto out;
+int
+ch9329_send(struct Ch9329 *ch9329, const struct Ch9329Frame *frame) {
+	return ch9329_send_batch(ch9329, &frame, 1);
+}
+
+int
+ch9329_send_batch(
+		struct Ch9329 *ch9329, const struct Ch9329Frame *const frames[],
+		int count) {
+	int rv = 0;
+	struct iovec iov[CH9329_BATCH_SIZE * 2];
+	uint8_t checksums[CH9329_BATCH_SIZE];
+
+	for (int start = 0; start < count && rv >= 0;
+		 start += CH9329_BATCH_SIZE) {
+		int iovcnt = 0;
+		ssize_t written = 0;
+		for (int i = 0; i < CH9329_BATCH_SIZE && start + i < count; i++) {
+			const struct Ch9329Frame *frame = frames[start + i];
+			checksums[i] = ch9329_frame_checksum(frame);
+			iov[iovcnt].iov_base = (void *)frame->header;
+			iov[iovcnt++].iov_len =
+					sizeof(frame->header) + ch9329_frame_len(frame);
+			iov[iovcnt].iov_base = &checksums[i];
+			iov[iovcnt++].iov_len = 1;
+		}
+
+		// Bytes still waiting from an earlier send go first.
+		if (ch9329->tx_len == 0) {
+			written = writev(ch9329->fd, iov, iovcnt);
+			if (written < 0 && errno != EAGAIN) {
+				rv = -1;
+				break;
+			}
+		}
+		// A tty may take less than everything, keep the rest.
+		rv = tx_append(ch9329, iov, iovcnt, written < 0 ? 0 : written);
+		if (rv >= 0) {
+			rv = ch9329_transmit(ch9329, !ch9329->nonblocking);
+		}
 	}
+	return rv < 0 ? rv : 0;
+}
 
-	// checksum
-	rv = serial_write(ch9329->fd, &checksum, 1);
-	if (rv < 1) {
-		rv = -1;
-		goto out;
+int
+ch9329_transmit(struct Ch9329 *ch9329, bool wait) {
+	while (ch9329->tx_len > 0) {
+		ssize_t written = write(ch9329->fd, ch9329->tx, ch9329->tx_len);
+		if (written < 0 && errno == EAGAIN && wait) {
+			if (serial_wait_writable(ch9329->fd) < 0) {
+				return -1;
+			}
+			continue;
+		} else if (written < 0 && errno == EAGAIN) {
+			break;
+		} else if (written < 0) {
+			return -1;
+		}
+		ch9329->tx_len -= written;
+		memmove(ch9329->tx, &ch9329->tx[written], ch9329->tx_len);
 	}
-out:
-	return rv;
+	return ch9329->tx_len;
 }
 
 int
-ch9329_request(struct Ch9329 *ch9329, struct Ch9329Frame *frame) {
-	int rv = 0;
-	enum Ch9329Command command = ch9329_frame_command(frame);
+ch9329_set_nonblocking(struct Ch9329 *ch9329, bool nonblocking) {
+	int flags = fcntl(ch9329->fd, F_GETFL);
+	if (flags < 0) {
+		return -1;
+	}
+	flags = nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+	if (fcntl(ch9329->fd, F_SETFL, flags) < 0) {
+		return -1;
+	}
+	ch9329->nonblocking = nonblocking;
+	return 0;
+}
 
-	rv = ch9329_send(ch9329, frame);
-	if (rv < 0) {
-		goto out;
+struct RequestResult {
+	struct Ch9329Frame *frame;
+	int rv;
+};
+
+static void
+request_done(
+		struct Ch9329 *ch9329, const struct Ch9329Frame *request,
+		enum Ch9329Error error, const struct Ch9329Frame *response,
+		void *userdata) {
+	struct RequestResult *result = userdata;
+	(void)ch9329;
+	(void)request;
+
+	if (response) {
+		memcpy(result->frame, response, sizeof(struct Ch9329Frame));
 	}
+	result->rv = -(int)error;
+}
 
-	rv = ch9329_receive(ch9329, frame);
-	if (rv < 0) {
-		goto out;
+// Keeps commands still pending from completing into a result that is
+// going out of scope.
+static void
+abandon(struct Ch9329 *ch9329, void *userdata) {
+	for (int i = 0; i < ch9329->pending_count; i++) {
+		struct Ch9329Pending *pending =
+				&ch9329->pending[(ch9329->pending_head + i) %
+								 CH9329_QUEUE_SIZE];
+		if (pending->userdata == userdata) {
+			pending->callback = NULL;
+		}
 	}
+}
 
-	rv = -ch9329_frame_error(frame);
+int
+ch9329_request(struct Ch9329 *ch9329, struct Ch9329Frame *frame) {
+	int rv = 0;
+	struct RequestResult result = {.frame = frame, .rv = -1};
+
+	// Goes through the pipeline to get the same retries, but waits for the
+	// answer. Commands still in flight are acknowledged first.
+	rv = ch9329_submit(ch9329, frame, request_done, &result);
 	if (rv < 0) {
 		goto out;
 	}
 
-	if (ch9329_frame_command(frame) != (0x80 | command)) {
-		rv = -1;
+	rv = ch9329_flush(ch9329);
+	if (rv < 0) {
+		// Failed on the port, the request may still be pending.
+		abandon(ch9329, &result);
 		goto out;
 	}
 
+	rv = result.rv;
 out:
 	return rv;
 }
@@ -211,6 +373,8 @@ out:
 int
 ch9329_reset(struct Ch9329 *ch9329) {
 	struct Ch9329Frame frame = {0};
+	// The chip comes back with nothing pressed, whatever was sent before.
+	ch9329->reports_valid = 0;
 	ch9329_frame(&frame, CH9329_CMD_RESET, NULL, 0);
 	return ch9329_request(ch9329, &frame);
 }
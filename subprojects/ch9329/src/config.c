@@ -0,0 +1,167 @@
+#include "ch9329.h"
+#include <assert.h>
+
+// Offset of the big endian baud rate in the parameter block.
+#define CONFIG_BAUD 3
+// How long the chip may take to come back after a reset.
+#define PROBE_ATTEMPTS 10
+#define PROBE_DELAY 20000
+
+// Fastest first. The datasheet only guarantees up to CH9329_BAUD_MAX, the
+// faster ones are for callers that know their chip and bridge.
+static const uint32_t bauds[] = {
+		921600, 460800, 230400, 115200, 57600, 38400, 19200, 9600,
+};
+
+int
+ch9329_get_config(struct Ch9329 *ch9329, struct Ch9329Frame *frame) {
+	ch9329_frame(frame, CH9329_CMD_GET_PARA_CFG, NULL, 0);
+	return ch9329_request(ch9329, frame);
+}
+
+int
+ch9329_set_config(struct Ch9329 *ch9329, const struct Ch9329Frame *config) {
+	struct Ch9329Frame frame = {0};
+	assert(ch9329_frame_command(config) == CH9329_RES_GET_PARA_CFG);
+	ch9329_frame(
+			&frame, CH9329_CMD_SET_PARA_CFG, ch9329_frame_data(config),
+			ch9329_frame_len(config));
+	return ch9329_request(ch9329, &frame);
+}
+
+uint32_t
+ch9329_config_baud(const struct Ch9329Frame *config) {
+	const uint8_t *data = ch9329_frame_data(config) + CONFIG_BAUD;
+	assert(ch9329_frame_command(config) == CH9329_RES_GET_PARA_CFG);
+	return (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 |
+			(uint32_t)data[2] << 8 | data[3];
+}
+
+void
+ch9329_config_set_baud(struct Ch9329Frame *config, uint32_t baud) {
+	assert(ch9329_frame_command(config) == CH9329_RES_GET_PARA_CFG);
+	config->data[CONFIG_BAUD + 0] = (baud >> 24) & 0xff;
+	config->data[CONFIG_BAUD + 1] = (baud >> 16) & 0xff;
+	config->data[CONFIG_BAUD + 2] = (baud >> 8) & 0xff;
+	config->data[CONFIG_BAUD + 3] = baud & 0xff;
+}
+
+// Checks whether the chip answers at the given speed, giving it time to
+// finish a reset.
+static int
+probe(struct Ch9329 *ch9329, uint32_t baud, int attempts) {
+	int rv = 0;
+	struct Ch9329Frame frame = {0};
+
+	rv = ch9329_set_speed(ch9329, baud);
+	for (int i = 0; rv >= 0 && i < attempts; i++) {
+		rv = ch9329_get_info(ch9329, &frame);
+		if (rv >= 0) {
+			goto out;
+		} else if (i + 1 < attempts) {
+			usleep(PROBE_DELAY);
+			rv = 0;
+		}
+	}
+out:
+	return rv;
+}
+
+int
+ch9329_detect_baud(struct Ch9329 *ch9329, uint32_t max) {
+	const uint32_t current = ch9329->baud;
+
+	if (probe(ch9329, current, 1) >= 0) {
+		return 0;
+	}
+	for (size_t i = 0; i < sizeof(bauds) / sizeof(bauds[0]); i++) {
+		if (bauds[i] <= max && bauds[i] != current &&
+			probe(ch9329, bauds[i], 1) >= 0) {
+			return 0;
+		}
+	}
+
+	ch9329_set_speed(ch9329, current);
+	return -1;
+}
+
+// Writes the baud rate into the chip's configuration and restarts it, so it
+// takes effect.
+static int
+apply_baud(
+		struct Ch9329 *ch9329, struct Ch9329Frame *config, uint32_t baud) {
+	int rv = 0;
+
+	ch9329_config_set_baud(config, baud);
+	rv = ch9329_set_config(ch9329, config);
+	if (rv < 0) {
+		goto out;
+	}
+
+	rv = ch9329_reset(ch9329);
+	if (rv < 0) {
+		goto out;
+	}
+
+	rv = probe(ch9329, baud, PROBE_ATTEMPTS);
+out:
+	return rv;
+}
+
+int
+ch9329_set_baud(struct Ch9329 *ch9329, uint32_t baud) {
+	int rv = 0;
+	struct Ch9329Frame config = {0};
+	const uint32_t old_baud = ch9329->baud;
+
+	// Make sure the bridge on this end can do it before touching the chip.
+	rv = ch9329_set_speed(ch9329, baud);
+	if (rv < 0) {
+		goto out;
+	}
+	rv = ch9329_set_speed(ch9329, old_baud);
+	if (rv < 0) {
+		goto out;
+	}
+
+	rv = ch9329_get_config(ch9329, &config);
+	if (rv < 0) {
+		goto out;
+	}
+
+	rv = apply_baud(ch9329, &config, baud);
+	if (rv >= 0) {
+		goto out;
+	}
+
+	// The link doesn't work at the new speed. Find out where the chip
+	// ended up and put it back to the old speed.
+	if (probe(ch9329, old_baud, PROBE_ATTEMPTS) >= 0) {
+		// It never switched, maybe it doesn't support that speed.
+		if (ch9329_get_config(ch9329, &config) >= 0 &&
+			ch9329_config_baud(&config) != old_baud) {
+			apply_baud(ch9329, &config, old_baud);
+		}
+	} else if (probe(ch9329, baud, PROBE_ATTEMPTS) >= 0) {
+		apply_baud(ch9329, &config, old_baud);
+	} else {
+		ch9329_set_speed(ch9329, old_baud);
+	}
+	rv = -1;
+out:
+	return rv;
+}
+
+int
+ch9329_negotiate_baud(struct Ch9329 *ch9329, uint32_t max) {
+	for (size_t i = 0; i < sizeof(bauds) / sizeof(bauds[0]); i++) {
+		if (bauds[i] > max) {
+			continue;
+		} else if (bauds[i] <= ch9329->baud) {
+			break;
+		} else if (ch9329_set_baud(ch9329, bauds[i]) >= 0) {
+			break;
+		}
+	}
+	return ch9329->baud;
+}
@@ -33,14 +33,32 @@ ch9329_frame_data(const struct Ch9329Frame *frame) {
 	return frame->data;
 }
 
+uint8_t
+ch9329_frame_checksum(const struct Ch9329Frame *frame) {
+	uint8_t checksum = 0;
+	const uint8_t len = ch9329_frame_len(frame);
+	for (size_t i = 0; i < sizeof(frame->header); i++) {
+		checksum += frame->header[i];
+	}
+	for (int i = 0; i < len; i++) {
+		checksum += frame->data[i];
+	}
+	return checksum;
+}
+
 enum Ch9329Error
 ch9329_frame_error(const struct Ch9329Frame *frame) {
-	if ((ch9329_frame_command(frame) & 0xc0) != 0) {
-		return CH9329_SUCCESS;
+	const uint8_t command = ch9329_frame_command(frame);
+	if ((command & 0x80) == 0) {
+		// Not a response at all.
+		return CH9329_ERR_CMD;
 	} else if (ch9329_frame_len(frame) == 1) {
+		// Both error responses (0xC0 | command) and plain acknowledgements
+		// carry a single status byte.
 		return (enum Ch9329Error)frame->data[0];
-	} else {
-		// TODO
+	} else if ((command & 0xc0) == 0xc0) {
 		return CH9329_ERR_OPERATE;
+	} else {
+		return CH9329_SUCCESS;
 	}
 }
@@ -22,17 +22,17 @@ ch9329_info_connected(const struct Ch9329Frame *frame) {
 bool
 ch9329_info_num_lock(const struct Ch9329Frame *frame) {
 	assert(ch9329_frame_command(frame) == CH9329_RES_GET_INFO);
-	return ch9329_frame_data(frame)[1] & CH9329_INDICATOR_NUM_LOCK;
+	return ch9329_frame_data(frame)[2] & CH9329_INDICATOR_NUM_LOCK;
 }
 
 bool
 ch9329_info_caps_lock(const struct Ch9329Frame *frame) {
 	assert(ch9329_frame_command(frame) == CH9329_RES_GET_INFO);
-	return ch9329_frame_data(frame)[1] & CH9329_INDICATOR_CAPS_LOCK;
+	return ch9329_frame_data(frame)[2] & CH9329_INDICATOR_CAPS_LOCK;
 }
 
 bool
 ch9329_info_scroll_lock(const struct Ch9329Frame *frame) {
 	assert(ch9329_frame_command(frame) == CH9329_RES_GET_INFO);
-	return ch9329_frame_data(frame)[1] & CH9329_INDICATOR_SCROLL_LOCK;
+	return ch9329_frame_data(frame)[2] & CH9329_INDICATOR_SCROLL_LOCK;
 }
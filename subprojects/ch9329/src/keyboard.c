@@ -17,6 +17,7 @@ ch9329_keyboard(struct Ch9329 *ch9329, uint8_t scan_code, bool pressed) {
 			if (ch9329->keyboard_state[i] == 0 ||
 				ch9329->keyboard_state[i] == scan_code) {
 				ch9329->keyboard_state[i] = scan_code;
+				break;
 			}
 		}
 	} else {
@@ -29,7 +30,7 @@ ch9329_keyboard(struct Ch9329 *ch9329, uint8_t scan_code, bool pressed) {
 
 	ch9329_frame(
 			&frame, CH9329_CMD_SEND_KB_GENERAL_DATA, ch9329->keyboard_state, 8);
-	return ch9329_request(ch9329, &frame);
+	return ch9329_report(ch9329, &frame);
 }
 
 int
@@ -61,5 +62,5 @@ ch9329_keyboard_extra(
 	}
 
 	ch9329_frame(&frame, CH9329_CMD_SEND_KB_MEDIA_DATA, data, 4);
-	return ch9329_request(ch9329, &frame);
+	return ch9329_report(ch9329, &frame);
 }
@@ -5,6 +5,13 @@
 
 #include "ch9329.h"
 
+// A full window takes longer to be acknowledged than a single command.
+#define BATCH_WINDOW 4
+#define BATCH_TIMEOUT 100
+#define BATCH_WORDS 16
+#define WAIT_LED_TIMEOUT 1000
+#define WAIT_LED_POLL 10
+
 static int
 get_info(struct Ch9329 *ch9329, int argc, char *argv[]) {
 	if (argc != 3) {
@@ -115,53 +122,42 @@ out:
 
 static int
 send_string(struct Ch9329 *ch9329, int argc, char *argv[]) {
-	if (argc != 4) {
-		puts("Usage: ch9329 <DEVICE> string STRING");
+	if (argc < 4 || argc > 6) {
+		puts("Usage: ch9329 <DEVICE> string STRING [LAYOUT [INTERVAL]]");
+		puts("Layouts: us, de, fr");
+		return -1;
+	}
+	int rv = 0;
+	int layout = argc > 4 ? ch9329_layout_from_name(argv[4]) : 0;
+	int interval = argc > 5 ? atoi(argv[5]) : CH9329_TYPE_INTERVAL;
+	if (layout < 0) {
+		puts("Unknown layout");
 		return -1;
 	}
-	char *str = argv[3];
-	for (int i = 0; str[i] != '\0'; i++) {
-		bool upper = false;
-		int scan_code = 0;
-
-		if (str[i] >= 'a' && str[i] <= 'z') {
-			scan_code = str[i] - 'a' + 4;
-		} else if (str[i] >= 'A' && str[i] <= 'Z') {
-			scan_code = str[i] - 'A' + 4;
-			upper = true;
-		} else if (str[i] >= '0' && str[i] <= '9') {
-			scan_code = str[i] - '0' + 30;
-		} else if (str[i] == ' ') {
-			scan_code = 44;
-		} else {
-			continue;
-		}
-
-		if (upper) {
-			int rv = ch9329_keyboard(ch9329, 225, true);
-			if (rv < 0) {
-				return rv;
-			}
-		}
-
-		int rv = ch9329_keyboard(ch9329, scan_code, true);
-		if (rv < 0) {
-			return rv;
-		}
 
-		rv = ch9329_keyboard(ch9329, scan_code, false);
-		if (rv < 0) {
-			return rv;
-		}
+	rv = ch9329_type(ch9329, layout, argv[3], interval);
+	if (rv > 0) {
+		printf("%d characters have no key in this layout\n", rv);
+	}
+	return rv;
+}
 
-		if (upper) {
-			rv = ch9329_keyboard(ch9329, 225, false);
-			if (rv < 0) {
-				return rv;
-			}
-		}
+static int
+calibrate(struct Ch9329 *ch9329, int argc, char *argv[]) {
+	(void)argv;
+	if (argc != 3) {
+		puts("Usage: ch9329 <DEVICE> calibrate");
+		return -1;
 	}
-	return 0;
+	int rv = ch9329_type_calibrate(ch9329);
+	if (rv < 0) {
+		puts("The target didn't toggle Caps Lock");
+		goto out;
+	}
+	printf("Type Interval:    %d ms\n", rv);
+
+out:
+	return rv;
 }
 
 static int
@@ -218,6 +214,30 @@ send_wheel(struct Ch9329 *ch9329, int argc, char *argv[]) {
 	return ch9329_mouse_wheel(ch9329, wheel);
 }
 
+static int
+set_baud(struct Ch9329 *ch9329, int argc, char *argv[]) {
+	if (argc != 3 && argc != 4) {
+		puts("Usage: ch9329 <DEVICE> baud [RATE]");
+		return -1;
+	}
+	int rv = ch9329_detect_baud(ch9329, UINT32_MAX);
+	if (rv < 0) {
+		puts("No CH9329 found");
+		goto out;
+	}
+
+	if (argc == 4) {
+		rv = ch9329_set_baud(ch9329, strtoul(argv[3], NULL, 10));
+		if (rv < 0) {
+			puts("Couldn't switch baud rate");
+		}
+	}
+	printf("Baud Rate:        %u\n", ch9329->baud);
+
+out:
+	return rv;
+}
+
 static int
 send_reset(struct Ch9329 *ch9329, int argc, char *argv[]) {
 	(void)argv;
@@ -229,6 +249,250 @@ send_reset(struct Ch9329 *ch9329, int argc, char *argv[]) {
 	return ch9329_reset(ch9329);
 }
 
+static int
+wait_led(struct Ch9329 *ch9329, int argc, char *argv[]) {
+	static const struct {
+		char *name;
+		bool (*get)(const struct Ch9329Frame *frame);
+	} leds[] = {
+			{"num", ch9329_info_num_lock},
+			{"caps", ch9329_info_caps_lock},
+			{"scroll", ch9329_info_scroll_lock},
+	};
+	if (argc != 5 && argc != 6) {
+		puts("Usage: ch9329 <DEVICE> wait_led num|caps|scroll on|off "
+			 "[TIMEOUT_MS]");
+		return -1;
+	}
+	int rv = 0;
+	struct Ch9329Frame info = {0};
+	bool (*get)(const struct Ch9329Frame *frame) = NULL;
+	bool on = strcmp(argv[4], "on") == 0;
+	int timeout = argc == 6 ? atoi(argv[5]) : WAIT_LED_TIMEOUT;
+
+	for (size_t i = 0; i < sizeof(leds) / sizeof(leds[0]); i++) {
+		if (strcmp(argv[3], leds[i].name) == 0) {
+			get = leds[i].get;
+			break;
+		}
+	}
+	if (get == NULL || (!on && strcmp(argv[4], "off") != 0)) {
+		puts("Unknown LED or state");
+		return -1;
+	}
+
+	for (int waited = 0;; waited += WAIT_LED_POLL) {
+		rv = ch9329_get_info(ch9329, &info);
+		if (rv < 0 || get(&info) == on) {
+			goto out;
+		} else if (waited >= timeout) {
+			puts("Timed out waiting for the LED");
+			rv = -1;
+			goto out;
+		}
+		usleep(WAIT_LED_POLL * 1000);
+	}
+
+out:
+	return rv;
+}
+
+static int
+sleep_ms(struct Ch9329 *ch9329, int argc, char *argv[]) {
+	if (argc != 4) {
+		puts("Usage: ch9329 <DEVICE> sleep MS");
+		return -1;
+	}
+	// The time starts once everything before is on the target.
+	int rv = ch9329_flush(ch9329);
+	if (rv < 0) {
+		goto out;
+	}
+	usleep(atoi(argv[3]) * 1000);
+
+out:
+	return rv;
+}
+
+static int run_batch(struct Ch9329 *ch9329, int argc, char *argv[]);
+
+static int
+run_command(struct Ch9329 *ch9329, int argc, char *argv[]) {
+	int rv = 0;
+
+	if (strcmp(argv[2], "info") == 0) {
+		rv = get_info(ch9329, argc, argv);
+	} else if (strcmp(argv[2], "key") == 0) {
+		rv = send_key(ch9329, argc, argv);
+	} else if (strcmp(argv[2], "mouse_rel") == 0) {
+		rv = send_mouse_rel(ch9329, argc, argv);
+	} else if (strcmp(argv[2], "mouse_abs") == 0) {
+		rv = send_mouse_abs(ch9329, argc, argv);
+	} else if (strcmp(argv[2], "click") == 0) {
+		rv = send_click(ch9329, argc, argv);
+	} else if (strcmp(argv[2], "wheel") == 0) {
+		rv = send_wheel(ch9329, argc, argv);
+	} else if (strcmp(argv[2], "string") == 0) {
+		rv = send_string(ch9329, argc, argv);
+	} else if (strcmp(argv[2], "calibrate") == 0) {
+		rv = calibrate(ch9329, argc, argv);
+	} else if (strcmp(argv[2], "media") == 0) {
+		rv = send_media(ch9329, argc, argv);
+	} else if (strcmp(argv[2], "reset") == 0) {
+		rv = send_reset(ch9329, argc, argv);
+	} else if (strcmp(argv[2], "baud") == 0) {
+		rv = set_baud(ch9329, argc, argv);
+	} else if (strcmp(argv[2], "wait_led") == 0) {
+		rv = wait_led(ch9329, argc, argv);
+	} else if (strcmp(argv[2], "sleep") == 0) {
+		rv = sleep_ms(ch9329, argc, argv);
+	} else if (strcmp(argv[2], "batch") == 0) {
+		rv = run_batch(ch9329, argc, argv);
+	} else {
+		puts("Unknown command");
+		rv = -1;
+	}
+	return rv;
+}
+
+// Splits a script line into words in place. Double quotes keep spaces in a
+// word, a backslash takes the next character as it is and # starts a
+// comment. Returns the number of words, `max` + 1 if there are more, or -1
+// for an unterminated quote.
+static int
+split_line(char *line, char *words[], int max) {
+	int count = 0;
+	char *in = line;
+	char *out = line;
+
+	for (;;) {
+		bool quoted = false;
+		while (*in == ' ' || *in == '\t' || *in == '\r' || *in == '\n') {
+			in++;
+		}
+		if (*in == '\0' || *in == '#') {
+			break;
+		}
+		if (count == max) {
+			return max + 1;
+		}
+
+		words[count++] = out;
+		for (; *in != '\0'; in++) {
+			if (*in == '"') {
+				quoted = !quoted;
+				continue;
+			} else if (!quoted && (*in == ' ' || *in == '\t' ||
+								   *in == '\r' || *in == '\n')) {
+				break;
+			} else if (*in == '\\' && in[1] != '\0') {
+				in++;
+				if (*in == 'n') {
+					*out++ = '\n';
+					continue;
+				} else if (*in == 't') {
+					*out++ = '\t';
+					continue;
+				}
+			}
+			*out++ = *in;
+		}
+		if (quoted) {
+			return -1;
+		}
+		if (*in != '\0') {
+			in++;
+		}
+		*out++ = '\0';
+	}
+	return count;
+}
+
+static void
+batch_done(
+		struct Ch9329 *ch9329, const struct Ch9329Frame *request,
+		enum Ch9329Error error, const struct Ch9329Frame *response,
+		void *userdata) {
+	int *failed = userdata;
+	(void)ch9329;
+	(void)request;
+	(void)response;
+	if (error != CH9329_SUCCESS) {
+		(*failed)++;
+	}
+}
+
+// Runs one command per line over the open port. Reports go out without
+// waiting for the one before to be acknowledged; commands that read
+// something back, and sleep, wait for everything before them first.
+static int
+run_batch(struct Ch9329 *ch9329, int argc, char *argv[]) {
+	if (argc != 3 && argc != 4) {
+		puts("Usage: ch9329 <DEVICE> batch [SCRIPT]");
+		return -1;
+	}
+	int rv = 0;
+	int failed = 0;
+	int line_number = 0;
+	const int timeout = ch9329->timeout;
+	char *line = NULL;
+	size_t size = 0;
+	FILE *script = stdin;
+
+	if (ch9329->window > 0) {
+		puts("Batches can't be nested");
+		return -1;
+	}
+	if (argc == 4 && strcmp(argv[3], "-") != 0) {
+		script = fopen(argv[3], "r");
+		if (script == NULL) {
+			perror(argv[3]);
+			return -1;
+		}
+	}
+
+	ch9329->timeout = BATCH_TIMEOUT;
+	rv = ch9329_pipeline(ch9329, BATCH_WINDOW, batch_done, &failed);
+	while (rv >= 0 && getline(&line, &size, script) >= 0) {
+		char *words[BATCH_WORDS + 2] = {argv[0], argv[1]};
+		int count = split_line(line, &words[2], BATCH_WORDS);
+
+		line_number++;
+		if (count < 0) {
+			printf("Line %d: unterminated quote\n", line_number);
+			rv = -1;
+		} else if (count > BATCH_WORDS) {
+			printf("Line %d: more than %d words\n", line_number,
+				   BATCH_WORDS);
+			rv = -1;
+		} else if (count > 0) {
+			rv = run_command(ch9329, count + 2, words);
+		}
+		if (rv >= 0 && failed > 0) {
+			printf("Line %d: a report up to here wasn't acknowledged\n",
+				   line_number);
+			rv = -1;
+		} else if (rv < 0 && count > 0 && count <= BATCH_WORDS) {
+			printf("Line %d: %s failed\n", line_number, words[2]);
+		}
+	}
+	if (rv >= 0) {
+		rv = ch9329_flush(ch9329);
+	}
+	if (rv >= 0 && failed > 0) {
+		puts("The last reports weren't acknowledged");
+		rv = -1;
+	}
+	ch9329_pipeline(ch9329, 0, NULL, NULL);
+	ch9329->timeout = timeout;
+
+	free(line);
+	if (script != stdin) {
+		fclose(script);
+	}
+	return rv;
+}
+
 int
 main(int argc, char *argv[]) {
 	int rv = 0;
@@ -240,10 +504,18 @@ main(int argc, char *argv[]) {
 		puts("info");
 		puts("mouse_rel X Y");
 		puts("mouse_abs X Y");
+		puts("click BUTTON");
 		puts("wheel WHEEL");
 		puts("key SCAN_CODE");
-		puts("string STRING");
+		puts("media CODE");
+		puts("string STRING [LAYOUT [INTERVAL]]");
+		puts("calibrate");
 		puts("reset");
+		puts("baud [RATE]");
+		puts("sleep MS");
+		puts("wait_led num|caps|scroll on|off [TIMEOUT_MS]");
+		puts("batch [SCRIPT]   runs the commands in SCRIPT or on stdin,");
+		puts("                 one per line");
 		return 1;
 	}
 
@@ -252,28 +524,7 @@ main(int argc, char *argv[]) {
 		goto out;
 	}
 
-	if (strcmp(argv[2], "info") == 0) {
-		rv = get_info(&ch9329, argc, argv);
-	} else if (strcmp(argv[2], "key") == 0) {
-		rv = send_key(&ch9329, argc, argv);
-	} else if (strcmp(argv[2], "mouse_rel") == 0) {
-		rv = send_mouse_rel(&ch9329, argc, argv);
-	} else if (strcmp(argv[2], "mouse_abs") == 0) {
-		rv = send_mouse_abs(&ch9329, argc, argv);
-	} else if (strcmp(argv[2], "click") == 0) {
-		rv = send_click(&ch9329, argc, argv);
-	} else if (strcmp(argv[2], "wheel") == 0) {
-		rv = send_wheel(&ch9329, argc, argv);
-	} else if (strcmp(argv[2], "string") == 0) {
-		rv = send_string(&ch9329, argc, argv);
-	} else if (strcmp(argv[2], "media") == 0) {
-		rv = send_media(&ch9329, argc, argv);
-	} else if (strcmp(argv[2], "reset") == 0) {
-		rv = send_reset(&ch9329, argc, argv);
-	} else {
-		puts("Unknown command");
-		rv = -1;
-	}
+	rv = run_command(&ch9329, argc, argv);
 
 out:
 	ch9329_close(&ch9329);
@@ -8,7 +8,7 @@ mouse_rel(struct Ch9329 *ch9329, int8_t x, int8_t y, int8_t wheel) {
 	};
 	struct Ch9329Frame frame = {0};
 	ch9329_frame(&frame, CH9329_CMD_SEND_MS_REL_DATA, &data, 5);
-	return ch9329_request(ch9329, &frame);
+	return ch9329_report(ch9329, &frame);
 }
 
 int
@@ -21,7 +21,7 @@ ch9329_mouse_abs(struct Ch9329 *ch9329, uint16_t x, uint16_t y) {
 	};
 	struct Ch9329Frame frame = {0};
 	ch9329_frame(&frame, CH9329_CMD_SEND_MS_ABS_DATA, &data, 7);
-	return ch9329_request(ch9329, &frame);
+	return ch9329_report(ch9329, &frame);
 }
 
 int
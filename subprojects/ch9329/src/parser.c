@@ -0,0 +1,116 @@
+#include <assert.h>
+#include <ch9329.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+
+static_assert(
+		(CH9329_RX_SIZE & (CH9329_RX_SIZE - 1)) == 0,
+		"CH9329_RX_SIZE must be a power of two");
+
+#define RX_MASK (CH9329_RX_SIZE - 1)
+
+static unsigned int
+rx_available(const struct Ch9329 *ch9329) {
+	return ch9329->rx_tail - ch9329->rx_head;
+}
+
+static uint8_t
+rx_at(const struct Ch9329 *ch9329, unsigned int offset) {
+	return ch9329->rx[(ch9329->rx_head + offset) & RX_MASK];
+}
+
+static void
+rx_copy(const struct Ch9329 *ch9329, uint8_t *dest, unsigned int offset,
+		unsigned int len) {
+	for (unsigned int i = 0; i < len; i++) {
+		dest[i] = rx_at(ch9329, offset + i);
+	}
+}
+
+int
+ch9329_feed(struct Ch9329 *ch9329, const void *data, int len) {
+	const uint8_t *bytes = data;
+	int fed = 0;
+	for (; fed < len && rx_available(ch9329) < CH9329_RX_SIZE; fed++) {
+		ch9329->rx[ch9329->rx_tail++ & RX_MASK] = bytes[fed];
+	}
+	return fed;
+}
+
+int
+ch9329_fill(struct Ch9329 *ch9329) {
+	struct iovec iov[2];
+	int iovcnt = 0;
+	ssize_t len;
+	const unsigned int space = CH9329_RX_SIZE - rx_available(ch9329);
+	const unsigned int tail = ch9329->rx_tail & RX_MASK;
+
+	if (space == 0) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	// The free space may wrap around the end of the buffer. Fill both parts
+	// with the same syscall.
+	iov[iovcnt].iov_base = &ch9329->rx[tail];
+	iov[iovcnt++].iov_len =
+			space < CH9329_RX_SIZE - tail ? space : CH9329_RX_SIZE - tail;
+	if (iov[0].iov_len < space) {
+		iov[iovcnt].iov_base = ch9329->rx;
+		iov[iovcnt++].iov_len = space - iov[0].iov_len;
+	}
+
+	len = readv(ch9329->fd, iov, iovcnt);
+	if (len > 0) {
+		ch9329->rx_tail += len;
+	}
+	return len;
+}
+
+int
+ch9329_parse(struct Ch9329 *ch9329, struct Ch9329Frame *frame) {
+	const unsigned int header_len = sizeof(frame->header);
+
+	while (rx_available(ch9329) > 0) {
+		unsigned int available = rx_available(ch9329);
+		uint8_t len;
+
+		// Resynchronise on the 0x57 0xAB that starts every frame.
+		if (rx_at(ch9329, 0) != 0x57 ||
+			(available > 1 && rx_at(ch9329, 1) != 0xAB)) {
+			ch9329_skip(ch9329);
+			continue;
+		}
+		if (available < header_len) {
+			break;
+		}
+		len = rx_at(ch9329, 4);
+		if (available < header_len + len + 1) {
+			break;
+		}
+
+		memset(frame, 0, sizeof(struct Ch9329Frame));
+		rx_copy(ch9329, frame->header, 0, header_len);
+		rx_copy(ch9329, frame->data, header_len, len);
+		if (rx_at(ch9329, header_len + len) != ch9329_frame_checksum(frame)) {
+			// Probably a sync pattern inside of some other frame.
+			ch9329_skip(ch9329);
+			continue;
+		}
+
+		ch9329->rx_head += header_len + len + 1;
+		return 1;
+	}
+	return 0;
+}
+
+int
+ch9329_skip(struct Ch9329 *ch9329) {
+	if (rx_available(ch9329) == 0) {
+		return 0;
+	}
+	ch9329->rx_head++;
+	ch9329->rx_dropped++;
+	return 1;
+}
@@ -0,0 +1,431 @@
+#include <ch9329.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t
+now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct Ch9329Pending *
+pending_at(struct Ch9329 *ch9329, int index) {
+	return &ch9329->pending[(ch9329->pending_head + index) % CH9329_QUEUE_SIZE];
+}
+
+static int
+in_flight(const struct Ch9329 *ch9329) {
+	return ch9329->pending_count - ch9329->unsent;
+}
+
+static int
+window_size(const struct Ch9329 *ch9329) {
+	return ch9329->window > 0 ? ch9329->window : 1;
+}
+
+static int
+report_channel(const struct Ch9329Frame *frame) {
+	switch (ch9329_frame_command(frame)) {
+	case CH9329_CMD_SEND_KB_GENERAL_DATA:
+		return CH9329_CHANNEL_KEYBOARD;
+	case CH9329_CMD_SEND_KB_MEDIA_DATA:
+		return ch9329_frame_data(frame)[0] == 0x01 ? CH9329_CHANNEL_ACPI
+												   : CH9329_CHANNEL_MEDIA;
+	case CH9329_CMD_SEND_MS_ABS_DATA:
+		return CH9329_CHANNEL_MOUSE_ABS;
+	case CH9329_CMD_SEND_MS_REL_DATA:
+		return CH9329_CHANNEL_MOUSE_REL;
+	default:
+		return -1;
+	}
+}
+
+// Remembers the report as the channel's state. Returns whether it's the
+// same as the one before.
+static bool
+redundant(struct Ch9329 *ch9329, const struct Ch9329Frame *frame) {
+	const int channel = report_channel(frame);
+	const uint8_t len = ch9329_frame_len(frame);
+	uint8_t report[CH9329_REPORT_SIZE] = {0};
+	bool moves = false;
+	bool same;
+
+	if (channel < 0 || len > CH9329_REPORT_SIZE) {
+		return false;
+	}
+	memcpy(report, ch9329_frame_data(frame), len);
+	if (channel == CH9329_CHANNEL_MOUSE_REL) {
+		// Relative motion adds up, only the buttons are state.
+		moves = report[2] || report[3] || report[4];
+		memset(&report[2], 0, 3);
+	}
+
+	same = !moves && (ch9329->reports_valid & 1u << channel) &&
+			memcmp(ch9329->reports[channel], report, sizeof(report)) == 0;
+	memcpy(ch9329->reports[channel], report, sizeof(report));
+	ch9329->reports_valid |= 1u << channel;
+	return same;
+}
+
+// The report may not have made it, the next one must go out in any case.
+static void
+forget(struct Ch9329 *ch9329, const struct Ch9329Frame *frame) {
+	const int channel = report_channel(frame);
+	if (channel >= 0) {
+		ch9329->reports_valid &= ~(1u << channel);
+	}
+}
+
+// Writes held back commands at once, as many as fit into the window.
+static int
+send_unsent(struct Ch9329 *ch9329) {
+	int rv = 0;
+	const struct Ch9329Frame *frames[CH9329_PIPELINE_SIZE];
+	const int first = in_flight(ch9329);
+	const uint64_t now = now_ms();
+	int count = window_size(ch9329) - first;
+
+	if (count > ch9329->unsent) {
+		count = ch9329->unsent;
+	}
+	if (count <= 0) {
+		goto out;
+	}
+
+	for (int i = 0; i < count; i++) {
+		struct Ch9329Pending *pending = pending_at(ch9329, first + i);
+		frames[i] = &pending->frame;
+		pending->sent_at = now;
+	}
+	rv = ch9329_send_batch(ch9329, frames, count);
+	if (rv < 0) {
+		// The port is gone, nothing is going to acknowledge these.
+		for (int i = 0; i < ch9329->unsent; i++) {
+			struct Ch9329Pending *pending = pending_at(ch9329, first + i);
+			forget(ch9329, &pending->frame);
+			if (pending->callback) {
+				pending->callback(
+						ch9329, &pending->frame, CH9329_ERR_OPERATE, NULL,
+						pending->userdata);
+			}
+		}
+		ch9329->pending_count = first;
+		ch9329->unsent = 0;
+		goto out;
+	}
+	ch9329->unsent -= count;
+out:
+	return rv;
+}
+
+static int
+queue(struct Ch9329 *ch9329, const struct Ch9329Frame *frame,
+	  Ch9329Callback callback, void *userdata, int retries) {
+	struct Ch9329Pending *pending;
+
+	if (ch9329->pending_count == CH9329_QUEUE_SIZE) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	pending = pending_at(ch9329, ch9329->pending_count);
+	memcpy(&pending->frame, frame, sizeof(struct Ch9329Frame));
+	pending->callback = callback;
+	pending->userdata = userdata;
+	pending->retries = retries;
+	ch9329->pending_count++;
+	ch9329->unsent++;
+
+	return ch9329->corked ? 0 : send_unsent(ch9329);
+}
+
+static bool
+same_report(const struct Ch9329Frame *a, const struct Ch9329Frame *b) {
+	const enum Ch9329Command command = ch9329_frame_command(a);
+	if (command != ch9329_frame_command(b)) {
+		return false;
+	}
+
+	switch (command) {
+	case CH9329_CMD_SEND_KB_GENERAL_DATA:
+	case CH9329_CMD_SEND_MS_ABS_DATA:
+		return true;
+	case CH9329_CMD_SEND_KB_MEDIA_DATA:
+		// Media and ACPI keys share the command, but are separate reports.
+		return ch9329_frame_data(a)[0] == ch9329_frame_data(b)[0];
+	default:
+		// Relative reports add up, so none replaces another.
+		return false;
+	}
+}
+
+static bool
+superseded(struct Ch9329 *ch9329, const struct Ch9329Frame *frame) {
+	for (int i = 0; i < ch9329->pending_count; i++) {
+		if (same_report(frame, &pending_at(ch9329, i)->frame)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Completes the oldest pending command. Lost and garbled commands are sent
+// again, unless a later report carrying the full state is already on its way.
+static int
+finish(struct Ch9329 *ch9329, enum Ch9329Error error,
+	   const struct Ch9329Frame *response) {
+	int rv = 0;
+	struct Ch9329Pending pending = *pending_at(ch9329, 0);
+	enum Ch9329Command command = ch9329_frame_command(&pending.frame);
+
+	ch9329->pending_head = (ch9329->pending_head + 1) % CH9329_QUEUE_SIZE;
+	ch9329->pending_count--;
+
+	if ((error == CH9329_ERR_TIMEOUT || error == CH9329_ERR_SUM) &&
+		pending.retries > 0) {
+		if (superseded(ch9329, &pending.frame)) {
+			error = CH9329_SUCCESS;
+			response = NULL;
+		} else {
+			// The retry goes out after everything sent since, so it has
+			// to carry the buttons as they are now.
+			if (command == CH9329_CMD_SEND_MS_ABS_DATA ||
+				command == CH9329_CMD_SEND_MS_REL_DATA) {
+				pending.frame.data[1] = ch9329->mouse_button_state;
+			}
+			return queue(
+					ch9329, &pending.frame, pending.callback, pending.userdata,
+					pending.retries - 1);
+		}
+	}
+
+	if (error != CH9329_SUCCESS) {
+		forget(ch9329, &pending.frame);
+	}
+	if (pending.callback) {
+		pending.callback(
+				ch9329, &pending.frame, error, response, pending.userdata);
+	}
+	return rv;
+}
+
+// Responses come in the order the commands were sent. Commands before the
+// one answered never made it to the chip.
+static int
+dispatch(struct Ch9329 *ch9329, const struct Ch9329Frame *response) {
+	int rv = 0;
+	int index;
+	const uint8_t command = ch9329_frame_command(response) & ~0x40;
+
+	for (index = 0; index < in_flight(ch9329); index++) {
+		if ((ch9329_frame_command(&pending_at(ch9329, index)->frame) | 0x80) ==
+			command) {
+			break;
+		}
+	}
+	if (index == in_flight(ch9329)) {
+		// Unsolicited, nothing is waiting for it.
+		goto out;
+	}
+
+	for (int i = 0; i < index && rv >= 0; i++) {
+		rv = finish(ch9329, CH9329_ERR_TIMEOUT, NULL);
+	}
+	if (rv >= 0) {
+		rv = finish(ch9329, ch9329_frame_error(response), response);
+	}
+out:
+	return rv;
+}
+
+static int
+expire(struct Ch9329 *ch9329) {
+	int rv = 0;
+	while (rv >= 0 && in_flight(ch9329) > 0 && ch9329_timeout(ch9329) == 0) {
+		rv = finish(ch9329, CH9329_ERR_TIMEOUT, NULL);
+	}
+	return rv;
+}
+
+// Blocks until a response arrives or the oldest command times out.
+static int
+collect(struct Ch9329 *ch9329) {
+	int rv = 0;
+	struct Ch9329Frame response;
+
+	// Waiting for an answer to a command that was never sent is pointless.
+	rv = send_unsent(ch9329);
+	if (rv < 0) {
+		goto out;
+	}
+	rv = ch9329_transmit(ch9329, true);
+	if (rv < 0) {
+		goto out;
+	}
+
+	// An earlier read may have brought in more than one response.
+	if (ch9329_parse(ch9329, &response) == 0) {
+		rv = ch9329_wait(ch9329, ch9329_timeout(ch9329));
+		if (rv <= 0) {
+			rv = rv < 0 ? rv : expire(ch9329);
+			goto out;
+		}
+		rv = ch9329_fill(ch9329);
+		if (rv <= 0) {
+			rv = -1;
+			goto out;
+		}
+		if (ch9329_parse(ch9329, &response) == 0) {
+			rv = expire(ch9329);
+			goto out;
+		}
+	}
+
+	rv = dispatch(ch9329, &response);
+out:
+	return rv;
+}
+
+int
+ch9329_pipeline(
+		struct Ch9329 *ch9329, int window, Ch9329Callback callback,
+		void *userdata) {
+	int rv = ch9329_flush(ch9329);
+	if (rv < 0) {
+		goto out;
+	}
+
+	if (window > CH9329_PIPELINE_SIZE) {
+		window = CH9329_PIPELINE_SIZE;
+	} else if (window < 0) {
+		window = 0;
+	}
+	ch9329->window = window;
+	ch9329->callback = callback;
+	ch9329->userdata = userdata;
+out:
+	return rv;
+}
+
+int
+ch9329_submit(
+		struct Ch9329 *ch9329, const struct Ch9329Frame *frame,
+		Ch9329Callback callback, void *userdata) {
+	int rv = 0;
+
+	// Pick up acknowledgements that already arrived. In blocking mode, wait
+	// for room in the window; otherwise the command is queued.
+	rv = ch9329_process(ch9329);
+	while (rv >= 0 && !ch9329->nonblocking &&
+		   ch9329->pending_count >= window_size(ch9329)) {
+		rv = collect(ch9329);
+	}
+	if (rv < 0) {
+		goto out;
+	}
+
+	rv = queue(ch9329, frame, callback, userdata, CH9329_RETRIES);
+out:
+	return rv;
+}
+
+int
+ch9329_report(struct Ch9329 *ch9329, struct Ch9329Frame *frame) {
+	int rv = 0;
+
+	if (redundant(ch9329, frame)) {
+		// Done as far as the caller is concerned, like a superseded report.
+		ch9329->reports_saved++;
+		if (ch9329->window > 0 && ch9329->callback) {
+			ch9329->callback(
+					ch9329, frame, CH9329_SUCCESS, NULL, ch9329->userdata);
+		}
+		goto out;
+	}
+
+	if (ch9329->window > 0) {
+		rv = ch9329_submit(ch9329, frame, ch9329->callback, ch9329->userdata);
+	} else {
+		rv = ch9329_request(ch9329, frame);
+	}
+	if (rv < 0) {
+		forget(ch9329, frame);
+	}
+out:
+	return rv;
+}
+
+int
+ch9329_cork(struct Ch9329 *ch9329) {
+	ch9329->corked = true;
+	return 0;
+}
+
+int
+ch9329_uncork(struct Ch9329 *ch9329) {
+	ch9329->corked = false;
+	return send_unsent(ch9329);
+}
+
+int
+ch9329_flush(struct Ch9329 *ch9329) {
+	int rv = 0;
+	while (rv >= 0 && ch9329->pending_count > 0) {
+		rv = collect(ch9329);
+	}
+	return rv < 0 ? rv : 0;
+}
+
+short
+ch9329_events(const struct Ch9329 *ch9329) {
+	// Always listen: there may be responses or unsolicited frames.
+	return ch9329->tx_len > 0 ? POLLIN | POLLOUT : POLLIN;
+}
+
+int
+ch9329_timeout(const struct Ch9329 *ch9329) {
+	const struct Ch9329Pending *oldest =
+			&ch9329->pending[ch9329->pending_head];
+	int64_t left;
+
+	if (in_flight(ch9329) == 0 || ch9329->timeout <= 0) {
+		return -1;
+	}
+	left = (int64_t)(oldest->sent_at + ch9329->timeout - now_ms());
+	return left > 0 ? (int)left : 0;
+}
+
+int
+ch9329_process(struct Ch9329 *ch9329) {
+	int rv = 0;
+	struct Ch9329Frame response;
+
+	rv = ch9329_transmit(ch9329, false);
+	if (rv < 0) {
+		goto out;
+	}
+
+	if (ch9329_wait(ch9329, 0) > 0) {
+		// Readable but nothing to read means the port is gone.
+		rv = ch9329_fill(ch9329);
+		if (rv == 0 || (rv < 0 && errno != EAGAIN)) {
+			rv = -1;
+			goto out;
+		}
+	}
+
+	rv = 0;
+	while (rv >= 0 && ch9329_parse(ch9329, &response) > 0) {
+		rv = dispatch(ch9329, &response);
+	}
+	if (rv >= 0) {
+		rv = expire(ch9329);
+	}
+	if (rv >= 0 && !ch9329->corked) {
+		rv = send_unsent(ch9329);
+	}
+out:
+	return rv < 0 ? rv : 0;
+}
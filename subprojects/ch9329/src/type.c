@@ -0,0 +1,773 @@
+#include "ch9329.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+// Caps Lock taps per interval tried, even so it ends up as it was.
+#define CALIBRATE_ROUNDS 4
+// How long the host gets to switch the LED.
+#define CALIBRATE_TIMEOUT 100
+#define CALIBRATE_POLL 5
+
+#define SHIFT 0x02
+#define ALTGR 0x40
+#define CAPS_LOCK 0x39
+
+// Caps Lock swaps the shift state of the key.
+#define LETTER (1 << 0)
+// A dead key, the accent is only typed with the next key.
+#define DEAD (1 << 1)
+
+// Keys and their dead keys are looked up by the character they type. Dead
+// keys are listed under the combining form of their accent.
+struct KeyMapping {
+	uint32_t codepoint;
+	uint8_t modifiers;
+	uint8_t scan_code;
+	uint8_t flags;
+};
+
+// A character typed as a dead key followed by another key.
+struct Composition {
+	uint32_t codepoint;
+	uint32_t accent;
+	uint32_t base;
+};
+
+static const struct KeyMapping us_keys[] = {
+		{'a', 0, 0x04, LETTER},
+		{'A', SHIFT, 0x04, LETTER},
+		{'b', 0, 0x05, LETTER},
+		{'B', SHIFT, 0x05, LETTER},
+		{'c', 0, 0x06, LETTER},
+		{'C', SHIFT, 0x06, LETTER},
+		{'d', 0, 0x07, LETTER},
+		{'D', SHIFT, 0x07, LETTER},
+		{'e', 0, 0x08, LETTER},
+		{'E', SHIFT, 0x08, LETTER},
+		{'f', 0, 0x09, LETTER},
+		{'F', SHIFT, 0x09, LETTER},
+		{'g', 0, 0x0a, LETTER},
+		{'G', SHIFT, 0x0a, LETTER},
+		{'h', 0, 0x0b, LETTER},
+		{'H', SHIFT, 0x0b, LETTER},
+		{'i', 0, 0x0c, LETTER},
+		{'I', SHIFT, 0x0c, LETTER},
+		{'j', 0, 0x0d, LETTER},
+		{'J', SHIFT, 0x0d, LETTER},
+		{'k', 0, 0x0e, LETTER},
+		{'K', SHIFT, 0x0e, LETTER},
+		{'l', 0, 0x0f, LETTER},
+		{'L', SHIFT, 0x0f, LETTER},
+		{'m', 0, 0x10, LETTER},
+		{'M', SHIFT, 0x10, LETTER},
+		{'n', 0, 0x11, LETTER},
+		{'N', SHIFT, 0x11, LETTER},
+		{'o', 0, 0x12, LETTER},
+		{'O', SHIFT, 0x12, LETTER},
+		{'p', 0, 0x13, LETTER},
+		{'P', SHIFT, 0x13, LETTER},
+		{'q', 0, 0x14, LETTER},
+		{'Q', SHIFT, 0x14, LETTER},
+		{'r', 0, 0x15, LETTER},
+		{'R', SHIFT, 0x15, LETTER},
+		{'s', 0, 0x16, LETTER},
+		{'S', SHIFT, 0x16, LETTER},
+		{'t', 0, 0x17, LETTER},
+		{'T', SHIFT, 0x17, LETTER},
+		{'u', 0, 0x18, LETTER},
+		{'U', SHIFT, 0x18, LETTER},
+		{'v', 0, 0x19, LETTER},
+		{'V', SHIFT, 0x19, LETTER},
+		{'w', 0, 0x1a, LETTER},
+		{'W', SHIFT, 0x1a, LETTER},
+		{'x', 0, 0x1b, LETTER},
+		{'X', SHIFT, 0x1b, LETTER},
+		{'y', 0, 0x1c, LETTER},
+		{'Y', SHIFT, 0x1c, LETTER},
+		{'z', 0, 0x1d, LETTER},
+		{'Z', SHIFT, 0x1d, LETTER},
+		{'1', 0, 0x1e, 0},
+		{'2', 0, 0x1f, 0},
+		{'3', 0, 0x20, 0},
+		{'4', 0, 0x21, 0},
+		{'5', 0, 0x22, 0},
+		{'6', 0, 0x23, 0},
+		{'7', 0, 0x24, 0},
+		{'8', 0, 0x25, 0},
+		{'9', 0, 0x26, 0},
+		{'0', 0, 0x27, 0},
+		{'!', SHIFT, 0x1e, 0},
+		{'@', SHIFT, 0x1f, 0},
+		{'#', SHIFT, 0x20, 0},
+		{'$', SHIFT, 0x21, 0},
+		{'%', SHIFT, 0x22, 0},
+		{'^', SHIFT, 0x23, 0},
+		{'&', SHIFT, 0x24, 0},
+		{'*', SHIFT, 0x25, 0},
+		{'(', SHIFT, 0x26, 0},
+		{')', SHIFT, 0x27, 0},
+		{'-', 0, 0x2d, 0},
+		{'_', SHIFT, 0x2d, 0},
+		{'=', 0, 0x2e, 0},
+		{'+', SHIFT, 0x2e, 0},
+		{'[', 0, 0x2f, 0},
+		{'{', SHIFT, 0x2f, 0},
+		{']', 0, 0x30, 0},
+		{'}', SHIFT, 0x30, 0},
+		{'\\', 0, 0x31, 0},
+		{'|', SHIFT, 0x31, 0},
+		{';', 0, 0x33, 0},
+		{':', SHIFT, 0x33, 0},
+		{'\'', 0, 0x34, 0},
+		{'"', SHIFT, 0x34, 0},
+		{'`', 0, 0x35, 0},
+		{'~', SHIFT, 0x35, 0},
+		{',', 0, 0x36, 0},
+		{'<', SHIFT, 0x36, 0},
+		{'.', 0, 0x37, 0},
+		{'>', SHIFT, 0x37, 0},
+		{'/', 0, 0x38, 0},
+		{'?', SHIFT, 0x38, 0},
+		{'\n', 0, 0x28, 0},
+		{'\t', 0, 0x2b, 0},
+		{' ', 0, 0x2c, 0},
+		{0},
+};
+
+static const struct KeyMapping de_keys[] = {
+		{'a', 0, 0x04, LETTER},
+		{'A', SHIFT, 0x04, LETTER},
+		{'b', 0, 0x05, LETTER},
+		{'B', SHIFT, 0x05, LETTER},
+		{'c', 0, 0x06, LETTER},
+		{'C', SHIFT, 0x06, LETTER},
+		{'d', 0, 0x07, LETTER},
+		{'D', SHIFT, 0x07, LETTER},
+		{'e', 0, 0x08, LETTER},
+		{'E', SHIFT, 0x08, LETTER},
+		{'f', 0, 0x09, LETTER},
+		{'F', SHIFT, 0x09, LETTER},
+		{'g', 0, 0x0a, LETTER},
+		{'G', SHIFT, 0x0a, LETTER},
+		{'h', 0, 0x0b, LETTER},
+		{'H', SHIFT, 0x0b, LETTER},
+		{'i', 0, 0x0c, LETTER},
+		{'I', SHIFT, 0x0c, LETTER},
+		{'j', 0, 0x0d, LETTER},
+		{'J', SHIFT, 0x0d, LETTER},
+		{'k', 0, 0x0e, LETTER},
+		{'K', SHIFT, 0x0e, LETTER},
+		{'l', 0, 0x0f, LETTER},
+		{'L', SHIFT, 0x0f, LETTER},
+		{'m', 0, 0x10, LETTER},
+		{'M', SHIFT, 0x10, LETTER},
+		{'n', 0, 0x11, LETTER},
+		{'N', SHIFT, 0x11, LETTER},
+		{'o', 0, 0x12, LETTER},
+		{'O', SHIFT, 0x12, LETTER},
+		{'p', 0, 0x13, LETTER},
+		{'P', SHIFT, 0x13, LETTER},
+		{'q', 0, 0x14, LETTER},
+		{'Q', SHIFT, 0x14, LETTER},
+		{'r', 0, 0x15, LETTER},
+		{'R', SHIFT, 0x15, LETTER},
+		{'s', 0, 0x16, LETTER},
+		{'S', SHIFT, 0x16, LETTER},
+		{'t', 0, 0x17, LETTER},
+		{'T', SHIFT, 0x17, LETTER},
+		{'u', 0, 0x18, LETTER},
+		{'U', SHIFT, 0x18, LETTER},
+		{'v', 0, 0x19, LETTER},
+		{'V', SHIFT, 0x19, LETTER},
+		{'w', 0, 0x1a, LETTER},
+		{'W', SHIFT, 0x1a, LETTER},
+		{'x', 0, 0x1b, LETTER},
+		{'X', SHIFT, 0x1b, LETTER},
+		{'y', 0, 0x1d, LETTER},
+		{'Y', SHIFT, 0x1d, LETTER},
+		{'z', 0, 0x1c, LETTER},
+		{'Z', SHIFT, 0x1c, LETTER},
+		{0x00e4 /* ä */, 0, 0x34, LETTER},
+		{0x00c4 /* Ä */, SHIFT, 0x34, LETTER},
+		{0x00f6 /* ö */, 0, 0x33, LETTER},
+		{0x00d6 /* Ö */, SHIFT, 0x33, LETTER},
+		{0x00fc /* ü */, 0, 0x2f, LETTER},
+		{0x00dc /* Ü */, SHIFT, 0x2f, LETTER},
+		{'1', 0, 0x1e, 0},
+		{'2', 0, 0x1f, 0},
+		{'3', 0, 0x20, 0},
+		{'4', 0, 0x21, 0},
+		{'5', 0, 0x22, 0},
+		{'6', 0, 0x23, 0},
+		{'7', 0, 0x24, 0},
+		{'8', 0, 0x25, 0},
+		{'9', 0, 0x26, 0},
+		{'0', 0, 0x27, 0},
+		{'!', SHIFT, 0x1e, 0},
+		{'"', SHIFT, 0x1f, 0},
+		{0x00a7 /* § */, SHIFT, 0x20, 0},
+		{'$', SHIFT, 0x21, 0},
+		{'%', SHIFT, 0x22, 0},
+		{'&', SHIFT, 0x23, 0},
+		{'/', SHIFT, 0x24, 0},
+		{'(', SHIFT, 0x25, 0},
+		{')', SHIFT, 0x26, 0},
+		{'=', SHIFT, 0x27, 0},
+		{0x00b2 /* ² */, ALTGR, 0x1f, 0},
+		{0x00b3 /* ³ */, ALTGR, 0x20, 0},
+		{'{', ALTGR, 0x24, 0},
+		{'[', ALTGR, 0x25, 0},
+		{']', ALTGR, 0x26, 0},
+		{'}', ALTGR, 0x27, 0},
+		{'\\', ALTGR, 0x2d, 0},
+		{'~', ALTGR, 0x30, 0},
+		{'|', ALTGR, 0x64, 0},
+		{'@', ALTGR, 0x14, 0},
+		{0x20ac /* € */, ALTGR, 0x08, 0},
+		{0x00b5 /* µ */, ALTGR, 0x10, 0},
+		{0x00df /* ß */, 0, 0x2d, 0},
+		{'?', SHIFT, 0x2d, 0},
+		{'+', 0, 0x30, 0},
+		{'*', SHIFT, 0x30, 0},
+		{'#', 0, 0x32, 0},
+		{'\'', SHIFT, 0x32, 0},
+		{',', 0, 0x36, 0},
+		{';', SHIFT, 0x36, 0},
+		{'.', 0, 0x37, 0},
+		{':', SHIFT, 0x37, 0},
+		{'-', 0, 0x38, 0},
+		{'_', SHIFT, 0x38, 0},
+		{'<', 0, 0x64, 0},
+		{'>', SHIFT, 0x64, 0},
+		{0x00b0 /* ° */, SHIFT, 0x35, 0},
+		{'\n', 0, 0x28, 0},
+		{'\t', 0, 0x2b, 0},
+		{' ', 0, 0x2c, 0},
+		{0x0302, 0, 0x35, DEAD},
+		{0x0301, 0, 0x2e, DEAD},
+		{0x0300, SHIFT, 0x2e, DEAD},
+		{0},
+};
+
+static const struct KeyMapping fr_keys[] = {
+		{'a', 0, 0x14, LETTER},
+		{'A', SHIFT, 0x14, LETTER},
+		{'b', 0, 0x05, LETTER},
+		{'B', SHIFT, 0x05, LETTER},
+		{'c', 0, 0x06, LETTER},
+		{'C', SHIFT, 0x06, LETTER},
+		{'d', 0, 0x07, LETTER},
+		{'D', SHIFT, 0x07, LETTER},
+		{'e', 0, 0x08, LETTER},
+		{'E', SHIFT, 0x08, LETTER},
+		{'f', 0, 0x09, LETTER},
+		{'F', SHIFT, 0x09, LETTER},
+		{'g', 0, 0x0a, LETTER},
+		{'G', SHIFT, 0x0a, LETTER},
+		{'h', 0, 0x0b, LETTER},
+		{'H', SHIFT, 0x0b, LETTER},
+		{'i', 0, 0x0c, LETTER},
+		{'I', SHIFT, 0x0c, LETTER},
+		{'j', 0, 0x0d, LETTER},
+		{'J', SHIFT, 0x0d, LETTER},
+		{'k', 0, 0x0e, LETTER},
+		{'K', SHIFT, 0x0e, LETTER},
+		{'l', 0, 0x0f, LETTER},
+		{'L', SHIFT, 0x0f, LETTER},
+		{'m', 0, 0x33, LETTER},
+		{'M', SHIFT, 0x33, LETTER},
+		{'n', 0, 0x11, LETTER},
+		{'N', SHIFT, 0x11, LETTER},
+		{'o', 0, 0x12, LETTER},
+		{'O', SHIFT, 0x12, LETTER},
+		{'p', 0, 0x13, LETTER},
+		{'P', SHIFT, 0x13, LETTER},
+		{'q', 0, 0x04, LETTER},
+		{'Q', SHIFT, 0x04, LETTER},
+		{'r', 0, 0x15, LETTER},
+		{'R', SHIFT, 0x15, LETTER},
+		{'s', 0, 0x16, LETTER},
+		{'S', SHIFT, 0x16, LETTER},
+		{'t', 0, 0x17, LETTER},
+		{'T', SHIFT, 0x17, LETTER},
+		{'u', 0, 0x18, LETTER},
+		{'U', SHIFT, 0x18, LETTER},
+		{'v', 0, 0x19, LETTER},
+		{'V', SHIFT, 0x19, LETTER},
+		{'w', 0, 0x1d, LETTER},
+		{'W', SHIFT, 0x1d, LETTER},
+		{'x', 0, 0x1b, LETTER},
+		{'X', SHIFT, 0x1b, LETTER},
+		{'y', 0, 0x1c, LETTER},
+		{'Y', SHIFT, 0x1c, LETTER},
+		{'z', 0, 0x1a, LETTER},
+		{'Z', SHIFT, 0x1a, LETTER},
+		{'1', SHIFT, 0x1e, 0},
+		{'2', SHIFT, 0x1f, 0},
+		{'3', SHIFT, 0x20, 0},
+		{'4', SHIFT, 0x21, 0},
+		{'5', SHIFT, 0x22, 0},
+		{'6', SHIFT, 0x23, 0},
+		{'7', SHIFT, 0x24, 0},
+		{'8', SHIFT, 0x25, 0},
+		{'9', SHIFT, 0x26, 0},
+		{'0', SHIFT, 0x27, 0},
+		{'&', 0, 0x1e, 0},
+		{0x00e9 /* é */, 0, 0x1f, 0},
+		{'"', 0, 0x20, 0},
+		{'\'', 0, 0x21, 0},
+		{'(', 0, 0x22, 0},
+		{'-', 0, 0x23, 0},
+		{0x00e8 /* è */, 0, 0x24, 0},
+		{'_', 0, 0x25, 0},
+		{0x00e7 /* ç */, 0, 0x26, 0},
+		{0x00e0 /* à */, 0, 0x27, 0},
+		{'#', ALTGR, 0x20, 0},
+		{'{', ALTGR, 0x21, 0},
+		{'[', ALTGR, 0x22, 0},
+		{'|', ALTGR, 0x23, 0},
+		{'\\', ALTGR, 0x25, 0},
+		{'^', ALTGR, 0x26, 0},
+		{'@', ALTGR, 0x27, 0},
+		{']', ALTGR, 0x2d, 0},
+		{'}', ALTGR, 0x2e, 0},
+		{0x00a4 /* ¤ */, ALTGR, 0x30, 0},
+		{0x20ac /* € */, ALTGR, 0x08, 0},
+		{')', 0, 0x2d, 0},
+		{0x00b0 /* ° */, SHIFT, 0x2d, 0},
+		{'=', 0, 0x2e, 0},
+		{'+', SHIFT, 0x2e, 0},
+		{'$', 0, 0x30, 0},
+		{0x00a3 /* £ */, SHIFT, 0x30, 0},
+		{0x00f9 /* ù */, 0, 0x34, 0},
+		{'%', SHIFT, 0x34, 0},
+		{'*', 0, 0x32, 0},
+		{0x00b5 /* µ */, SHIFT, 0x32, 0},
+		{',', 0, 0x10, 0},
+		{'?', SHIFT, 0x10, 0},
+		{';', 0, 0x36, 0},
+		{'.', SHIFT, 0x36, 0},
+		{':', 0, 0x37, 0},
+		{'/', SHIFT, 0x37, 0},
+		{'!', 0, 0x38, 0},
+		{0x00a7 /* § */, SHIFT, 0x38, 0},
+		{'<', 0, 0x64, 0},
+		{'>', SHIFT, 0x64, 0},
+		{0x00b2 /* ² */, 0, 0x35, 0},
+		{'\n', 0, 0x28, 0},
+		{'\t', 0, 0x2b, 0},
+		{' ', 0, 0x2c, 0},
+		{0x0302, 0, 0x2f, DEAD},
+		{0x0308, SHIFT, 0x2f, DEAD},
+		{0x0303, ALTGR, 0x1f, DEAD},
+		{0x0300, ALTGR, 0x24, DEAD},
+		{0},
+};
+
+static const struct Composition de_compositions[] = {
+		{0x00e2 /* â */, 0x0302, 'a'},
+		{0x00c2 /* Â */, 0x0302, 'A'},
+		{0x00ea /* ê */, 0x0302, 'e'},
+		{0x00ca /* Ê */, 0x0302, 'E'},
+		{0x00ee /* î */, 0x0302, 'i'},
+		{0x00ce /* Î */, 0x0302, 'I'},
+		{0x00f4 /* ô */, 0x0302, 'o'},
+		{0x00d4 /* Ô */, 0x0302, 'O'},
+		{0x00fb /* û */, 0x0302, 'u'},
+		{0x00db /* Û */, 0x0302, 'U'},
+		{'^', 0x0302, ' '},
+		{0x00e1 /* á */, 0x0301, 'a'},
+		{0x00c1 /* Á */, 0x0301, 'A'},
+		{0x00e9 /* é */, 0x0301, 'e'},
+		{0x00c9 /* É */, 0x0301, 'E'},
+		{0x00ed /* í */, 0x0301, 'i'},
+		{0x00cd /* Í */, 0x0301, 'I'},
+		{0x00f3 /* ó */, 0x0301, 'o'},
+		{0x00d3 /* Ó */, 0x0301, 'O'},
+		{0x00fa /* ú */, 0x0301, 'u'},
+		{0x00da /* Ú */, 0x0301, 'U'},
+		{0x00b4 /* ´ */, 0x0301, ' '},
+		{0x00e0 /* à */, 0x0300, 'a'},
+		{0x00c0 /* À */, 0x0300, 'A'},
+		{0x00e8 /* è */, 0x0300, 'e'},
+		{0x00c8 /* È */, 0x0300, 'E'},
+		{0x00ec /* ì */, 0x0300, 'i'},
+		{0x00cc /* Ì */, 0x0300, 'I'},
+		{0x00f2 /* ò */, 0x0300, 'o'},
+		{0x00d2 /* Ò */, 0x0300, 'O'},
+		{0x00f9 /* ù */, 0x0300, 'u'},
+		{0x00d9 /* Ù */, 0x0300, 'U'},
+		{'`', 0x0300, ' '},
+		{0},
+};
+
+static const struct Composition fr_compositions[] = {
+		{0x00e2 /* â */, 0x0302, 'a'},
+		{0x00c2 /* Â */, 0x0302, 'A'},
+		{0x00ea /* ê */, 0x0302, 'e'},
+		{0x00ca /* Ê */, 0x0302, 'E'},
+		{0x00ee /* î */, 0x0302, 'i'},
+		{0x00ce /* Î */, 0x0302, 'I'},
+		{0x00f4 /* ô */, 0x0302, 'o'},
+		{0x00d4 /* Ô */, 0x0302, 'O'},
+		{0x00fb /* û */, 0x0302, 'u'},
+		{0x00db /* Û */, 0x0302, 'U'},
+		{0x00e4 /* ä */, 0x0308, 'a'},
+		{0x00c4 /* Ä */, 0x0308, 'A'},
+		{0x00eb /* ë */, 0x0308, 'e'},
+		{0x00cb /* Ë */, 0x0308, 'E'},
+		{0x00ef /* ï */, 0x0308, 'i'},
+		{0x00cf /* Ï */, 0x0308, 'I'},
+		{0x00f6 /* ö */, 0x0308, 'o'},
+		{0x00d6 /* Ö */, 0x0308, 'O'},
+		{0x00fc /* ü */, 0x0308, 'u'},
+		{0x00dc /* Ü */, 0x0308, 'U'},
+		{0x00ff /* ÿ */, 0x0308, 'y'},
+		{0x0178 /* Ÿ */, 0x0308, 'Y'},
+		{0x00a8 /* ¨ */, 0x0308, ' '},
+		{0x00e3 /* ã */, 0x0303, 'a'},
+		{0x00c3 /* Ã */, 0x0303, 'A'},
+		{0x00f1 /* ñ */, 0x0303, 'n'},
+		{0x00d1 /* Ñ */, 0x0303, 'N'},
+		{0x00f5 /* õ */, 0x0303, 'o'},
+		{0x00d5 /* Õ */, 0x0303, 'O'},
+		{'~', 0x0303, ' '},
+		{0x00c0 /* À */, 0x0300, 'A'},
+		{0x00c8 /* È */, 0x0300, 'E'},
+		{0x00ec /* ì */, 0x0300, 'i'},
+		{0x00cc /* Ì */, 0x0300, 'I'},
+		{0x00f2 /* ò */, 0x0300, 'o'},
+		{0x00d2 /* Ò */, 0x0300, 'O'},
+		{0x00d9 /* Ù */, 0x0300, 'U'},
+		{'`', 0x0300, ' '},
+		{0},
+};
+
+static const struct Composition no_compositions[] = {
+		{0},
+};
+
+static const struct {
+	const char *name;
+	const struct KeyMapping *keys;
+	const struct Composition *compositions;
+} layouts[] = {
+		[CH9329_LAYOUT_US] = {"us", us_keys, no_compositions},
+		[CH9329_LAYOUT_DE] = {"de", de_keys, de_compositions},
+		[CH9329_LAYOUT_FR] = {"fr", fr_keys, fr_compositions},
+};
+
+static uint64_t
+now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static const struct KeyMapping *
+find_key(enum Ch9329Layout layout, uint32_t codepoint) {
+	for (const struct KeyMapping *key = layouts[layout].keys; key->codepoint;
+		 key++) {
+		if (key->codepoint == codepoint) {
+			return key;
+		}
+	}
+	return NULL;
+}
+
+static struct Ch9329Keystroke
+keystroke(const struct Ch9329Typist *typist, const struct KeyMapping *key) {
+	struct Ch9329Keystroke stroke = {key->modifiers, key->scan_code};
+	if (typist->caps_lock && (key->flags & LETTER)) {
+		stroke.modifiers ^= SHIFT;
+	}
+	return stroke;
+}
+
+// Decodes the next UTF-8 sequence. Broken ones come out as U+FFFD, which no
+// layout has a key for.
+static uint32_t
+next_codepoint(const char *text, size_t *pos) {
+	const uint8_t *bytes = (const uint8_t *)text + *pos;
+	uint32_t codepoint;
+	int len;
+
+	if (bytes[0] < 0x80) {
+		codepoint = bytes[0];
+		len = 1;
+	} else if ((bytes[0] & 0xe0) == 0xc0) {
+		codepoint = bytes[0] & 0x1f;
+		len = 2;
+	} else if ((bytes[0] & 0xf0) == 0xe0) {
+		codepoint = bytes[0] & 0x0f;
+		len = 3;
+	} else if ((bytes[0] & 0xf8) == 0xf0) {
+		codepoint = bytes[0] & 0x07;
+		len = 4;
+	} else {
+		*pos += 1;
+		return 0xfffd;
+	}
+
+	for (int i = 1; i < len; i++) {
+		if ((bytes[i] & 0xc0) != 0x80) {
+			*pos += i;
+			return 0xfffd;
+		}
+		codepoint = codepoint << 6 | (bytes[i] & 0x3f);
+	}
+	*pos += len;
+	return codepoint;
+}
+
+int
+ch9329_layout_keystrokes(
+		enum Ch9329Layout layout, uint32_t codepoint, bool caps_lock,
+		struct Ch9329Keystroke strokes[2]) {
+	const struct Ch9329Typist typist = {.caps_lock = caps_lock};
+	const struct KeyMapping *key = NULL;
+	const struct KeyMapping *accent = NULL;
+
+	// Both line ending conventions end up as one Enter.
+	if (codepoint == '\r') {
+		codepoint = '\n';
+	}
+
+	key = find_key(layout, codepoint);
+	if (key && !(key->flags & DEAD)) {
+		strokes[0] = keystroke(&typist, key);
+		return 1;
+	}
+
+	for (const struct Composition *composition =
+				 layouts[layout].compositions;
+		 composition->codepoint; composition++) {
+		if (composition->codepoint == codepoint) {
+			accent = find_key(layout, composition->accent);
+			key = find_key(layout, composition->base);
+			break;
+		}
+	}
+	if (!accent || !key) {
+		return 0;
+	}
+	strokes[0] = keystroke(&typist, accent);
+	strokes[1] = keystroke(&typist, key);
+	return 2;
+}
+
+int
+ch9329_layout_from_name(const char *name) {
+	for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+		if (strcmp(name, layouts[i].name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void
+ch9329_typist_init(
+		struct Ch9329Typist *typist, enum Ch9329Layout layout,
+		const char *text, int interval, bool caps_lock) {
+	memset(typist, 0, sizeof(struct Ch9329Typist));
+	typist->layout = layout;
+	typist->text = text;
+	typist->interval = interval > 0 ? interval : CH9329_TYPE_INTERVAL;
+	typist->caps_lock = caps_lock;
+}
+
+// Sends the keys in one report: the modifiers come down with the key.
+static int
+send_keys(
+		struct Ch9329 *ch9329, struct Ch9329Typist *typist,
+		struct Ch9329Keystroke stroke) {
+	struct Ch9329Frame frame = {0};
+	int rv = 0;
+
+	memset(ch9329->keyboard_state, 0, sizeof(ch9329->keyboard_state));
+	ch9329->keyboard_state[0] = stroke.modifiers;
+	ch9329->keyboard_state[2] = stroke.scan_code;
+	ch9329_frame(
+			&frame, CH9329_CMD_SEND_KB_GENERAL_DATA, ch9329->keyboard_state, 8);
+	rv = ch9329_report(ch9329, &frame);
+	if (rv >= 0) {
+		typist->held = stroke.scan_code;
+		typist->reports++;
+	}
+	return rv;
+}
+
+int
+ch9329_typist_step(struct Ch9329 *ch9329, struct Ch9329Typist *typist) {
+	const uint64_t now = now_ms();
+	struct Ch9329Keystroke stroke = {0};
+	int rv = 0;
+
+	if (now < typist->next_at) {
+		return (int)(typist->next_at - now);
+	}
+
+	while (typist->stroke == typist->stroke_count &&
+		   typist->text[typist->pos] != '\0') {
+		const uint32_t codepoint = next_codepoint(typist->text, &typist->pos);
+		typist->stroke = 0;
+		typist->stroke_count = ch9329_layout_keystrokes(
+				typist->layout, codepoint, typist->caps_lock, typist->strokes);
+		if (typist->stroke_count == 0) {
+			typist->unmapped++;
+		} else {
+			typist->typed++;
+		}
+	}
+
+	if (typist->stroke < typist->stroke_count) {
+		stroke = typist->strokes[typist->stroke];
+		// The target only sees a key again once it was up. Any other key
+		// replaces the one held in the same report.
+		if (stroke.scan_code != typist->held) {
+			typist->stroke++;
+		} else {
+			stroke = (struct Ch9329Keystroke){0};
+		}
+	} else if (typist->held == 0) {
+		return 0;
+	}
+
+	rv = send_keys(ch9329, typist, stroke);
+	if (rv < 0 && errno == EAGAIN) {
+		// The queue is full, try again once it drained a bit.
+		if (stroke.scan_code != 0) {
+			typist->stroke--;
+		}
+		return 1;
+	} else if (rv < 0) {
+		return rv;
+	}
+
+	// The host only polls the keyboard every so often. A report replaced
+	// before that is never seen.
+	typist->next_at = now + typist->interval;
+	return typist->interval;
+}
+
+int
+ch9329_type(
+		struct Ch9329 *ch9329, enum Ch9329Layout layout, const char *text,
+		int interval) {
+	struct Ch9329Typist typist;
+	struct Ch9329Frame info = {0};
+	int rv = 0;
+
+	rv = ch9329_get_info(ch9329, &info);
+	if (rv < 0) {
+		goto out;
+	}
+	ch9329_typist_init(
+			&typist, layout, text, interval, ch9329_info_caps_lock(&info));
+
+	while ((rv = ch9329_typist_step(ch9329, &typist)) > 0) {
+		usleep(rv * 1000);
+	}
+	if (rv < 0) {
+		goto out;
+	}
+	rv = ch9329_flush(ch9329);
+	if (rv < 0) {
+		goto out;
+	}
+	rv = typist.unmapped;
+out:
+	return rv;
+}
+
+// Waits for Caps Lock to change, which the host signals through the LEDs.
+static int
+wait_caps_lock(struct Ch9329 *ch9329, bool caps_lock) {
+	struct Ch9329Frame info = {0};
+	int rv = 0;
+
+	for (int waited = 0; waited < CALIBRATE_TIMEOUT;
+		 waited += CALIBRATE_POLL) {
+		rv = ch9329_get_info(ch9329, &info);
+		if (rv < 0) {
+			return rv;
+		} else if (ch9329_info_caps_lock(&info) == caps_lock) {
+			return 1;
+		}
+		usleep(CALIBRATE_POLL * 1000);
+	}
+	return 0;
+}
+
+// Taps Caps Lock, holding it down for interval.
+static int
+tap_caps_lock(struct Ch9329 *ch9329, int interval) {
+	struct Ch9329Typist typist = {0};
+	int rv = 0;
+
+	rv = send_keys(ch9329, &typist, (struct Ch9329Keystroke){0, CAPS_LOCK});
+	if (rv >= 0) {
+		usleep(interval * 1000);
+		rv = send_keys(ch9329, &typist, (struct Ch9329Keystroke){0});
+	}
+	if (rv >= 0) {
+		rv = ch9329_flush(ch9329);
+	}
+	return rv;
+}
+
+int
+ch9329_type_calibrate(struct Ch9329 *ch9329) {
+	static const int intervals[] = {1, 2, 4, 8, 16, 32};
+	struct Ch9329Frame info = {0};
+	bool caps_lock;
+	int rv = 0;
+
+	rv = ch9329_get_info(ch9329, &info);
+	if (rv < 0) {
+		goto out;
+	}
+	caps_lock = ch9329_info_caps_lock(&info);
+
+	for (size_t i = 0; i < sizeof(intervals) / sizeof(intervals[0]); i++) {
+		int round;
+
+		// A press the host never saw doesn't toggle Caps Lock. An even
+		// number of rounds leaves it as it was.
+		for (round = 0; round < CALIBRATE_ROUNDS; round++) {
+			rv = tap_caps_lock(ch9329, intervals[i]);
+			if (rv >= 0) {
+				rv = wait_caps_lock(ch9329, caps_lock ^ !(round & 1));
+			}
+			if (rv <= 0) {
+				break;
+			}
+		}
+		if (rv < 0) {
+			goto out;
+		} else if (round == CALIBRATE_ROUNDS) {
+			rv = intervals[i];
+			goto out;
+		}
+
+		// Put it back the slow way before trying the next interval.
+		rv = ch9329_get_info(ch9329, &info);
+		if (rv >= 0 && ch9329_info_caps_lock(&info) != caps_lock) {
+			rv = tap_caps_lock(ch9329, CALIBRATE_TIMEOUT);
+			if (rv >= 0) {
+				rv = wait_caps_lock(ch9329, caps_lock);
+			}
+		}
+		if (rv < 0) {
+			goto out;
+		}
+	}
+
+	// The target doesn't show Caps Lock, or doesn't take keys at all.
+	errno = ETIMEDOUT;
+	rv = -1;
+out:
+	return rv;
+}